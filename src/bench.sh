@@ -0,0 +1,274 @@
+#! /bin/sh
+#
+# bench.sh -- loopback throughput benchmark of the netcat binary
+# Part of the GNU netcat project
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# Usage: bench.sh [NETCAT]   (or "make bench" from the build tree)
+#
+# Moves a payload over loopback in each mode (connect, listen, tunnel and
+# UDP), for each payload size and set of options, and reports the throughput,
+# the CPU time used by all the netcat processes per GB moved, and the system
+# calls (reads, writes and event waits, as counted by netcat itself) per MB.
+# The numbers of every run are also appended to a file, one JSON object per
+# line tagged with the git revision, so that runs can be compared across
+# commits.  The environment can change the defaults:
+#
+#   BENCH_MODES     modes to run (connect listen tunnel udp)
+#   BENCH_SIZES     payload sizes, with k, M or G suffixes (1M 16M 128M)
+#   BENCH_OPTS      sets of options separated by `;', the empty set is the
+#                   default build behaviour
+#   BENCH_RUNS      runs of each case, the median is shown (3)
+#   BENCH_DATA      payload contents: zero, or iac for escaped telnet IAC
+#                   chars only, the worst case for -T (zero)
+#   BENCH_PORT      first of the local ports used (7950)
+#   BENCH_OUTPUT    file for the results (bench.jsonl)
+#
+# The throughput is measured by the receiving side, from the connection to
+# the end of the data, which leaves out the process startup.  In UDP mode
+# it is measured by the sender instead, and the lost datagrams are reported.
+# With -T the iac payload is received at half its size, each escaped pair
+# turning into a single byte, and the throughput counts the bytes received.
+# The CPU time comes from the `times' builtin of the shell, which may count
+# in 10ms ticks, so the small payloads are only good for the other numbers.
+
+NC=${1:-./netcat}
+BENCH_MODES=${BENCH_MODES:-"connect listen tunnel udp"}
+BENCH_SIZES=${BENCH_SIZES:-"1M 16M 128M"}
+BENCH_OPTS=${BENCH_OPTS-";--no-splice;--buffer-size=1M;--io-engine=select;--io-engine=io_uring"}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_DATA=${BENCH_DATA:-zero}
+BENCH_PORT=${BENCH_PORT:-7950}
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench.jsonl}
+
+srcdir=`dirname "$0"`
+revision=`cd "$srcdir" && git describe --always --dirty 2>/dev/null`
+test -n "$revision" || revision=unknown
+port=$BENCH_PORT
+
+tmp=`mktemp -d "${TMPDIR:-/tmp}/ncbench.XXXXXX"` || exit 1
+trap 'stop $pids; rm -rf "$tmp"' 0
+trap 'exit 1' 1 2 15
+
+if test ! -x "$NC"; then
+  echo "bench.sh: $NC: no such program, build netcat first" >&2
+  exit 1
+fi
+
+# Converts a size with an optional k, M or G suffix to bytes
+bytes () {
+  case $1 in
+    *k) echo $((${1%k} * 1000)) ;;
+    *M) echo $((${1%M} * 1000000)) ;;
+    *G) echo $((${1%G} * 1000000000)) ;;
+    *) echo $1 ;;
+  esac
+}
+
+# Runs netcat with the given arguments in the background, with the name of
+# its log and the file for its standard input as the first arguments.  The
+# log collects its messages and finally the CPU time it used, as printed by
+# `times'.  The received data is thrown away.
+spawn () {
+  log=$1 input=$2
+  shift 2
+  sh -c '"$@" 2>&1 > /dev/null; times' sh "$NC" -vv --stats-format=json \
+    $opts "$@" < "$input" > "$log" &
+  pids="$pids $!"
+}
+
+# Waits until the netcat logging to $1 is listening, or gives up
+listening () {
+  i=0
+  while ! grep -q "Listening on" "$1" 2>/dev/null; do
+    i=$(($i + 1))
+    test $i -gt 100 && return 1
+    sleep 0.05
+  done
+}
+
+# Sends SIGTERM to the netcats started by spawn() as the shells given as
+# arguments, which print the statistics and exit
+stop () {
+  for pid in "$@"; do
+    for child in `ps -o pid= --ppid $pid 2>/dev/null`; do
+      kill $child 2>/dev/null
+    done
+  done
+}
+
+# Prints the field $2 of the direction $3 (received or sent) of the
+# statistics in the log $1, or the field $2 at the top level without $3
+field () {
+  sed -n '/^{"elapsed"/p' "$1" | tail -n 1 | \
+    awk -v f="$2" -v d="$3" '{
+      s = $0
+      if (d != "") {
+        s = substr(s, index(s, "\"" d "\":{"))
+        s = substr(s, 1, index(s, "}"))
+      }
+      i = index(s, "\"" f "\":")
+      if (i == 0) { print 0; exit }
+      s = substr(s, i + length(f) + 3)
+      sub(/[,}].*/, "", s)
+      print s
+    }
+    END { if (NR == 0) print 0 }'
+}
+
+# Prints the CPU seconds (user and system) of the netcat in the log $1
+cputime () {
+  tail -n 1 "$1" | awk '{
+    t = 0
+    for (i = 1; i <= NF; i++) {
+      split($i, p, "m")
+      sub(/s$/, "", p[2])
+      t += p[1] * 60 + p[2]
+    }
+    print t
+  }'
+}
+
+# Runs the mode $1 with the payload file $2 once, and prints the elapsed
+# time, the bytes received, the CPU time and the system calls
+run () {
+  mode=$1 data=$2
+  pids=
+  rm -f "$tmp"/*.log
+  port=$(($port + 2))
+  test $port -gt $(($BENCH_PORT + 100)) && port=$BENCH_PORT
+
+  case $mode in
+    connect)
+      spawn "$tmp/recv.log" /dev/null -l -p $port
+      recv=$!
+      listening "$tmp/recv.log" || return 1
+      spawn "$tmp/send.log" "$data" -c 127.0.0.1 $port
+      ;;
+    listen)
+      spawn "$tmp/send.log" "$data" -c -l -p $port
+      listening "$tmp/send.log" || return 1
+      spawn "$tmp/recv.log" /dev/null 127.0.0.1 $port
+      recv=$!
+      ;;
+    tunnel)
+      spawn "$tmp/recv.log" /dev/null -l -p $(($port + 1))
+      recv=$!
+      listening "$tmp/recv.log" || return 1
+      spawn "$tmp/tunnel.log" /dev/null -L 127.0.0.1:$(($port + 1)) \
+	-p $port
+      listening "$tmp/tunnel.log" || return 1
+      spawn "$tmp/send.log" "$data" -c 127.0.0.1 $port
+      ;;
+    udp)
+      spawn "$tmp/recv.log" /dev/null -u -l -p $port
+      recv=$!
+      listening "$tmp/recv.log" || return 1
+      spawn "$tmp/send.log" "$data" -u -c 127.0.0.1 $port
+      send=$!
+      wait $send
+      sleep 0.2
+      stop $recv
+      ;;
+  esac
+  wait $pids 2>/dev/null
+
+  if test $mode = udp; then
+    elapsed=`field "$tmp/send.log" elapsed`
+  else
+    elapsed=`field "$tmp/recv.log" elapsed`
+  fi
+  received=`field "$tmp/recv.log" bytes received`
+  cpu=0 calls=0
+  for log in "$tmp"/*.log; do
+    c=`cputime "$log"`
+    n=$((`field "$log" calls received` + `field "$log" calls sent` +
+	 `field "$log" waits`))
+    cpu=`echo "$cpu $c" | awk '{ print $1 + $2 }'`
+    calls=$(($calls + $n))
+  done
+  echo "$elapsed $received $cpu $calls"
+}
+
+# Prints the median of the numbers on standard input
+median () {
+  sort -n | awk '{ v[NR] = $1 } END {
+    if (NR == 0) print 0
+    else if (NR % 2) print v[(NR + 1) / 2]
+    else print (v[NR / 2] + v[NR / 2 + 1]) / 2
+  }'
+}
+
+printf '%-8s %6s  %-24s %9s %10s %11s %7s\n' MODE SIZE OPTIONS "MB/s" \
+  "CPU s/GB" "calls/MB" "loss"
+
+echo "$BENCH_OPTS" | tr ';' '\n' > "$tmp/opts"
+for size in $BENCH_SIZES; do
+  total=`bytes $size`
+  data="$tmp/payload"
+  case $BENCH_DATA in
+    iac) head -c $total /dev/zero | tr '\000' '\377' > "$data" ;;
+    *) head -c $total /dev/zero > "$data" ;;
+  esac
+
+  for mode in $BENCH_MODES; do
+    while read opts; do
+      # skip the options this build doesn't support
+      if test -n "$opts" && ! "$NC" $opts -h > /dev/null 2>&1; then
+	printf '%-8s %6s  %-24s %s\n' $mode $size "$opts" "not supported"
+	continue
+      fi
+
+      expect=$total
+      case "$BENCH_DATA $opts" in
+	iac*-T*|iac*--telnet*) expect=$(($total / 2)) ;;
+      esac
+
+      : > "$tmp/runs"
+      r=0
+      while test $r -lt $BENCH_RUNS; do
+	r=$(($r + 1))
+	run $mode "$data" > "$tmp/result"
+	set -- `cat "$tmp/result"`
+	if test $# -ne 4; then
+	  echo "bench.sh: $mode $size $opts: run $r failed" >&2
+	  stop $pids
+	  wait
+	  continue
+	fi
+	echo "$@" | awk -v t=$expect '{
+	  mbps = ($1 > 0 ? $2 / $1 / 1e6 : 0)
+	  cpu = ($2 > 0 ? $3 / ($2 / 1e9) : 0)
+	  calls = ($2 > 0 ? $4 / ($2 / 1e6) : 0)
+	  loss = (t > 0 ? (t - $2) * 100 / t : 0)
+	  printf "%.1f %.2f %.1f %.2f %s %s %s %s\n", mbps, cpu, calls, loss,
+	    $1, $2, $3, $4
+	}' >> "$tmp/runs"
+	set -- `tail -n 1 "$tmp/runs"`
+	printf '{"revision":"%s","mode":"%s","size":%s,"options":"%s",' \
+	  "$revision" $mode $total "$opts" >> "$BENCH_OUTPUT"
+	printf '"run":%d,"elapsed":%s,"received":%s,"cpu":%s,"calls":%s,' \
+	  $r $5 $6 $7 $8 >> "$BENCH_OUTPUT"
+	printf '"mbps":%s,"cpu_per_gb":%s,"calls_per_mb":%s,"loss":%s}\n' \
+	  $1 $2 $3 $4 >> "$BENCH_OUTPUT"
+      done
+
+      printf '%-8s %6s  %-24s %9s %10s %11s %6s%%\n' $mode $size \
+	"${opts:-(default)}" `cut -d' ' -f1 "$tmp/runs" | median` \
+	`cut -d' ' -f2 "$tmp/runs" | median` \
+	`cut -d' ' -f3 "$tmp/runs" | median` \
+	`cut -d' ' -f4 "$tmp/runs" | median`
+    done < "$tmp/opts"
+  done
+done
+
+echo "Results appended to $BENCH_OUTPUT (revision $revision)"
@@ -0,0 +1,94 @@
+/*
+ * bucket.c -- token buckets for the bandwidth shaping
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+
+/* The buckets are refilled from the time elapsed since the last look, so
+   nothing needs to run while the data is held back.  The time is taken from
+   netcat_clock(), which doesn't jump when the system time is set. */
+
+/* Initializes the bucket `b' for `rate' units per second (0 for unlimited).
+   The bucket starts full. */
+
+void netcat_bucket_init(nc_bucket_t *b, unsigned long rate)
+{
+  b->rate = rate;
+  b->burst = rate * (NETCAT_BUCKET_BURST / 1000.0);
+  if (b->burst < 1)
+    b->burst = 1;
+  b->slice = rate * (NETCAT_BUCKET_SLICE / 1000.0);
+  if (b->slice < 1)
+    b->slice = 1;
+  b->tokens = b->burst;
+  b->last = netcat_clock();
+}
+
+/* Refills the bucket `b' and returns the number of whole tokens available,
+   which is 0 if the bucket holds less than a slice, or is in debt.  An
+   unlimited bucket always returns INT_MAX. */
+
+int netcat_bucket_avail(nc_bucket_t *b)
+{
+  double now;
+
+  if (b->rate == 0)
+    return INT_MAX;
+
+  now = netcat_clock();
+  b->tokens += (now - b->last) * b->rate;
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+  b->last = now;
+  return (b->tokens >= b->slice ? (int) b->tokens : 0);
+}
+
+/* Takes `n' tokens from the bucket `b'.  This may take more tokens than
+   available, the debt is paid back before the next tokens are handed out. */
+
+void netcat_bucket_take(nc_bucket_t *b, int n)
+{
+  if (b->rate > 0)
+    b->tokens -= n;
+}
+
+/* Stores in `tv' how long it takes for the bucket `b' to hold a slice of
+   tokens again, as seen at the last netcat_bucket_avail() call. */
+
+void netcat_bucket_wait(nc_bucket_t *b, struct timeval *tv)
+{
+  double wait = 0;
+
+  if ((b->rate > 0) && (b->tokens < b->slice))
+    wait = (b->slice - b->tokens) / b->rate;
+  tv->tv_sec = (long) wait;
+  tv->tv_usec = (long) ((wait - tv->tv_sec) * 1e6) + 1;
+  if (tv->tv_usec >= 1000000) {
+    tv->tv_sec++;
+    tv->tv_usec -= 1000000;
+  }
+}
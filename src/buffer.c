@@ -0,0 +1,193 @@
+/*
+ * buffer.c -- ring buffers used as data queues
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+
+/* A queue is allocated once and then data is appended at its tail and
+   consumed from its head, wrapping around the end of the memory area.  So
+   both the queued data and the free space are made of at most two segments,
+   which are handed to readv(2) and writev(2) so that a single call can move
+   the whole queue. */
+
+/* (Re)allocates the queue `buf' so that it can hold `size' bytes.  The data
+   already queued is preserved and moved to the beginning of the new area,
+   thus it must not be longer than `size'.
+   Returns TRUE on success or FALSE if the memory couldn't be allocated, in
+   which case the queue is left untouched. */
+
+bool netcat_buffer_init(nc_buffer_t *buf, int size)
+{
+  unsigned char *p;
+  struct iovec iov[2];
+  int i, n, len = 0;
+
+  assert(size > 0);
+  assert((buf->len <= size) && (buf->pinned == 0));
+  if (buf->head && (buf->size == size))
+    return TRUE;
+
+  p = malloc(size);
+  if (!p)
+    return FALSE;
+
+  n = netcat_buffer_data(buf, iov);
+  for (i = 0; i < n; i++) {
+    memcpy(p + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+
+  free(buf->head);
+  buf->head = p;
+  buf->size = size;
+  buf->pos = 0;
+  buf->len = len;
+  return TRUE;
+}
+
+/* Releases the memory of the queue `buf', discarding any data left. */
+
+void netcat_buffer_free(nc_buffer_t *buf)
+{
+  free(buf->head);
+  memset(buf, 0, sizeof(*buf));
+}
+
+/* Fills the `iov' vector with the segments of queued data, in order.
+   Returns the number of segments used (0, 1 or 2). */
+
+int netcat_buffer_data(nc_buffer_t *buf, struct iovec iov[2])
+{
+  int first;
+
+  if (buf->len == 0)
+    return 0;
+
+  first = buf->size - buf->pos;
+  iov[0].iov_base = buf->head + buf->pos;
+  if (buf->len <= first) {
+    iov[0].iov_len = buf->len;
+    return 1;
+  }
+
+  iov[0].iov_len = first;
+  iov[1].iov_base = buf->head;
+  iov[1].iov_len = buf->len - first;
+  return 2;
+}
+
+/* Fills the `iov' vector with the segments of free space that follow the
+   queued data, in order.  The free space ends where the pinned data begins.
+   Returns the number of segments used (0, 1 or 2). */
+
+int netcat_buffer_space(nc_buffer_t *buf, struct iovec iov[2])
+{
+  int start, tail;
+
+  if (buf->len + buf->pinned == buf->size)
+    return 0;
+
+  start = (buf->pos + buf->size - buf->pinned) % buf->size;
+  tail = (buf->pos + buf->len) % buf->size;
+  iov[0].iov_base = buf->head + tail;
+  if (tail < start) {
+    iov[0].iov_len = start - tail;
+    return 1;
+  }
+
+  iov[0].iov_len = buf->size - tail;
+  if (start == 0)
+    return 1;
+  iov[1].iov_base = buf->head;
+  iov[1].iov_len = start;
+  return 2;
+}
+
+/* Appends to the queue the `len' bytes that were just written into the
+   free space returned by netcat_buffer_space(). */
+
+void netcat_buffer_fill(nc_buffer_t *buf, int len)
+{
+  assert((len >= 0) && (buf->len + buf->pinned + len <= buf->size));
+  buf->len += len;
+}
+
+/* Removes `len' bytes from the beginning of the queued data.  When the queue
+   becomes empty it restarts from the beginning of the area, so that the next
+   data is more likely to be contiguous. */
+
+void netcat_buffer_drop(nc_buffer_t *buf, int len)
+{
+  assert((len >= 0) && (len <= buf->len));
+  buf->len -= len;
+  buf->pos = ((buf->len || buf->pinned) ? (buf->pos + len) % buf->size : 0);
+}
+
+/* Removes `len' bytes from the beginning of the queued data like
+   netcat_buffer_drop(), but their memory stays reserved until it's given
+   back with netcat_buffer_unpin(). */
+
+void netcat_buffer_pin(nc_buffer_t *buf, int len)
+{
+  assert((len >= 0) && (len <= buf->len));
+  buf->len -= len;
+  buf->pinned += len;
+  buf->pos = (buf->pos + len) % buf->size;
+}
+
+/* Gives back the memory of the oldest `len' pinned bytes. */
+
+void netcat_buffer_unpin(nc_buffer_t *buf, int len)
+{
+  assert((len >= 0) && (len <= buf->pinned));
+  buf->pinned -= len;
+  if (!buf->len && !buf->pinned)
+    buf->pos = 0;
+}
+
+/* Copies `len' bytes from `data' at the end of the queue.
+   Returns the number of bytes copied, which is less than `len' if the
+   queue doesn't have enough free space. */
+
+int netcat_buffer_put(nc_buffer_t *buf, const void *data, int len)
+{
+  struct iovec iov[2];
+  int i, n, done = 0;
+
+  n = netcat_buffer_space(buf, iov);
+  for (i = 0; (i < n) && (done < len); i++) {
+    int chunk = len - done;
+
+    if (chunk > (int) iov[i].iov_len)
+      chunk = iov[i].iov_len;
+
+    memcpy(iov[i].iov_base, (const unsigned char *) data + done, chunk);
+    done += chunk;
+  }
+  netcat_buffer_fill(buf, done);
+  return done;
+}
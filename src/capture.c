@@ -0,0 +1,312 @@
+/*
+ * capture.c -- hexdump of the traffic, off the data path
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+#ifdef USE_THREADS
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>		/* clock_gettime() */
+#endif
+
+/* When the hexdump goes to a file (-o), the data loops don't write it
+   themselves: each chunk is copied, as it is, into a ring in memory and a
+   writer thread formats it and writes it to the file, so that a slow disk
+   can't hold back the network.  The ring has a single producer (the thread
+   running the data loop) and a single consumer (the writer), which only
+   share the two positions, so no lock is needed to move the data.  The ring
+   never grows: when it's full the chunk is dropped and counted, and the
+   writer is told to skip its bytes, so that the offsets stay right. */
+
+#ifdef USE_THREADS
+
+#define CAPTURE_ALIGN 8
+#define CAPTURE_PIECE 65536		/* largest chunk in a single record */
+#define CAPTURE_IDLE_MS 10		/* the writer checks the ring this often */
+
+/* A record in the ring, followed by the header line (`hdr_len' bytes) and
+   the data (`len' bytes), then padded to CAPTURE_ALIGN.  A record with the
+   type CAPTURE_WRAP fills the end of the ring, and the next one starts at
+   the beginning. */
+
+enum {
+  CAPTURE_DATA,
+  CAPTURE_SKIP,		/* `len' bytes were dropped */
+  CAPTURE_WRAP
+};
+
+typedef struct {
+  unsigned int len;
+  unsigned short hdr_len;
+  unsigned char dir, type;
+} capture_rec_t;
+
+static struct {
+  unsigned char *ring;
+  unsigned long size;
+  unsigned long head;		/* written by the producer only */
+  unsigned long tail;		/* written by the writer only */
+  unsigned long skip[2];	/* dropped bytes not told to the writer yet */
+  int sleeping, stop;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} cap;
+
+static bool capture_running = FALSE;
+static unsigned long long capture_drops = 0, capture_dropped = 0;
+
+/* Rounds `len' up to the record alignment */
+#define CAPTURE_ROUND(len) (((len) + CAPTURE_ALIGN - 1) & ~(CAPTURE_ALIGN - 1))
+
+/* Writes the records of the ring to the output file until it's told to
+   stop, and the ring is empty. */
+
+static void *capture_main(void *arg)
+{
+  unsigned long tail = cap.tail;
+
+  (void) arg;
+  while (TRUE) {
+    unsigned long head = __atomic_load_n(&cap.head, __ATOMIC_ACQUIRE);
+    capture_rec_t *rec;
+
+    if (tail == head) {
+      if (__atomic_load_n(&cap.stop, __ATOMIC_ACQUIRE))
+	break;
+      fflush(output_fp);
+
+      /* the producer only signals a sleeping writer, so the flag must be
+         visible before the ring is checked again */
+      pthread_mutex_lock(&cap.lock);
+      __atomic_store_n(&cap.sleeping, 1, __ATOMIC_SEQ_CST);
+      if ((__atomic_load_n(&cap.head, __ATOMIC_SEQ_CST) == tail) &&
+	  !__atomic_load_n(&cap.stop, __ATOMIC_SEQ_CST)) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += CAPTURE_IDLE_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+	  ts.tv_sec++;
+	  ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&cap.wake, &cap.lock, &ts);
+      }
+      __atomic_store_n(&cap.sleeping, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&cap.lock);
+      continue;
+    }
+
+    rec = (capture_rec_t *) (cap.ring + tail % cap.size);
+    if (rec->type == CAPTURE_WRAP)
+      tail += cap.size - tail % cap.size;
+    else {
+      unsigned char *p = (unsigned char *) (rec + 1);
+
+      if (rec->type == CAPTURE_SKIP) {
+	netcat_fhexdump(output_fp, rec->dir, NULL, rec->len);
+	tail += CAPTURE_ROUND(sizeof(*rec));
+      }
+      else {
+	if (rec->hdr_len > 0)
+	  fwrite(p, 1, rec->hdr_len, output_fp);
+	netcat_fhexdump(output_fp, rec->dir, p + rec->hdr_len, rec->len);
+	tail += CAPTURE_ROUND(sizeof(*rec) + rec->hdr_len + rec->len);
+      }
+    }
+    __atomic_store_n(&cap.tail, tail, __ATOMIC_RELEASE);
+  }
+
+  fflush(output_fp);
+  return NULL;
+}
+
+/* Stores a record in the ring, with the header `hdr' and the data `data'
+   (a CAPTURE_SKIP record only holds the length).
+   Returns FALSE if there is no room for it. */
+
+static bool capture_push(int type, char dir, const char *hdr, int hdr_len,
+			 const void *data, unsigned int len)
+{
+  unsigned long need = CAPTURE_ROUND(sizeof(capture_rec_t) + hdr_len +
+				     (type == CAPTURE_DATA ? len : 0)),
+    head = cap.head, off = head % cap.size, pad = 0, tail;
+  capture_rec_t *rec;
+
+  /* a record never wraps around, it starts over from the beginning */
+  if (off + need > cap.size)
+    pad = cap.size - off;
+  tail = __atomic_load_n(&cap.tail, __ATOMIC_ACQUIRE);
+  if (head + pad + need - tail > cap.size)
+    return FALSE;
+
+  if (pad > 0) {
+    rec = (capture_rec_t *) (cap.ring + off);
+    rec->type = CAPTURE_WRAP;
+    head += pad;
+    off = 0;
+  }
+  rec = (capture_rec_t *) (cap.ring + off);
+  rec->len = len;
+  rec->hdr_len = hdr_len;
+  rec->dir = dir;
+  rec->type = type;
+  if (hdr_len > 0)
+    memcpy(rec + 1, hdr, hdr_len);
+  if (type == CAPTURE_DATA)
+    memcpy((unsigned char *) (rec + 1) + hdr_len, data, len);
+  __atomic_store_n(&cap.head, head + need, __ATOMIC_SEQ_CST);
+
+  /* wake up the writer if it went to sleep */
+  if (__atomic_load_n(&cap.sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&cap.lock);
+    pthread_cond_signal(&cap.wake);
+    pthread_mutex_unlock(&cap.lock);
+  }
+  return TRUE;
+}
+
+/* Stops the writer thread after it has written everything in the ring, and
+   reports the dropped chunks */
+
+static void capture_stop(void)
+{
+  if (!capture_running)
+    return;
+  capture_running = FALSE;
+
+  pthread_mutex_lock(&cap.lock);
+  __atomic_store_n(&cap.stop, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&cap.wake);
+  pthread_mutex_unlock(&cap.lock);
+  pthread_join(cap.thread, NULL);
+  free(cap.ring);
+
+  if (capture_drops > 0)
+    ncprint(NCPRINT_WARNING, _("The hexdump queue was full, %llu chunks "
+	    "(%llu bytes) were not dumped"), capture_drops, capture_dropped);
+}
+#endif	/* USE_THREADS */
+
+/* Starts the writer thread of the hexdump, if the hexdump goes to a file.
+   The ring takes `size' bytes.  If the thread can't be started, the data
+   loops write the hexdump themselves. */
+
+void netcat_capture_start(unsigned long size)
+{
+#ifdef USE_THREADS
+  sigset_t sigs, old_sigs;
+  int ret;
+
+  if (!opt_hexdump || (output_fp == stderr) || capture_running)
+    return;
+
+  memset(&cap, 0, sizeof(cap));
+  cap.size = CAPTURE_ROUND(size);
+  cap.ring = malloc(cap.size);
+  if (!cap.ring)
+    return;
+  pthread_mutex_init(&cap.lock, NULL);
+  pthread_cond_init(&cap.wake, NULL);
+
+  /* the signals are handled by the main thread */
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+  ret = pthread_create(&cap.thread, NULL, capture_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+  if (ret != 0) {
+    ncprint(NCPRINT_VERB2, _("Couldn't start the hexdump writer: %s"),
+	    strerror(ret));
+    free(cap.ring);
+    return;
+  }
+  capture_running = TRUE;
+  atexit(capture_stop);
+#else
+  (void) size;
+#endif
+}
+
+/* Hexdumps `len' bytes at `data' that went in the direction `dir' ('<' for
+   the received data, '>' for the sent data), after a header line formatted
+   from `fmt' (the old hexdump format has no header).  If the writer thread
+   is running the data is queued for it, or dropped if the queue is full. */
+
+void netcat_capture(char dir, const void *data, size_t len,
+		    const char *fmt, ...)
+{
+  char hdr[256];
+  int hdr_len = 0;
+#ifndef USE_OLD_HEXDUMP
+  va_list args;
+
+  va_start(args, fmt);
+  hdr_len = vsnprintf(hdr, sizeof(hdr), fmt, args);
+  va_end(args);
+  if (hdr_len >= (int) sizeof(hdr))
+    hdr_len = sizeof(hdr) - 1;
+#else
+  (void) fmt;
+#endif
+
+#ifdef USE_THREADS
+  if (capture_running) {
+    const unsigned char *p = data;
+    int i = (dir == '<' ? 0 : 1);
+    size_t done = 0;
+
+    /* first tell the writer about the bytes dropped before */
+    if (cap.skip[i] > 0) {
+      unsigned int n = (cap.skip[i] > UINT_MAX ? UINT_MAX : cap.skip[i]);
+
+      if (capture_push(CAPTURE_SKIP, dir, NULL, 0, NULL, n))
+	cap.skip[i] -= n;
+    }
+
+    /* the large chunks are split, only the first piece has the header */
+    while ((cap.skip[i] == 0) && (done < len)) {
+      unsigned int n = (len - done < CAPTURE_PIECE ? len - done :
+			CAPTURE_PIECE);
+
+      if (!capture_push(CAPTURE_DATA, dir, hdr, (done ? 0 : hdr_len),
+			p + done, n))
+	break;
+      done += n;
+    }
+    if (done < len) {
+      capture_drops++;
+      capture_dropped += len - done;
+      cap.skip[i] += len - done;
+    }
+    return;
+  }
+#endif
+
+  if (hdr_len > 0)
+    fwrite(hdr, 1, hdr_len, output_fp);
+  netcat_fhexdump(output_fp, dir, data, len);
+}
@@ -27,11 +27,65 @@
 #endif
 
 #include "netcat.h"
+#include <fcntl.h>		/* fcntl() */
+#include <sys/stat.h>		/* fstat() */
+#include <poll.h>		/* poll() */
+#ifdef USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef USE_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+#ifdef USE_THREADS
+#include <signal.h>
+#include <pthread.h>
+#endif
+
+/* How many consecutive rounds the core loop may run without polling the
+   event engine, when it already knows that some descriptors are ready. */
+#define CORE_SPIN_MAX 64
+
+/* Requested size of the pipes used by the spliced tunnel (bytes) */
+#define CORE_SPLICE_PIPESZ (1024 * 1024)
+
+/* Maximum amount of data moved by a single sendfile(2) or splice(2) call
+   between the standard I/O and the socket (bytes) */
+#define CORE_DIRECT_CHUNK (1024 * 1024)
+
+/* Datagrams built from a data stream are cut at this size (bytes) */
+#define CORE_UDP_CHUNK 1024
+
+/* Size of the buffer of each received datagram, enough for the largest UDP
+   datagram (bytes) */
+#define CORE_DGRAM_MAX 65536
 
-/* Global variables */
+/* A data queue that filled up is only read into again when it has been
+   drained down to this level, so that the reads aren't tiny (bytes) */
+#define CORE_QUEUE_LOWAT(q) ((q)->size / 2)
 
-unsigned long bytes_sent = 0;		/* total bytes received */
-unsigned long bytes_recv = 0;		/* total bytes sent */
+/* Updates the high-water mark of the statistics `st' with the data waiting
+   in the queue `q' */
+#define CORE_STATS_QUEUE(st, q) \
+  do { if ((q)->len > (st)->queue_peak) (st)->queue_peak = (q)->len; } while (0)
+
+/* Kinds of standard I/O descriptors that can exchange data with the socket
+   without passing through our buffers */
+
+typedef enum {
+  CORE_DIRECT_NONE,
+  CORE_DIRECT_FILE,
+  CORE_DIRECT_PIPE
+} core_direct_t;
+
+/* Per-descriptor state of the core loop.  `ready' holds the events that are
+   known to be pending: for level-triggered descriptors the read readiness is
+   only valid for a single round, while edge-triggered ones (and writes in
+   general) keep it until a read or write call returns EAGAIN. */
+
+typedef struct {
+  int fd, ready;
+  bool edge, pollable;
+} core_fd_t;
 
 /* Creates a UDP socket with a default destination address.  It also calls
    bind(2) if it is needed in order to specify the source address.
@@ -67,6 +121,7 @@ static int core_udp_connect(nc_sock_t *ncsock)
   if (ret < 0)
     goto err;
 
+  netcat_socket_report(sock);
   return sock;
 
  err:
@@ -182,7 +237,7 @@ static int core_udp_listen(nc_sock_t *ncsock)
     for (socks_loop = 1; socks_loop <= sockbuf[0]; socks_loop++) {
       int recv_ret, write_ret;
       struct msghdr my_hdr;
-      unsigned char buf[1024];
+      unsigned char buf[CORE_DGRAM_MAX];
       struct iovec my_hdr_vec;
       struct sockaddr_in rem_addr;
       struct sockaddr_in local_addr;
@@ -244,26 +299,33 @@ static int core_udp_listen(nc_sock_t *ncsock)
 		netcat_inet_ntop(&rem_addr.sin_addr), ntohs(rem_addr.sin_port));
 
       if (opt_zero) {		/* output the packet right here right now */
-	write_ret = write(STDOUT_FILENO, buf, recv_ret);
-	bytes_recv += write_ret;
-	debug_dv(("write_u(stdout) = %d", write_ret));
-
-	if (write_ret < 0) {
-	  perror("write_u(stdout)");
-	  exit(EXIT_FAILURE);
+	/* a write may be cut short (or refused, if stdout was left
+	   non-blocking by someone else), so go on until it's all out */
+	for (write_ret = 0; write_ret < recv_ret; write_ret += ret) {
+	  ret = write(STDOUT_FILENO, buf + write_ret, recv_ret - write_ret);
+	  debug_dv(("write_u(stdout) = %d", ret));
+
+	  if ((ret < 0) && ((errno == EINTR) || (errno == EAGAIN))) {
+	    struct pollfd pfd;
+
+	    pfd.fd = STDOUT_FILENO;
+	    pfd.events = POLLOUT;
+	    poll(&pfd, 1, -1);
+	    ret = 0;
+	  }
+	  else if (ret < 0) {
+	    perror("write_u(stdout)");
+	    exit(EXIT_FAILURE);
+	  }
 	}
-
-	/* FIXME: unhandled exception */
-	assert(write_ret == recv_ret);
+	stats_recv.bytes += write_ret;
+	stats_recv.packets++;
 
 	/* if the hexdump option is set, hexdump the received data */
-	if (opt_hexdump) {
-#ifndef USE_OLD_HEXDUMP
-	  fprintf(output_fp, "Received %d bytes from %s:%d\n", recv_ret,
-		netcat_inet_ntop(&rem_addr.sin_addr), ntohs(rem_addr.sin_port));
-#endif
-	  netcat_fhexdump(output_fp, '<', buf, write_ret);
-	}
+	if (opt_hexdump)
+	  netcat_capture('<', buf, write_ret, "Received %d bytes from %s:%d\n",
+			 recv_ret, netcat_inet_ntop(&rem_addr.sin_addr),
+			 ntohs(rem_addr.sin_port));
       }
       else {
 #ifdef USE_PKTINFO
@@ -281,10 +343,8 @@ static int core_udp_listen(nc_sock_t *ncsock)
 	dup_socket.port.netnum = rem_addr.sin_port;
 	dup_socket.port.num = ntohs(rem_addr.sin_port);
 	/* copy the received data in the socket's queue */
-	ncsock->recvq.len = recv_ret;
-	ncsock->recvq.head = ncsock->recvq.pos = malloc(recv_ret);
-	memcpy(ncsock->recvq.head, my_hdr_vec.iov_base, recv_ret);
-	/* FIXME: this ONLY saves the first 1024 bytes! and the others? */
+	if ((recv_ret > 0) && netcat_buffer_init(&ncsock->recvq, recv_ret))
+	  netcat_buffer_put(&ncsock->recvq, my_hdr_vec.iov_base, recv_ret);
 #else
 	ret = connect(sock, (struct sockaddr *)&rem_addr, sizeof(rem_addr));
 	if (ret < 0)
@@ -382,6 +442,7 @@ static int core_tcp_connect(nc_sock_t *ncsock)
     /* everything went fine, we have the socket */
     ncprint(NCPRINT_VERB1, _("%s open"), netcat_strid(&ncsock->host,
 						      &ncsock->port));
+    netcat_socket_report(sock);
     return sock;
   }
   else if (ret) {
@@ -402,26 +463,20 @@ static int core_tcp_connect(nc_sock_t *ncsock)
   return -1;
 }				/* end of core_tcp_connect() */
 
-/* This function loops inside the accept() loop until a *VALID* connection is
-   fetched.  If an unwanted connection arrives, it is shutdown() and close()d.
-   If zero I/O mode is enabled, ALL connections are refused and it stays
-   unconditionally in listen mode until timeout elapses, if given, otherwise
-   forever.
-   Returns: The new socket descriptor for the fetched connection */
+/* Creates the listening socket for `ncsock'.  If the port was set to 0 it
+   is assigned randomly by the OS, so find out which one they assigned to us.
+   Returns the listening socket or -1 on error. */
 
-static int core_tcp_listen(nc_sock_t *ncsock)
+static int core_tcp_listen_socket(nc_sock_t *ncsock)
 {
-  int sock_listen, sock_accept, timeout = ncsock->timeout;
-  debug_v(("core_tcp_listen(ncsock=%p)", (void *)ncsock));
+  int sock_listen;
 
   sock_listen = netcat_socket_new_listen(PF_INET, &ncsock->local_host.iaddrs[0],
-			ncsock->local_port.netnum);
+			ncsock->local_port.netnum, FALSE);
   if (sock_listen < 0)
     ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
 	    _("Couldn't setup listening socket (err=%d)"), sock_listen);
 
-  /* if the port was set to 0 this means that it is assigned randomly by the
-     OS.  Find out which port they assigned to us. */
   if (ncsock->local_port.num == 0) {
     int ret;
     struct sockaddr_in myaddr;
@@ -437,6 +492,44 @@ static int core_tcp_listen(nc_sock_t *ncsock)
 
   ncprint(NCPRINT_VERB2, _("Listening on %s"),
 	netcat_strid(&ncsock->local_host, &ncsock->local_port));
+  return sock_listen;
+}
+
+/* Checks the connection that was just accepted from `addr'.  If a remote
+   address (and optionally some ports) have been specified we assume it as
+   the only ip and port that it is allowed to connect to this socket.
+   Returns TRUE if the connection is allowed. */
+
+static bool core_tcp_accept_allowed(nc_sock_t *ncsock, struct sockaddr_in *addr)
+{
+  if ((ncsock->host.iaddrs[0].s_addr && memcmp(&ncsock->host.iaddrs[0],
+       &addr->sin_addr, sizeof(ncsock->host.iaddrs[0]))) ||
+      (netcat_flag_count() && !netcat_flag_get(ntohs(addr->sin_port)))) {
+    ncprint(NCPRINT_VERB2, _("Unwanted connection from %s:%hu (refused)"),
+	    netcat_inet_ntop(&addr->sin_addr), ntohs(addr->sin_port));
+    return FALSE;
+  }
+  ncprint(NCPRINT_VERB1, _("Connection from %s:%hu"),
+	  netcat_inet_ntop(&addr->sin_addr), ntohs(addr->sin_port));
+  return TRUE;
+}
+
+/* This function loops inside the accept() loop until a *VALID* connection is
+   fetched.  If an unwanted connection arrives, it is shutdown() and close()d.
+   If zero I/O mode is enabled, ALL connections are refused and it stays
+   unconditionally in listen mode until timeout elapses, if given, otherwise
+   forever.
+   Returns: The new socket descriptor for the fetched connection */
+
+static int core_tcp_listen(nc_sock_t *ncsock)
+{
+  int sock_listen, sock_accept, timeout = ncsock->timeout;
+  debug_v(("core_tcp_listen(ncsock=%p)", (void *)ncsock));
+
+  sock_listen = core_tcp_listen_socket(ncsock);
+  if (sock_listen < 0)
+    return -1;
+
   while (TRUE) {
     struct sockaddr_in my_addr;
     unsigned int my_len = sizeof(my_addr);	/* this *IS* socklen_t */
@@ -454,20 +547,8 @@ static int core_tcp_listen(nc_sock_t *ncsock)
     /* FIXME: i want a library function like netcat_peername() that fetches it
        and resolves with netcat_resolvehost(). */
     getpeername(sock_accept, (struct sockaddr *)&my_addr, &my_len);
-
-    /* if a remote address (and optionally some ports) have been specified we
-       assume it as the only ip and port that it is allowed to connect to
-       this socket */
-
-    if ((ncsock->host.iaddrs[0].s_addr && memcmp(&ncsock->host.iaddrs[0],
-	 &my_addr.sin_addr, sizeof(ncsock->host.iaddrs[0]))) ||
-	(netcat_flag_count() && !netcat_flag_get(ntohs(my_addr.sin_port)))) {
-      ncprint(NCPRINT_VERB2, _("Unwanted connection from %s:%hu (refused)"),
-	      netcat_inet_ntop(&my_addr.sin_addr), ntohs(my_addr.sin_port));
+    if (!core_tcp_accept_allowed(ncsock, &my_addr))
       goto refuse;
-    }
-    ncprint(NCPRINT_VERB1, _("Connection from %s:%hu"),
-	    netcat_inet_ntop(&my_addr.sin_addr), ntohs(my_addr.sin_port));
 
     /* with zero I/O mode we don't really accept any connection */
     if (opt_zero)
@@ -484,6 +565,7 @@ static int core_tcp_listen(nc_sock_t *ncsock)
 
   /* we don't need a listening socket anymore */
   close(sock_listen);
+  netcat_socket_report(sock_accept);
   return sock_accept;
 }				/* end of core_tcp_listen() */
 
@@ -519,394 +601,1946 @@ int core_listen(nc_sock_t *ncsock)
   return -1;
 }
 
-/* handle stdin/stdout/network I/O. */
+/* Sets the non-blocking flag on the descriptor `fd'.  Returns the original
+   descriptor flags, or -1 on error. */
 
-int core_readwrite(nc_sock_t *nc_main, nc_sock_t *nc_slave)
+static int core_set_nonblock(int fd)
 {
-  int fd_stdin, fd_stdout, fd_sock, fd_max;
-  int read_ret, write_ret;
-  unsigned char buf[1024];
-  bool inloop = TRUE;
-  fd_set ins, outs;
-  struct timeval delayer;
-  assert(nc_main && nc_slave);
+  int ret = fcntl(fd, F_GETFL, 0);
 
-  debug_v(("core_readwrite(nc_main=%p, nc_slave=%p)", (void *)nc_main,
-	  (void *)nc_slave));
+  if ((ret >= 0) && !(ret & O_NONBLOCK) &&
+      (fcntl(fd, F_SETFL, ret | O_NONBLOCK) < 0))
+    return -1;
+  return ret;
+}
 
-  /* set the actual input and output fds and find out the max fd + 1 */
-  fd_sock = nc_main->fd;
-  assert(fd_sock >= 0);
+/* Original flags of the standard I/O descriptors made non-blocking by
+   core_stdio_nonblock(), or -1 if they weren't touched */
 
-  /* if the domain is unspecified, it means that this is the standard I/O */
-  if (nc_slave->domain == PF_UNSPEC) {
-    fd_stdin = STDIN_FILENO;
-    fd_stdout = STDOUT_FILENO;
+static int core_stdio_flags[2] = { -1, -1 };
+
+/* Gives back to the standard input and output their original flags.  This
+   is also called at exit, since the open files are shared with the parent
+   process and with the other commands of a pipeline. */
+
+static void core_stdio_restore(void)
+{
+  int fd;
+
+  for (fd = STDIN_FILENO; fd <= STDOUT_FILENO; fd++)
+    if (core_stdio_flags[fd] >= 0) {
+      fcntl(fd, F_SETFL, core_stdio_flags[fd]);
+      core_stdio_flags[fd] = -1;
+    }
+}
+
+/* Tells if the descriptor `fd' refers to the same object as the stream
+   `fp' */
+
+static bool core_same_file(int fd, FILE *fp)
+{
+  struct stat st, st_fp;
+
+  return (fp && (fstat(fd, &st) == 0) && (fstat(fileno(fp), &st_fp) == 0) &&
+	  (st.st_dev == st_fp.st_dev) && (st.st_ino == st_fp.st_ino));
+}
+
+/* Makes the standard I/O descriptor `fd' non-blocking, so that a slow
+   process on the other side of a pipe can't stall the whole loop.  This is
+   only done for pipes and sockets: regular files never block, while a
+   terminal is shared with the shell.  The messages and the hexdump are
+   written with stdio, which can't handle EAGAIN, so the descriptor is left
+   alone if it refers to the same pipe as stderr or the output file.
+   Returns TRUE if the descriptor is now non-blocking. */
+
+static bool core_stdio_nonblock(int fd)
+{
+  static bool registered = FALSE;
+  struct stat st;
+  int flags;
+
+  if ((fstat(fd, &st) < 0) || !(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) ||
+      core_same_file(fd, stderr) || core_same_file(fd, output_fp))
+    return FALSE;
+
+  if (!registered) {
+    atexit(core_stdio_restore);
+    registered = TRUE;
   }
-  else {
-    fd_stdin = fd_stdout = nc_slave->fd;
-    assert(fd_stdin >= 0);
+  flags = core_set_nonblock(fd);
+  if (flags < 0)
+    return FALSE;
+  if (!(flags & O_NONBLOCK) && (core_stdio_flags[fd] < 0))
+    core_stdio_flags[fd] = flags;
+  return TRUE;
+}
+
+/* Updates the `full' state of the queue `q' with its high and low
+   watermarks: it becomes full when there's no room left, and stops being
+   so only when it has been drained down to CORE_QUEUE_LOWAT().
+   Returns TRUE if the queue can take more data. */
+
+static bool core_queue_room(nc_buffer_t *q, bool *full)
+{
+  if (q->len + q->pinned >= q->size)
+    *full = TRUE;
+  else if (q->len <= CORE_QUEUE_LOWAT(q))
+    *full = FALSE;
+  return !*full;
+}
+
+/* Registers the core descriptor `cfd' in the event loop `ev'.  Descriptors
+   that can't be polled (regular files, for example) are marked as always
+   ready, which is what select(2) would report for them. */
+
+static void core_event_add(nc_evloop_t *ev, core_fd_t *cfd)
+{
+  int ret = netcat_event_add(ev, cfd->fd, 0, cfd->edge, cfd);
+
+  if (ret < 0)
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Critical system request failed: %s"),
+	    strerror(errno));
+  else if (ret > 0) {
+    debug_v(("fd %d can't be polled, assuming always ready", cfd->fd));
+    cfd->edge = TRUE;
+    cfd->pollable = FALSE;
+    cfd->ready = NC_EV_READ | NC_EV_WRITE;
   }
-  fd_max = 1 + (fd_stdin > fd_sock ? fd_stdin : fd_sock);
-  delayer.tv_sec = 0;
-  delayer.tv_usec = 0;
+  else
+    cfd->pollable = TRUE;
+}
 
-  /* use the internal signal handler */
+/* Updates the events of interest of the core descriptor `cfd' */
+
+static void core_event_mod(nc_evloop_t *ev, core_fd_t *cfd, int mask)
+{
+  if (cfd->pollable && (netcat_event_mod(ev, cfd->fd, mask) < 0))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Critical system request failed: %s"),
+	    strerror(errno));
+}
+
+/* Waits for events in the event loop `ev' for the maximum time `timeout'
+   (or forever if NULL), and merges them into the ready masks of the core
+   descriptors.  Returns the number of events or -1 on error. */
+
+static int core_event_wait(nc_evloop_t *ev, struct timeval *timeout)
+{
+  nc_event_t events[8];
+  int i, ret;
+
+  ret = netcat_event_wait(ev, events, sizeof(events) / sizeof(events[0]),
+			  timeout);
+  stats_waits++;
+  for (i = 0; i < ret; i++)
+    ((core_fd_t *)events[i].data)->ready |= events[i].events;
+  return ret;
+}
+
+#ifdef USE_SPLICE
+/* Creates a pipe for splicing data and tries to enlarge it, since bigger
+   pipes mean less round trips (the limit is system-wide though).
+   Returns the pipe capacity in bytes, or -1 on error. */
+
+static int core_pipe_open(int pipefd[2])
+{
+  int size = -1;
+
+  if (pipe(pipefd) < 0)
+    return -1;
+#ifdef F_SETPIPE_SZ
+  fcntl(pipefd[1], F_SETPIPE_SZ, CORE_SPLICE_PIPESZ);
+#endif
+#ifdef F_GETPIPE_SZ
+  size = fcntl(pipefd[1], F_GETPIPE_SZ);
+#endif
+  if (size <= 0)
+    size = 65536;			/* the traditional Linux pipe size */
+  return size;
+}
+
+/* One direction of a spliced tunnel.  The data flows from `src' into the pipe
+   and from the pipe into `dst' without ever being copied to user space.
+   `pending' counts the bytes parked inside the pipe, while `full' is set when
+   a read from `src' would block while the pipe wasn't empty.  In that case
+   EAGAIN doesn't tell whether the socket was drained or the pipe was full, so
+   the read is retried as soon as the pipe is emptied. */
+
+typedef struct {
+  core_fd_t *src, *dst;
+  int pipe[2];
+  size_t pending, size;
+  bool eof, full;
+  nc_stats_t *stats;
+} core_splice_t;
+
+/* Moves as much data as possible through the spliced direction `sp'.
+   Returns the number of bytes moved through the pipe, or -1 if the kernel
+   doesn't support splicing from the source socket (EINVAL).  The data
+   already parked in the pipes is left there, so the caller decides whether
+   it can still fall back to copying. */
+
+static int core_splice_move(core_splice_t *sp)
+{
+  ssize_t ret;
+  int moved = 0;
+
+  /* fill the pipe from the source socket */
+  if (!sp->eof && (sp->pending < sp->size) && (sp->src->ready & NC_EV_READ)) {
+    ret = splice(sp->src->fd, NULL, sp->pipe[1], NULL, sp->size - sp->pending,
+		 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    debug_dv(("splice(net -> pipe) = %d", (int) ret));
+    sp->stats->calls++;
+    if (ret > 0)
+      sp->pending += ret;
+    else if (ret == 0) {
+      debug_v(("EOF Received from fd %d", sp->src->fd));
+      sp->eof = TRUE;
+    }
+    else if (errno == EAGAIN) {
+      sp->src->ready &= ~NC_EV_READ;
+      sp->full = (sp->pending > 0);
+    }
+    else if (errno == EINVAL)
+      return -1;
+    else {
+      perror("splice(net)");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* flush the pipe into the destination socket */
+  if ((sp->pending > 0) && (sp->dst->ready & NC_EV_WRITE)) {
+    ret = splice(sp->pipe[0], NULL, sp->dst->fd, NULL, sp->pending,
+		 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    debug_dv(("splice(pipe -> net) = %d", (int) ret));
+    sp->stats->calls++;
+    if (ret > 0) {
+      sp->pending -= ret;
+      sp->stats->bytes += ret;		/* update statistics */
+      moved = ret;
+      if (!sp->pending && sp->full) {
+	sp->src->ready |= NC_EV_READ;
+	sp->full = FALSE;
+      }
+    }
+    else if ((ret < 0) && (errno == EAGAIN))
+      sp->dst->ready &= ~NC_EV_WRITE;
+    else {
+      perror("splice(net)");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return moved;
+}
+
+/* Relays the data between the two sockets of a tunnel using splice(2).
+   Returns 0 when the tunnel is closed, or -1 if splicing is not supported
+   for these sockets; in this case no data has been moved and the caller
+   should fall back to the common copying loop. */
+
+static int core_splice_readwrite(nc_sock_t *nc_main, nc_sock_t *nc_slave)
+{
+  int i, ret = 0;
+  nc_evloop_t ev;
+  core_fd_t fd_main, fd_slave;
+  core_splice_t dirs[2];
+  debug_v(("core_splice_readwrite(nc_main=%p, nc_slave=%p)", (void *)nc_main,
+	  (void *)nc_slave));
+
+  memset(&fd_main, 0, sizeof(fd_main));
+  memset(&fd_slave, 0, sizeof(fd_slave));
+  memset(dirs, 0, sizeof(dirs));
+  dirs[0].src = dirs[1].dst = &fd_main;
+  dirs[1].src = dirs[0].dst = &fd_slave;
+  dirs[0].stats = &stats_recv;
+  dirs[1].stats = &stats_sent;
+
+  for (i = 0; i < 2; i++) {
+    int size = core_pipe_open(dirs[i].pipe);
+
+    if (size < 0) {
+      if (i)
+	close(dirs[0].pipe[0]), close(dirs[0].pipe[1]);
+      return -1;
+    }
+    dirs[i].size = size;
+  }
+
+  netcat_event_init(&ev, opt_engine);
+  fd_main.fd = nc_main->fd;
+  fd_slave.fd = nc_slave->fd;
+  fd_main.edge = fd_slave.edge = (ev.engine != NETCAT_EVENT_SELECT);
+  core_set_nonblock(fd_main.fd);
+  core_set_nonblock(fd_slave.fd);
+  core_event_add(&ev, &fd_main);
+  core_event_add(&ev, &fd_slave);
+  fd_main.ready |= NC_EV_WRITE;
+  fd_slave.ready |= NC_EV_WRITE;
+
+  ncprint(NCPRINT_VERB2, _("Relaying the tunnel with splice(2)"));
   signal_handler = FALSE;
 
-  while (inloop) {
-    bool call_select = TRUE;
-    struct sockaddr_in recv_addr;	/* only used by UDP proto */
-    unsigned int recv_len = sizeof(recv_addr);
+  while (TRUE) {
+    int want_main = 0, want_slave = 0;
 
-    /* if we received an interrupt signal break this function */
     if (got_sigint) {
       got_sigint = FALSE;
       break;
     }
-    /* if we received a terminating signal we must terminate */
     if (got_sigterm)
       break;
 
-    /* reset the ins and outs events watch because some changes could happen */
-    FD_ZERO(&ins);
-    FD_ZERO(&outs);
+    for (i = 0; i < 2; i++) {
+      if (core_splice_move(&dirs[i]) < 0) {
+	/* the pipes are closed by the fallback, so it's too late for it once
+	   any data went through either of them */
+	if (dirs[0].pending || dirs[1].pending || dirs[0].stats->bytes ||
+	    dirs[1].stats->bytes) {
+	  perror("splice(net)");
+	  exit(EXIT_FAILURE);
+	}
+	ret = -1;
+	goto cleanup;
+      }
+    }
+
+    /* as in the copying loop, an EOF from either side closes the tunnel, but
+       only after the data parked in the pipe has been delivered.  This is
+       checked right after moving the data, since the last flush leaves
+       nothing to wait for. */
+    if ((dirs[0].eof && !dirs[0].pending) || (dirs[1].eof && !dirs[1].pending))
+      break;
+
+    /* find out what each socket is waiting for */
+    for (i = 0; i < 2; i++) {
+      int *want_src = (i ? &want_slave : &want_main);
+      int *want_dst = (i ? &want_main : &want_slave);
 
-    /* if the receiving queue is not empty it means that something bad is
-       happening (for example the target sending queue is delaying the output
-       and so requires some more time to free up. */
-    if (nc_main->recvq.len == 0) {
-      debug_v(("watching main sock for incoming data (recvq is empty)"));
-      FD_SET(fd_sock, &ins);
+      if (!dirs[i].eof && (dirs[i].pending < dirs[i].size))
+	*want_src |= NC_EV_READ;
+      if (dirs[i].pending > 0)
+	*want_dst |= NC_EV_WRITE;
     }
-    else
-      call_select = FALSE;
 
-    /* same thing for the other socket */
-    if (nc_slave->recvq.len == 0) { /* FIXME: call_select = false but could call it
-	anyway and one of them could be set.. so what happens? */
-      debug_v(("watching slave sock for incoming data (recvq is empty)"));
-      if (use_stdin || (netcat_mode == NETCAT_TUNNEL))
-        FD_SET(fd_stdin, &ins);
+    if ((want_main & fd_main.ready) || (want_slave & fd_slave.ready))
+      continue;
+
+    core_event_mod(&ev, &fd_main, want_main & ~fd_main.ready);
+    core_event_mod(&ev, &fd_slave, want_slave & ~fd_slave.ready);
+    if ((core_event_wait(&ev, NULL) < 0) && (errno != EINTR)) {
+      perror("select(core_readwrite)");
+      exit(EXIT_FAILURE);
     }
-    else
-      call_select = FALSE;
 
-    /* now the send queue. There are two cases in which the main sendq is not
-       empty.  The first one is when we have a delayed output (-i), in which
-       case the delayer is not null, and the socket is writable.  The second
-       case is when the socket buffer is full, so the socket is not writable
-       and the delayer is either null or set, depending on the opt_interval
-       variable. */
-    if (nc_main->sendq.len > 0) {
-      if ((delayer.tv_sec == 0) && (delayer.tv_usec == 0)) {
-	debug_v(("watching main sock for outgoing availability (there is pending data)"));
-	FD_SET(fd_sock, &outs);
-	call_select = TRUE;
-      }
+    netcat_stats_tick();
+    if (got_sigusr1) {
+      netcat_printstats(TRUE);
+      got_sigusr1 = FALSE;
     }
+  }
 
-    if (call_select || delayer.tv_sec || delayer.tv_usec) {
-      int ret;
-#ifndef USE_LINUX_SELECT
-      struct timeval dd_saved;
+  /* the tunnel is over, close the sockets.  The side that didn't send the
+     EOF may still have some data to receive from the kernel. */
+  if (dirs[0].eof)
+    netcat_socket_linger_off(fd_slave.fd);
+  if (dirs[1].eof)
+    netcat_socket_linger_off(fd_main.fd);
+  shutdown(fd_main.fd, SHUT_RDWR);
+  close(fd_main.fd);
+  nc_main->fd = -1;
+  shutdown(fd_slave.fd, SHUT_RDWR);
+  close(fd_slave.fd);
+  nc_slave->fd = -1;
+
+ cleanup:
+  netcat_event_close(&ev);
+  for (i = 0; i < 2; i++) {
+    close(dirs[i].pipe[0]);
+    close(dirs[i].pipe[1]);
+  }
+  signal_handler = TRUE;
+  return ret;
+}
+#endif
+
+/* Finds out whether the standard I/O descriptor `fd' can exchange data with
+   the socket directly, and how.  If `output' is TRUE the descriptor is going
+   to be written. */
 
-      dd_saved.tv_sec = delayer.tv_sec;
-      dd_saved.tv_usec = delayer.tv_usec;
-      update_timeval(NULL);
+static core_direct_t core_direct_type(int fd, bool output)
+{
+  struct stat st;
+
+  if (!opt_splice || (fstat(fd, &st) < 0))
+    return CORE_DIRECT_NONE;
+
+#ifdef USE_SPLICE
+  if (S_ISFIFO(st.st_mode))
+    return CORE_DIRECT_PIPE;
+  /* splice(2) refuses to write to files opened in append mode */
+  if (S_ISREG(st.st_mode) && output && !(fcntl(fd, F_GETFL) & O_APPEND))
+    return CORE_DIRECT_FILE;
+#endif
+#ifdef USE_SENDFILE
+  if (S_ISREG(st.st_mode) && !output)
+    return CORE_DIRECT_FILE;
 #endif
+  return CORE_DIRECT_NONE;
+}
 
-      debug(("[select] entering with timeout=%d:%d ...", delayer.tv_sec, delayer.tv_usec));
-      ret = select(fd_max, &ins, &outs, NULL,
-		   (delayer.tv_sec || delayer.tv_usec ? &delayer : NULL));
+/* Sends up to `len' bytes from the standard input `fd' of kind `type'
+   straight to the socket `sock'.  The descriptor is only read when the
+   socket can accept the data, so EAGAIN means that the socket is full.
+   Returns the number of bytes sent, 0 on EOF or -1 on error. */
 
-#ifndef USE_LINUX_SELECT
-      delayer.tv_sec = dd_saved.tv_sec;
-      delayer.tv_usec = dd_saved.tv_usec;
-      update_timeval(&delayer);
+static ssize_t core_direct_send(int sock, int fd, core_direct_t type,
+				size_t len)
+{
+#ifdef USE_SENDFILE
+  if (type == CORE_DIRECT_FILE)
+    return sendfile(sock, fd, NULL, len);
 #endif
+#ifdef USE_SPLICE
+  if (type == CORE_DIRECT_PIPE)
+    return splice(fd, NULL, sock, NULL, len, SPLICE_F_MOVE);
+#endif
+  errno = EINVAL;
+  return -1;
+}
 
-      if (ret < 0) {			/* something went wrong (maybe a legal signal) */
-	if (errno == EINTR)
-	  goto handle_signal;
-	perror("select(core_readwrite)");
-	exit(EXIT_FAILURE);
-      }
-      else if (ret == 0) {		/* timeout expired */
-	delayer.tv_sec = 0;
-	delayer.tv_usec = 0;
-      }
+/* Receives up to `len' bytes from the socket `sock' straight into the
+   standard output `fd' of kind `type'.  Regular files can't be spliced to
+   directly from a socket, so the data goes through the pipe `pipefd', which
+   is always emptied before returning.  An output pipe may be non-blocking,
+   so EAGAIN means that either the socket was drained or the pipe is full.
+   Returns the number of bytes received, 0 on EOF or -1 on error. */
 
-      call_select = TRUE;
-      debug(("ret=%d\n", ret));
+static ssize_t core_direct_recv(int fd, core_direct_t type, int sock,
+				int pipefd[2], size_t len)
+{
+#ifdef USE_SPLICE
+  ssize_t ret, done, sent;
+
+  if (type == CORE_DIRECT_PIPE)
+    return splice(sock, NULL, fd, NULL, len, SPLICE_F_MOVE);
+
+  ret = splice(sock, NULL, pipefd[1], NULL, len,
+	       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  for (done = 0; done < ret; done += sent) {
+    sent = splice(pipefd[0], NULL, fd, NULL, ret - done, SPLICE_F_MOVE);
+    if (sent <= 0) {
+      if (sent == 0)
+	errno = EIO;
+      return -1;
     }
+  }
+  return ret;
+#else
+  errno = EINVAL;
+  return -1;
+#endif
+}
 
-    /* reading from stdin the incoming data.  The data is currently in the
-       kernel's receiving queue, and in this session we move that data to our
-       own receiving queue, located in the socket object.  We can be sure that
-       this queue is empty now because otherwise this fd wouldn't have been
-       watched. */
-    if (call_select && FD_ISSET(fd_stdin, &ins)) {
-      read_ret = read(fd_stdin, buf, sizeof(buf));
-      debug_dv(("read(stdin) = %d", read_ret));
+/* Tells if the descriptor `fd' can take some data right now.  A splice(2)
+   between a pipe and a socket that are both non-blocking returns EAGAIN
+   whichever side would block, and this tells the two cases apart. */
 
-      if (read_ret < 0) {
-	perror("read(stdin)");
-	exit(EXIT_FAILURE);
-      }
-      else if (read_ret == 0) {
-	/* when we receive EOF and this is a tunnel say goodbye, otherwise
-	   it means that stdin has finished its input. */
-	if ((netcat_mode == NETCAT_TUNNEL) || opt_eofclose) {
-	  debug_v(("EOF Received from stdin! (exiting from loop..)"));
-	  inloop = FALSE;
-	}
-	else {
-	  debug_v(("EOF Received from stdin! (removing from lookups..)"));
-	  use_stdin = FALSE;
-	}
-      }
-      else {
-	/* we can overwrite safely since if the receive queue is busy this fd
-	   is not watched at all. */
-        nc_slave->recvq.len = read_ret;
-        nc_slave->recvq.head = NULL;
-        nc_slave->recvq.pos = buf;
-      }
-    }
-
-    /* for optimization reasons we have a common buffer for both receiving
-       queues, because of this, handle the data now so the buffer is available
-       for the other socket events. */
-    if (nc_slave->recvq.len > 0) {
-      nc_buffer_t *my_recvq = &nc_slave->recvq;
-      nc_buffer_t *rem_sendq = &nc_main->sendq;
-      debug_v(("there are %d data bytes in slave->recvq", my_recvq->len));
-
-      /* if the remote send queue is empty, move there the entire data block */
-      if (rem_sendq->len == 0) {
-	debug_v(("  moved %d data bytes from slave->recvq to main->sendq", my_recvq->len));
-	memcpy(rem_sendq, my_recvq, sizeof(*rem_sendq));
-	memset(my_recvq, 0, sizeof(*my_recvq));
-      }
-      else if (!my_recvq->head) {
-	/* move the data block in a dedicated allocated space */
-	debug_v(("  reallocating %d data bytes in slave->recvq", my_recvq->len));
-	my_recvq->head = malloc(my_recvq->len);
-	memcpy(my_recvq->head, my_recvq->pos, my_recvq->len);
-	my_recvq->pos = my_recvq->head;
-      }
-    }
-
-    /* now handle the nc_slave sendq because of the same reason as above. There
-       could be a common buffer that moves around the queues, so if this is the case
-       handle it so that it can be reused. If we must delay it some more, copy it
-       in a dynamically allocated space. */
-    if (nc_main->sendq.len > 0) {
-      unsigned char *data = nc_main->sendq.pos;
-      int data_len = nc_main->sendq.len;
-      nc_buffer_t *my_sendq = &nc_main->sendq;
-
-      debug_v(("there are %d data bytes in main->sendq", my_sendq->len));
-
-      /* we have a delayed output, but at this point we might have the
-         send queue pointing to a stack buffer.  In this case, allocate a
-         new buffer and copy the data there for the buffered output. */
-      if (opt_interval) {
-	int i = 0;
+static bool core_writable_now(int fd)
+{
+  struct pollfd pfd;
 
-	if (delayer.tv_sec || delayer.tv_usec)
-	  goto skip_sect;		/* the delay is not yet over! */
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  return ((poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLOUT));
+}
 
-	/* find the newline character.  We are going to output the first line
-	   immediately while we allocate and safe the rest of the data for a
-	   later output. */
-	while (i < data_len)
-	  if (data[i++] == '\n')
-	    break;
+/* Prepares in `iov' the queued data of `q' that should be written with a
+   single call.  The hexdump shows every write as one block, so it only gets
+   the first segment.  When the destination is a datagram socket and the data
+   comes from a stream, the datagrams are cut at CORE_UDP_CHUNK bytes as the
+   traditional netcat did, while data coming from datagrams is kept as it is
+   (one datagram is queued at a time).
+   Returns the number of vectors used. */
 
-	data_len = i;
-	delayer.tv_sec = opt_interval;
-      }
+static int core_queue_iov(nc_buffer_t *q, struct iovec iov[2], bool to_dgram,
+			  bool from_dgram)
+{
+  int iovcnt = netcat_buffer_data(q, iov);
 
-      write_ret = write(fd_sock, data, data_len);
-      if (write_ret < 0) {
-	if (errno == EAGAIN)
-	  write_ret = 0;	/* write would block, append it to select */
-	else {
-	  perror("write(net)");
-	  exit(EXIT_FAILURE);
-	}
-      }
+  if (opt_hexdump || to_dgram)
+    iovcnt = 1;
+  if (to_dgram && !from_dgram && (iov[0].iov_len > CORE_UDP_CHUNK))
+    iov[0].iov_len = CORE_UDP_CHUNK;
+  return iovcnt;
+}
 
-      /* FIXME: fix the below unhandled exception, and find a way to delay the
-       * tries to call write(2) in case of EAGAIN, i think 100ms would be fine
-       * for most systems. A too high value would not use all the bandwidth on
-       * bigger installations, while a too small value would eat cpu with
-       * kernel overhead. */
+/* Trims the `iovcnt' vectors `iov' so that they hold `max' bytes at most.
+   Returns the number of vectors left. */
 
-      bytes_sent += write_ret;		/* update statistics */
-      debug_dv(("write(net) = %d (buf=%p)", write_ret, (void *)data));
+static int core_iov_limit(struct iovec *iov, int iovcnt, int max)
+{
+  int i;
 
-      if (write_ret < data_len) {
-	debug_v(("Damn! I wanted to send to sock %d bytes but it only sent %d",
-		data_len, write_ret));
-	data_len = write_ret;
-      }
+  for (i = 0; i < iovcnt; i++) {
+    if ((int) iov[i].iov_len >= max) {
+      iov[i].iov_len = max;
+      return i + 1;
+    }
+    max -= iov[i].iov_len;
+  }
+  return iovcnt;
+}
 
-      /* if the option is set, hexdump the sent data */
-      if (opt_hexdump) {
-#ifndef USE_OLD_HEXDUMP
-	fprintf(output_fp, "Sent %u bytes to the socket\n", write_ret);
+/* The data sent to the net may need some bytes added on the way out: with -T a
+   data byte 255 is sent twice, so that it's not taken for a telnet code (IAC),
+   and with --crlf every LF goes out as CR LF, unless it already follows a CR
+   (`last' is the last queued byte written, for the LF at the start of the
+   queue).  The queued data isn't copied for this: it's cut in front of each
+   byte that needs one more, and the added byte goes in a vector element of its
+   own, so the common case (no such byte in the queue) is a single writev(2) of
+   the queue as it is.  The telnet answers go in front of the queued data, in
+   the same write.  Since a write may end between an added byte and the byte it
+   belongs to, `added' remembers that the first queued byte doesn't need it
+   anymore. */
+
+#define CORE_XLAT_IOV 1024
+
+enum {
+  CORE_XLAT_DATA,
+  CORE_XLAT_ADDED,
+  CORE_XLAT_REPLY
+};
+
+typedef struct {
+  bool on, iac, crlf;
+  bool added;
+  unsigned char last;
+  unsigned char *dump;		/* the bytes written, for the hexdump */
+  int dump_size;
+} core_xlat_t;
+
+static unsigned char core_xlat_cr = '\r', core_xlat_iac = 255;
+
+/* Sets up the transform of the data sent as the options ask */
+
+static void core_xlat_init(core_xlat_t *x)
+{
+  memset(x, 0, sizeof(*x));
+#ifndef USE_OLD_TELNET
+  x->iac = opt_telnet;
 #endif
-	netcat_fhexdump(output_fp, '>', data, data_len);
-      }
+  x->crlf = opt_crlf;
+  x->on = (opt_telnet || opt_crlf);
+}
 
-      /* update the queue */
-      my_sendq->len -= data_len;
-      my_sendq->pos += data_len;
+/* Returns the queued byte that comes before `p', which is in the vector `i'
+   of `iov' */
 
- skip_sect:
-      debug_v(("there are %d data bytes left in the queue", my_sendq->len));
-      if (my_sendq->len == 0) {
-	free(my_sendq->head);
-	memset(my_sendq, 0, sizeof(*my_sendq));
-      }
-      else if (!my_sendq->head) {
-	my_sendq->head = malloc(my_sendq->len);
-	memcpy(my_sendq->head, my_sendq->pos, my_sendq->len);
-	my_sendq->pos = my_sendq->head;
-      }
+static unsigned char core_xlat_before(core_xlat_t *x, struct iovec *iov,
+				      int i, unsigned char *p)
+{
+  if (p > (unsigned char *) iov[i].iov_base)
+    return p[-1];
+  if (i > 0)
+    return ((unsigned char *) iov[i - 1].iov_base)[iov[i - 1].iov_len - 1];
+  return x->last;
+}
 
-    }				/* end of reading from stdin section */
+/* Writes to `fd' the telnet answers waiting in `t' and then the `iovcnt'
+   vectors of queued data `iov', with the bytes added by the transform `x'.
+   The answers that went out are removed from `t'.  Returns what writev(2)
+   returns, and stores in `queued' how many of the queued bytes went out. */
 
-    /* reading from the socket (net). */
-    if (call_select && FD_ISSET(fd_sock, &ins)) {
-      if ((nc_main->proto == NETCAT_PROTO_UDP) && opt_zero) {
-	memset(&recv_addr, 0, sizeof(recv_addr));
-	/* this allows us to fetch packets from different addresses */
-	read_ret = recvfrom(fd_sock, buf, sizeof(buf), 0,
-			    (struct sockaddr *)&recv_addr, &recv_len);
-	/* when recvfrom() call fails, recv_addr remains untouched */
-	debug_dv(("recvfrom(net) = %d (address=%s:%d)", read_ret,
-		netcat_inet_ntop(&recv_addr.sin_addr), ntohs(recv_addr.sin_port)));
+static int core_xlat_writev(core_xlat_t *x, int fd, nc_telnet_t *t,
+			    struct iovec *iov, int iovcnt, int *queued)
+{
+  struct iovec out[CORE_XLAT_IOV];
+  unsigned char kind[CORE_XLAT_IOV];
+  bool full = FALSE, skip = x->added;
+  int i, n = 0, ret, left;
+
+  /* the answers can't go between an added byte and its own byte */
+  if ((t->reply_len > 0) && !x->added) {
+    out[n].iov_base = t->reply;
+    out[n].iov_len = t->reply_len;
+    kind[n++] = CORE_XLAT_REPLY;
+  }
+
+  for (i = 0; (i < iovcnt) && !full; i++) {
+    unsigned char *p = iov[i].iov_base, *end = p + iov[i].iov_len, *from = p;
+    unsigned char *lf = (x->crlf ? NULL : end), *ff = (x->iac ? NULL : end);
+
+    if (skip) {
+      from++;
+      skip = FALSE;
+    }
+    while (p < end) {
+      unsigned char *next;
+
+      /* each kind of byte is looked for again only once it's passed */
+      if (!lf || (lf < from)) {
+	lf = memchr(from, '\n', end - from);
+	while (lf && (core_xlat_before(x, iov, i, lf) == '\r'))
+	  lf = memchr(lf + 1, '\n', end - lf - 1);
+	if (!lf)
+	  lf = end;
       }
-      else {
-	/* common file read fallback */
-	read_ret = read(fd_sock, buf, sizeof(buf));
-	debug_dv(("read(net) = %d", read_ret));
+      if (!ff || (ff < from)) {
+	ff = memchr(from, 255, end - from);
+	if (!ff)
+	  ff = end;
       }
+      next = (lf < ff ? lf : ff);
 
-      if (read_ret < 0) {
-	perror("read(net)");
-	exit(EXIT_FAILURE);
-      }
-      else if (read_ret == 0) {
-	debug_v(("EOF Received from the net"));
-	inloop = FALSE;
+      if (next > p) {
+	if (n == CORE_XLAT_IOV) {
+	  full = TRUE;
+	  break;
+	}
+	out[n].iov_base = p;
+	out[n].iov_len = next - p;
+	kind[n++] = CORE_XLAT_DATA;
       }
-      else {
-	nc_main->recvq.len = read_ret;
-	nc_main->recvq.head = NULL;
-	nc_main->recvq.pos = buf;
+      if (next == end)
+	break;
+      if (n + 2 > CORE_XLAT_IOV) {
+	full = TRUE;
+	break;
       }
+      out[n].iov_base = (*next == '\n' ? &core_xlat_cr : &core_xlat_iac);
+      out[n].iov_len = 1;
+      kind[n++] = CORE_XLAT_ADDED;
+      p = next;
+      from = next + 1;
     }
+  }
 
-    /* handle net receiving queue */
-    if (nc_main->recvq.len > 0) {
-      nc_buffer_t *my_recvq = &nc_main->recvq;
-      nc_buffer_t *rem_sendq = &nc_slave->sendq;
+  *queued = 0;
+  ret = writev(fd, out, n);
+  if (ret <= 0)
+    return ret;
 
-      /* check for telnet codes (if enabled).  Note that the buffered output
-         interval does NOT apply to telnet code answers */
-      if (opt_telnet)
-	netcat_telnet_parse(nc_main);
-
-      /* the telnet parsing could have returned 0 chars! */
-      if (my_recvq->len > 0) {
-	/* if the remote send queue is empty, move there the entire data block */
-	if (rem_sendq->len == 0) {
-	  memcpy(rem_sendq, my_recvq, sizeof(*rem_sendq));
-	  memset(my_recvq, 0, sizeof(*my_recvq));
-	}
-	else if (!my_recvq->head) {
-	  /* move the data block in a dedicated allocated space */
-	  my_recvq->head = malloc(my_recvq->len);
-	  memcpy(my_recvq->head, my_recvq->pos, my_recvq->len);
-	  my_recvq->pos = my_recvq->head;
-	}
-      }
+  /* find out where the write ended */
+  for (i = 0, left = ret; (i < n) && (left > 0); i++) {
+    int len = (left < (int) out[i].iov_len ? left : (int) out[i].iov_len);
+
+    left -= len;
+    if (kind[i] == CORE_XLAT_DATA) {
+      *queued += len;
+      x->added = FALSE;
+      x->last = ((unsigned char *) out[i].iov_base)[len - 1];
     }
+    else if (kind[i] == CORE_XLAT_ADDED)
+      x->added = TRUE;
+    else {
+      t->reply_len -= len;
+      memmove(t->reply, t->reply + len, t->reply_len);
+    }
+  }
 
-    if (nc_slave->sendq.len > 0) {
-      unsigned char *data = nc_slave->sendq.pos;
-      int data_len = nc_slave->sendq.len;
-      nc_buffer_t *my_sendq = &nc_slave->sendq;
+  /* the hexdump shows the bytes as they went out */
+  if (opt_hexdump) {
+    if (ret > x->dump_size) {
+      unsigned char *dump = realloc(x->dump, ret);
 
-      write_ret = write(fd_stdout, data, data_len);
-      bytes_recv += write_ret;		/* update statistics */
-      debug_dv(("write(stdout) = %d", write_ret));
+      if (!dump)
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Couldn't allocate the data queues: %s"), strerror(errno));
+      x->dump = dump;
+      x->dump_size = ret;
+    }
+    for (i = 0, left = ret; (i < n) && (left > 0); i++) {
+      int len = (left < (int) out[i].iov_len ? left : (int) out[i].iov_len);
+
+      memcpy(x->dump + ret - left, out[i].iov_base, len);
+      left -= len;
+    }
+  }
+  return ret;
+}
+
+#ifdef USE_ZEROCOPY
+/* Writes shorter than this are copied as usual, since pinning the pages and
+   reaping the completion would cost more than the copy itself (bytes) */
+#define CORE_ZC_MIN (16 * 1024)
+
+/* Maximum number of writes whose memory may be pinned at the same time */
+#define CORE_ZC_MAX 256
+
+/* How long the end of the session waits for the last completions (ms) */
+#define CORE_ZC_DRAIN 1000
+
+/* A write that left its data pinned in the sending queue.  A zero-copy
+   write is done when the kernel reports the completion of its sequence
+   number, while a common write is done at once, but its memory can only be
+   given back after the one of the earlier writes. */
+
+typedef struct {
+  unsigned int seq;
+  int len;
+  bool zc, done;
+} core_zc_write_t;
+
+/* The zero-copy state of a socket: the ring of the writes in flight, from
+   the oldest one, and the sequence number of the next zero-copy write */
+
+typedef struct {
+  bool on;
+  unsigned int seq;
+  int first, count;
+  core_zc_write_t w[CORE_ZC_MAX];
+} core_zc_t;
+
+/* Enables the zero-copy writes on the socket `fd'.  The kernel reports the
+   completions on the error queue, which can only wake up the loop with the
+   epoll engine.  Returns TRUE on success. */
+
+static bool core_zc_init(core_zc_t *zc, int fd, nc_evengine_t engine)
+{
+  int on = 1;
+
+  memset(zc, 0, sizeof(*zc));
+  if (engine != NETCAT_EVENT_EPOLL)
+    ncprint(NCPRINT_VERB1 | NCPRINT_WARNING,
+	    _("Zero-copy sends need the epoll engine, copying the data"));
+  else if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+    ncprint(NCPRINT_VERB1 | NCPRINT_WARNING,
+	    _("Zero-copy sends not available: %s"), strerror(errno));
+  else
+    zc->on = TRUE;
+  return zc->on;
+}
+
+/* Writes the `iovcnt' vectors `iov' of the sending queue to the socket
+   `fd'.  Large writes are zero-copy, and any write that finds some memory
+   still pinned is tracked as well, so that the queue is given back in
+   order.  The caller must pin the written data instead of dropping it when
+   `zc->count' is not 0 after the call.
+   Returns the number of bytes written or -1 on error. */
+
+static int core_zc_writev(core_zc_t *zc, int fd, struct iovec *iov,
+			  int iovcnt)
+{
+  struct msghdr msg;
+  core_zc_write_t *w;
+  int i, len = 0, flags = 0, ret;
+
+  assert(zc->count < CORE_ZC_MAX);
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (zc->on && (len >= CORE_ZC_MIN))
+    flags = MSG_ZEROCOPY;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  ret = sendmsg(fd, &msg, flags);
+
+  /* the pinned pages count in the socket memory, copy when it's over */
+  if ((ret < 0) && (errno == ENOBUFS) && flags) {
+    flags = 0;
+    ret = sendmsg(fd, &msg, 0);
+  }
+  debug_dv(("sendmsg(net, %s) = %d", (flags ? "zerocopy" : "copy"), ret));
+  if ((ret <= 0) || (!flags && (zc->count == 0)))
+    return ret;
+
+  w = &zc->w[(zc->first + zc->count++) % CORE_ZC_MAX];
+  w->len = ret;
+  w->zc = (flags != 0);
+  w->done = !w->zc;
+  if (w->zc)
+    w->seq = zc->seq++;
+  return ret;
+}
+
+/* Reads the completions from the error queue of the socket `fd' and gives
+   back to the sending queue `q' the memory of the writes that are done.
+   If the kernel had to copy the data anyway (the loopback device, or cards
+   without scatter-gather), the next writes are simply copied. */
+
+static void core_zc_reap(core_zc_t *zc, int fd, nc_buffer_t *q)
+{
+  unsigned char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  int i;
+
+  while (TRUE) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err *ee = (void *) CMSG_DATA(cm);
+      unsigned int lo = ee->ee_info, hi = ee->ee_data;
+
+      if ((cm->cmsg_level != SOL_IP) || (cm->cmsg_type != IP_RECVERR) ||
+	  (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || (ee->ee_errno != 0))
+	continue;
+      debug_dv(("zerocopy completion %u-%u%s", lo, hi,
+		(ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED ? " (copied)" : "")));
+      if ((ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zc->on) {
+	ncprint(NCPRINT_VERB2, _("Zero-copy sends are copied by the kernel, "
+				 "disabling them"));
+	zc->on = FALSE;
+      }
+
+      /* the sequence numbers wrap around */
+      for (i = 0; i < zc->count; i++) {
+	core_zc_write_t *w = &zc->w[(zc->first + i) % CORE_ZC_MAX];
+
+	if (w->zc && (w->seq - lo <= hi - lo))
+	  w->done = TRUE;
+      }
+    }
+  }
+
+  while ((zc->count > 0) && zc->w[zc->first].done) {
+    netcat_buffer_unpin(q, zc->w[zc->first].len);
+    zc->first = (zc->first + 1) % CORE_ZC_MAX;
+    zc->count--;
+  }
+}
+
+/* Waits for the completions of all the writes still in flight on the socket
+   `fd', for up to CORE_ZC_DRAIN milliseconds, so that the sending queue `q'
+   can be released.  The completions wake up poll(2) as errors.
+   Returns TRUE if the memory of the queue isn't pinned anymore. */
+
+static bool core_zc_drain(core_zc_t *zc, int fd, nc_buffer_t *q)
+{
+  double deadline = netcat_clock() + CORE_ZC_DRAIN / 1000.0;
+
+  core_zc_reap(zc, fd, q);
+  while (zc->count > 0) {
+    struct pollfd pfd;
+    int left = (int) ((deadline - netcat_clock()) * 1000);
+
+    if (left <= 0)
+      break;
+    pfd.fd = fd;
+    pfd.events = 0;
+    if ((poll(&pfd, 1, left) < 0) && (errno != EINTR))
+      break;
+    core_zc_reap(zc, fd, q);
+  }
+  return (zc->count == 0);
+}
+#endif
+
+/* With --sink the received data is dropped instead of being written to
+   stdout, after checking it against the expected pattern (if any).  The
+   data is counted as if it was written, so the statistics still hold. */
+
+typedef struct {
+  nc_pattern_t check;		/* expected data (NETCAT_PATTERN_NONE: any) */
+  unsigned long long bad;	/* bytes that didn't match */
+} core_sink_t;
+
+/* Takes the data in the `iovcnt' buffers of `iov' into the sink `sk', as
+   writev(2) would do.  Returns the number of bytes taken. */
+
+static int core_sink_writev(core_sink_t *sk, const struct iovec *iov,
+			    int iovcnt)
+{
+  int i, ret = 0;
+
+  for (i = 0; i < iovcnt; i++) {
+    if (sk->check.type != NETCAT_PATTERN_NONE) {
+      unsigned long long first;
+      size_t bad = netcat_pattern_verify(&sk->check, iov[i].iov_base,
+					 iov[i].iov_len, &first);
+
+      /* only the first mismatch is reported, the rest are counted */
+      if (bad && !sk->bad)
+	ncprint(NCPRINT_WARNING,
+		_("Received data doesn't match the pattern at offset %llu"),
+		first);
+      sk->bad += bad;
+    }
+    ret += iov[i].iov_len;
+  }
+  return ret;
+}
+
+/* The datagram batches.  Each message of a receiving batch has its own
+   buffer, big enough for the largest datagram, so that a whole batch can be
+   received with a single recvmmsg(2) call.  The batch is then delivered to
+   the other side one datagram per message (sendmmsg(2)) or as a single
+   stream write, and the next batch is only received when this one is done.
+   `iov' holds one vector for each received message, or two for each message
+   built from the sending queue, which may wrap around. */
+
+#ifdef USE_MMSG
+typedef struct mmsghdr core_mmsghdr_t;
+#else
+typedef struct {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} core_mmsghdr_t;
+#endif
+
+typedef struct {
+  core_mmsghdr_t *msgs;
+  struct iovec *iov;
+  struct sockaddr_in *addrs;	/* the source of each received datagram */
+  unsigned char *data;
+  int depth, count, next;
+} core_dgram_t;
+
+/* Tells if some datagrams of the batch `b' weren't delivered yet */
+#define CORE_DGRAM_PENDING(b) ((b)->next < (b)->count)
+
+/* Receives up to `n' datagrams from `fd' without blocking.  If the system
+   doesn't have recvmmsg(2) the datagrams are received one by one.
+   Returns the number of datagrams received or -1 on error. */
+
+static int core_recvmmsg(int fd, core_mmsghdr_t *msgs, int n)
+{
+#ifdef USE_MMSG
+  return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+#else
+  int i, ret;
+
+  for (i = 0; i < n; i++) {
+    ret = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+    if (ret < 0)
+      return (i > 0 ? i : -1);
+    msgs[i].msg_len = ret;
+  }
+  return n;
+#endif
+}
+
+/* Sends up to `n' datagrams to `fd', the counterpart of core_recvmmsg().
+   Returns the number of datagrams sent or -1 on error. */
+
+static int core_sendmmsg(int fd, core_mmsghdr_t *msgs, int n)
+{
+#ifdef USE_MMSG
+  return sendmmsg(fd, msgs, n, 0);
+#else
+  int i, ret;
+
+  for (i = 0; i < n; i++) {
+    ret = sendmsg(fd, &msgs[i].msg_hdr, 0);
+    if (ret < 0)
+      return (i > 0 ? i : -1);
+    msgs[i].msg_len = ret;
+  }
+  return n;
+#endif
+}
+
+/* Allocates the batch `b' for `depth' messages.  The data buffers are only
+   needed if the batch is used for receiving datagrams (`rx').
+   Returns TRUE on success or FALSE if the memory couldn't be allocated. */
+
+static bool core_dgram_init(core_dgram_t *b, int depth, bool rx)
+{
+  memset(b, 0, sizeof(*b));
+  b->depth = depth;
+  b->msgs = calloc(depth, sizeof(*b->msgs));
+  b->iov = calloc(depth * 2, sizeof(*b->iov));
+  b->addrs = calloc(depth, sizeof(*b->addrs));
+  if (rx)
+    b->data = malloc(depth * CORE_DGRAM_MAX);
+  return (b->msgs && b->iov && b->addrs && (!rx || b->data));
+}
+
+/* Releases the memory of the batch `b' */
+
+static void core_dgram_free(core_dgram_t *b)
+{
+  free(b->msgs);
+  free(b->iov);
+  free(b->addrs);
+  free(b->data);
+  memset(b, 0, sizeof(*b));
+}
+
+/* Receives a new batch of datagrams from `fd' into `b', which must have been
+   delivered completely.  Returns the number of datagrams received or -1 on
+   error. */
+
+static int core_dgram_recv(core_dgram_t *b, int fd)
+{
+  int i, ret;
+
+  assert(b->data && !CORE_DGRAM_PENDING(b));
+  for (i = 0; i < b->depth; i++) {
+    struct msghdr *hdr = &b->msgs[i].msg_hdr;
+
+    b->iov[i].iov_base = b->data + i * CORE_DGRAM_MAX;
+    b->iov[i].iov_len = CORE_DGRAM_MAX;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &b->addrs[i];
+    hdr->msg_namelen = sizeof(b->addrs[i]);
+    hdr->msg_iov = &b->iov[i];
+    hdr->msg_iovlen = 1;
+  }
+
+  ret = core_recvmmsg(fd, b->msgs, b->depth);
+  if (ret < 0)
+    return -1;
+  for (i = 0; i < ret; i++)
+    b->iov[i].iov_len = b->msgs[i].msg_len;
+  b->count = ret;
+  b->next = 0;
+  return ret;
+}
+
+/* Returns the data of the next datagram to be delivered from `b' */
+
+static unsigned char *core_dgram_peek(core_dgram_t *b)
+{
+  assert(CORE_DGRAM_PENDING(b));
+  return b->iov[b->next].iov_base;
+}
+
+/* Delivers up to `max' of the pending datagrams of `b' to `fd'.  If `fd' is
+   a datagram socket each datagram is sent as it was received, otherwise the
+   payloads are written as a stream and a partial write leaves the rest of
+   the datagram pending.  If `sink' is not NULL the payloads go there
+   instead of `fd'.
+   Returns the number of bytes written or -1 on error. */
+
+static int core_dgram_flush(core_dgram_t *b, int fd, bool to_dgram, int max,
+			    core_sink_t *sink)
+{
+  int i, ret, n = b->count - b->next, len = 0;
+
+  if (n > max)
+    n = max;
+
+  if (to_dgram) {
+    for (i = b->next; i < b->next + n; i++) {
+      b->msgs[i].msg_hdr.msg_name = NULL;	/* the socket is connected */
+      b->msgs[i].msg_hdr.msg_namelen = 0;
+    }
+    ret = core_sendmmsg(fd, &b->msgs[b->next], n);
+    if (ret < 0)
+      return -1;
+    for (i = b->next; i < b->next + ret; i++)
+      len += b->iov[i].iov_len;
+    b->next += ret;
+    return len;
+  }
+
+  if (sink)
+    ret = core_sink_writev(sink, &b->iov[b->next], n);
+  else
+    ret = writev(fd, &b->iov[b->next], n);
+  if (ret < 0)
+    return -1;
+  for (len = ret; CORE_DGRAM_PENDING(b) &&
+       ((int) b->iov[b->next].iov_len <= len); b->next++)
+    len -= b->iov[b->next].iov_len;
+  if (CORE_DGRAM_PENDING(b)) {
+    b->iov[b->next].iov_base = (unsigned char *) b->iov[b->next].iov_base + len;
+    b->iov[b->next].iov_len -= len;
+  }
+  return ret;
+}
+
+/* Tells how many of the pending datagrams of `b', at least one, can be
+   delivered without exceeding `max_len' bytes. */
+
+static int core_dgram_fit(core_dgram_t *b, int max_len)
+{
+  int i, len = 0;
+
+  for (i = b->next; i < b->count; i++) {
+    len += b->iov[i].iov_len;
+    if ((len > max_len) && (i > b->next))
+      break;
+  }
+  return i - b->next;
+}
+
+/* Sends the data of the queue `q' to the datagram socket `fd', cut in up to
+   `max' datagrams of CORE_UDP_CHUNK bytes each.  No more datagrams are added
+   once they hold `max_len' bytes, but the last one is never cut short.  The
+   datagrams point straight into the queue, so the data is not copied.
+   Every datagram but the last one is full, so the number of datagrams sent
+   can be told from the number of bytes.
+   Returns the number of bytes sent, which the caller must drop from the
+   queue, or -1 on error. */
+
+static int core_dgram_send_queue(core_dgram_t *b, int fd, nc_buffer_t *q,
+				 int max, int max_len)
+{
+  struct iovec seg[2];
+  int i, n, ret, segcnt, s = 0, off = 0, len = 0;
+
+  if (max > b->depth)
+    max = b->depth;
+  segcnt = netcat_buffer_data(q, seg);
+  for (n = 0; (n < max) && (s < segcnt) && (len < max_len); n++) {
+    struct msghdr *hdr = &b->msgs[n].msg_hdr;
+    int chunk = 0;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_iov = &b->iov[n * 2];
+
+    /* a datagram takes the end of a segment and the start of the next one
+       when the data wraps around the end of the queue */
+    while ((chunk < CORE_UDP_CHUNK) && (s < segcnt)) {
+      int piece = seg[s].iov_len - off;
+
+      if (piece > CORE_UDP_CHUNK - chunk)
+	piece = CORE_UDP_CHUNK - chunk;
+      hdr->msg_iov[hdr->msg_iovlen].iov_base =
+	(unsigned char *) seg[s].iov_base + off;
+      hdr->msg_iov[hdr->msg_iovlen].iov_len = piece;
+      hdr->msg_iovlen++;
+      chunk += piece;
+      len += piece;
+      off += piece;
+      if (off == (int) seg[s].iov_len) {
+	s++;
+	off = 0;
+      }
+    }
+  }
+
+  ret = core_sendmmsg(fd, b->msgs, n);
+  if (ret < 0)
+    return -1;
+  for (len = 0, i = 0; i < ret; i++)
+    len += b->msgs[i].msg_len;
+  return len;
+}
+
+/* Parses the telnet codes (if enabled) in each datagram of the batch `b'
+   that was just received on the socket `ncsock'. */
+
+static void core_dgram_telnet(core_dgram_t *b, nc_sock_t *ncsock)
+{
+  int i;
+
+  for (i = 0; i < b->count; i++) {
+    int len = b->iov[i].iov_len;
+
+    netcat_telnet_parse(ncsock, b->iov[i].iov_base, &len);
+    b->iov[i].iov_len = len;
+  }
+}
+
+/* handle stdin/stdout/network I/O. */
+
+int core_readwrite(nc_sock_t *nc_main, nc_sock_t *nc_slave)
+{
+  int read_ret, write_ret, spin = 0;
+  int direct_pipe[2] = { -1, -1 }, direct_len = CORE_DIRECT_CHUNK;
+  bool delaying = FALSE, eof_net = FALSE, eof_in = FALSE;
+  bool dgram_main, dgram_slave, shaping = (opt_rate || opt_pps);
+  bool recv_full = FALSE, send_full = FALSE, generating, gen_done = FALSE;
+  bool sinking;
+  struct timeval delay_end;
+  nc_bucket_t rate_send, rate_recv, pps_send, pps_recv;
+  nc_evloop_t ev;
+  nc_buffer_t *sendq, *recvq;
+  core_dgram_t dg_recv, dg_send;
+  nc_pattern_t gen = opt_generate;
+  core_sink_t sink;
+  core_xlat_t xlat;
+  core_fd_t fd_sock, fd_stdin, fd_stdout, *fd_in, *fd_out;
+  core_direct_t direct_in = CORE_DIRECT_NONE, direct_out = CORE_DIRECT_NONE;
+#ifdef USE_ZEROCOPY
+  core_zc_t zc;
+#endif
+  assert(nc_main && nc_slave);
+
+  debug_v(("core_readwrite(nc_main=%p, nc_slave=%p)", (void *)nc_main,
+	  (void *)nc_slave));
+  netcat_stats_start();
+
+#ifdef USE_URING
+  /* the io_uring pump moves the data as it is, so it can't be used when
+     something has to look at it or make it up, and it only knows about
+     streams */
+  if ((opt_engine == NETCAT_EVENT_URING) && !opt_hexdump && !opt_telnet &&
+      !opt_crlf && !opt_interval && !shaping && !opt_zerocopy &&
+      (opt_generate.type == NETCAT_PATTERN_NONE) && !opt_sink &&
+      (nc_main->proto == NETCAT_PROTO_TCP) &&
+      (nc_slave->proto != NETCAT_PROTO_UDP) && (nc_main->recvq.len == 0)) {
+    if (netcat_uring_readwrite(nc_main, nc_slave) == 0)
+      return 0;
+    ncprint(NCPRINT_VERB2, _("io_uring not available, using the event loop"));
+  }
+#endif
+
+#ifdef USE_SPLICE
+  /* a tunnel between two TCP sockets doesn't need to see the data, unless
+     something has to look at it (hexdump, telnet codes, line ends or the
+     line delays) or to hold it back (shaping) */
+  if ((netcat_mode == NETCAT_TUNNEL) && opt_splice && !opt_hexdump &&
+      !opt_telnet && !opt_crlf && !opt_interval && !shaping &&
+      (nc_main->proto == NETCAT_PROTO_TCP) &&
+      (nc_slave->proto == NETCAT_PROTO_TCP) && (nc_main->recvq.len == 0)) {
+    if (core_splice_readwrite(nc_main, nc_slave) == 0)
+      return 0;
+    ncprint(NCPRINT_VERB2, _("splice(2) not available, copying the data"));
+  }
+#endif
+
+  /* each direction has its own queue, both of them held by the main socket:
+     the data received from the net waits in the receiving queue until it's
+     written to the output, while the input waits in the sending queue.  The
+     receiving queue may already contain some data (UDP listen mode), and
+     the sending queue the input read by the io_uring pump before it fell
+     back to this loop. */
+  recvq = &nc_main->recvq;
+  sendq = &nc_main->sendq;
+  if (!netcat_buffer_init(recvq, (recvq->len > opt_buffer_size ? recvq->len :
+				  opt_buffer_size)) ||
+      !netcat_buffer_init(sendq, (sendq->len > opt_buffer_size ? sendq->len :
+				  opt_buffer_size)))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+  dgram_main = (nc_main->proto == NETCAT_PROTO_UDP);
+  dgram_slave = (nc_slave->proto == NETCAT_PROTO_UDP);
+
+  /* with --generate, the data to send is made up right into the sending
+     queue and stdin is left alone */
+  generating = ((gen.type != NETCAT_PATTERN_NONE) &&
+		(nc_slave->domain == PF_UNSPEC));
+
+  /* with --sink, the received data is dropped (and maybe checked) instead
+     of being written to stdout */
+  sinking = (opt_sink && (nc_slave->domain == PF_UNSPEC));
+  memset(&sink, 0, sizeof(sink));
+  sink.check.type = opt_sink_pattern;
+
+  /* the data sent may need some bytes added (-T and --crlf) */
+  core_xlat_init(&xlat);
+
+  /* the datagrams are moved in batches, in both directions: the ones
+     received from the net wait in `dg_recv', while the input (if it's a
+     datagram socket too) waits in `dg_send'.  The sending batch is also used
+     to cut the sending queue into datagrams. */
+  memset(&dg_recv, 0, sizeof(dg_recv));
+  memset(&dg_send, 0, sizeof(dg_send));
+  if ((dgram_main || dgram_slave) &&
+      (!core_dgram_init(&dg_recv, opt_udp_batch, dgram_main) ||
+       !core_dgram_init(&dg_send, opt_udp_batch, dgram_slave)))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+
+  /* each direction is shaped on its own, in bytes and in datagrams */
+  netcat_bucket_init(&rate_send, opt_rate);
+  netcat_bucket_init(&rate_recv, opt_rate);
+  netcat_bucket_init(&pps_send, opt_pps);
+  netcat_bucket_init(&pps_recv, opt_pps);
+
+  memset(&fd_sock, 0, sizeof(fd_sock));
+  memset(&fd_stdin, 0, sizeof(fd_stdin));
+  memset(&fd_stdout, 0, sizeof(fd_stdout));
+  netcat_event_init(&ev, opt_engine);
+
+  /* set the actual input and output fds.  The network sockets are ours, so
+     they are made non-blocking and, with an edge-triggered engine, drained
+     until EAGAIN.  Standard I/O is shared with other processes instead, so
+     it's watched in level-triggered mode and it's only non-blocking while
+     the loop runs (see core_stdio_nonblock()). */
+  fd_sock.fd = nc_main->fd;
+  assert(fd_sock.fd >= 0);
+  fd_sock.edge = (ev.engine != NETCAT_EVENT_SELECT);
+  fd_in = &fd_stdin;
+
+  /* if the domain is unspecified, it means that this is the standard I/O */
+  if (nc_slave->domain == PF_UNSPEC) {
+    fd_stdin.fd = STDIN_FILENO;
+    fd_stdout.fd = STDOUT_FILENO;
+    fd_out = &fd_stdout;
+  }
+  else {
+    fd_stdin.fd = nc_slave->fd;
+    assert(fd_stdin.fd >= 0);
+    fd_stdin.edge = fd_sock.edge;
+    fd_out = &fd_stdin;		/* the same socket for both directions */
+  }
+
+  /* when nobody needs to look at the data exchanged with the standard I/O,
+     the kernel can move it to and from the socket without our buffers */
+  if ((nc_slave->domain == PF_UNSPEC) && (nc_main->proto == NETCAT_PROTO_TCP) &&
+      !opt_hexdump) {
+    if (!opt_interval && !generating && !xlat.on)
+      direct_in = core_direct_type(STDIN_FILENO, FALSE);
+    if (!opt_telnet && !sinking)
+      direct_out = core_direct_type(STDOUT_FILENO, TRUE);
+#ifdef USE_SPLICE
+    if ((direct_out == CORE_DIRECT_FILE) &&
+	((direct_len = core_pipe_open(direct_pipe)) < 0))
+      direct_out = CORE_DIRECT_NONE;
+#endif
+    debug_v(("direct standard I/O: in=%d out=%d", direct_in, direct_out));
+  }
+
+  if (core_set_nonblock(fd_sock.fd) < 0)
+    fd_sock.edge = FALSE;
+  if (nc_slave->domain != PF_UNSPEC) {
+    if (core_set_nonblock(fd_in->fd) < 0)
+      fd_in->edge = FALSE;
+  }
+  else {
+    if (use_stdin && !generating)
+      core_stdio_nonblock(STDIN_FILENO);
+    if (!sinking)
+      core_stdio_nonblock(STDOUT_FILENO);
+  }
+
+#ifdef USE_ZEROCOPY
+  /* the zero-copy writes are for the data that goes through the sending
+     queue to a stream socket */
+  memset(&zc, 0, sizeof(zc));
+  if (opt_zerocopy && !dgram_main && (direct_in == CORE_DIRECT_NONE) &&
+      !xlat.on)
+    core_zc_init(&zc, fd_sock.fd, ev.engine);
+#endif
+
+  /* unless proven otherwise (EAGAIN), every output is writable.  The
+     generated data is always ready, like a regular file, and so is the
+     sink. */
+  core_event_add(&ev, &fd_sock);
+  if (generating) {
+    fd_in->edge = TRUE;
+    fd_in->pollable = FALSE;
+    fd_in->ready = NC_EV_READ;
+  }
+  else
+    core_event_add(&ev, fd_in);
+  if (sinking) {
+    fd_out->edge = TRUE;
+    fd_out->pollable = FALSE;
+  }
+  else if (fd_out != fd_in)
+    core_event_add(&ev, fd_out);
+  fd_sock.ready |= NC_EV_WRITE;
+  fd_out->ready |= NC_EV_WRITE;
+
+  debug_v(("using the %s engine (edge-triggered: %s)",
+	  netcat_event_name(ev.engine), BOOL_TO_STR(fd_sock.edge)));
+
+  /* use the internal signal handler */
+  signal_handler = FALSE;
+
+  while (TRUE) {
+    int iovcnt, want_sock = 0, want_in = 0, want_out = 0;
+    int send_allow = INT_MAX, send_dgrams = INT_MAX;
+    int recv_allow = INT_MAX, recv_dgrams = INT_MAX;
+    bool ready_work, hold_send, hold_recv = FALSE;
+    struct iovec iov[2];
+    struct timeval delayer, shaper, *timeout = NULL, *hold_wait = NULL;
+
+    /* if we received an interrupt signal break this function */
+    if (got_sigint) {
+      got_sigint = FALSE;
+      break;
+    }
+    /* if we received a terminating signal we must terminate */
+    if (got_sigterm)
+      break;
+
+    /* after an EOF the loop only goes on until the data already received
+       has been delivered to the other side */
+    if ((eof_net && (recvq->len == 0) && !CORE_DGRAM_PENDING(&dg_recv)) ||
+	(eof_in && (sendq->len == 0) && !CORE_DGRAM_PENDING(&dg_send)))
+      break;
+
+    /* check whether the delayed output (-i) interval is over */
+    if (delaying) {
+      struct timeval now;
+
+      gettimeofday(&now, NULL);
+      delayer = delay_end;
+      netcat_timeval_sub(&delayer, &now);
+      if (!delayer.tv_sec && !delayer.tv_usec)
+	delaying = FALSE;
+    }
+    hold_send = delaying;
+    if (delaying)
+      hold_wait = &delayer;
+
+    /* find out how much each direction may move now (--rate and --pps).  A
+       direction whose buckets are empty is held back like a delayed output,
+       until the first of them holds enough tokens again. */
+    if (shaping) {
+      nc_bucket_t *empty[4];
+      int i, n = 0;
+
+      send_allow = netcat_bucket_avail(&rate_send);
+      send_dgrams = netcat_bucket_avail(&pps_send);
+      recv_allow = netcat_bucket_avail(&rate_recv);
+      recv_dgrams = netcat_bucket_avail(&pps_recv);
+      if (!send_allow)
+	empty[n++] = &rate_send;
+      if (!send_dgrams)
+	empty[n++] = &pps_send;
+      hold_send = (hold_send || (n > 0));
+      if (!recv_allow)
+	empty[n++] = &rate_recv;
+      if (!recv_dgrams)
+	empty[n++] = &pps_recv;
+      hold_recv = (!recv_allow || !recv_dgrams);
+
+      for (i = 0; i < n; i++) {
+	struct timeval wait;
+
+	netcat_bucket_wait(empty[i], &wait);
+	if (!hold_wait || timercmp(&wait, hold_wait, <)) {
+	  shaper = wait;
+	  hold_wait = &shaper;
+	}
+      }
+    }
+
+#ifdef USE_ZEROCOPY
+    /* the memory of the zero-copy writes is given back when the sending
+       queue needs it.  When too many writes are in flight the queue is held
+       back until the kernel reports some completions, which wake up the
+       engine as errors on the socket. */
+    if ((zc.count > 0) && (send_full || (zc.count == CORE_ZC_MAX) ||
+			   (sendq->len + sendq->pinned == sendq->size)))
+      core_zc_reap(&zc, fd_sock.fd, sendq);
+    if (zc.count == CORE_ZC_MAX)
+      hold_send = TRUE;
+#endif
+
+    /* watch the main socket for incoming data unless the receiving queue is
+       full (once full, it must be drained down to its low watermark first).
+       Datagrams are received in batches, when the previous batch has been
+       delivered.  The data that goes straight to stdout doesn't use the
+       queue at all, so it waits for the queue to be empty and for stdout to
+       be writable. */
+    if (eof_net)
+      ;
+    else if (dgram_main) {
+      if ((recvq->len == 0) && !CORE_DGRAM_PENDING(&dg_recv))
+	want_sock |= NC_EV_READ;
+    }
+    else if (direct_out != CORE_DIRECT_NONE) {
+      if ((recvq->len > 0) || hold_recv)
+	;
+      else if (fd_out->ready & NC_EV_WRITE)
+	want_sock |= NC_EV_READ;
+      else
+	want_out |= NC_EV_WRITE;
+    }
+    else if (core_queue_room(recvq, &recv_full))
+      want_sock |= NC_EV_READ;
+    if (want_sock & NC_EV_READ) {
+      debug_v(("watching main sock for incoming data"));
+    }
+
+    /* same thing for the other socket.  If stdin goes straight to the
+       socket, it can only be read when the socket can take the data. */
+    if (!eof_in && (generating ? !gen_done :
+		    (use_stdin || (netcat_mode == NETCAT_TUNNEL)))) {
+      if (direct_in != CORE_DIRECT_NONE) {
+	if (hold_send)
+	  ;
+	else if (fd_sock.ready & NC_EV_WRITE)
+	  want_in |= NC_EV_READ;
+	else
+	  want_sock |= NC_EV_WRITE;
+      }
+      else if (dgram_slave) {
+	if (!CORE_DGRAM_PENDING(&dg_send))
+	  want_in |= NC_EV_READ;
+      }
+      else if (core_queue_room(sendq, &send_full))
+	want_in |= NC_EV_READ;
+      if (want_in & NC_EV_READ) {
+	debug_v(("watching slave sock for incoming data"));
+      }
+    }
+
+    /* now the queued data.  The queues may not be written while they are
+       held back by a delayed output (-i) or by the shaping, while both of
+       them need to wait for the output to become writable if a previous
+       write would block. */
+    if (((sendq->len > 0) || (nc_main->telnet.reply_len > 0) ||
+	 CORE_DGRAM_PENDING(&dg_send)) && !hold_send)
+      want_sock |= NC_EV_WRITE;
+    if (((recvq->len > 0) || CORE_DGRAM_PENDING(&dg_recv)) && !hold_recv)
+      want_out |= NC_EV_WRITE;
+
+    /* don't go through the engine if we already know that something can be
+       done (edge-triggered descriptors that weren't drained, or outputs that
+       didn't block yet).  Every CORE_SPIN_MAX rounds poll anyway, so that
+       a busy descriptor can't starve the other ones. */
+    ready_work = ((want_sock & fd_sock.ready) || (want_in & fd_in->ready) ||
+		  (want_out & fd_out->ready));
+    if (!ready_work || (++spin >= CORE_SPIN_MAX)) {
+      struct timeval zero;
+      int ret;
+
+      /* register the interesting events that aren't pending already */
+      core_event_mod(&ev, &fd_sock, want_sock & ~fd_sock.ready);
+      if (fd_out == fd_in)
+	core_event_mod(&ev, fd_in, (want_in | want_out) & ~fd_in->ready);
+      else {
+	core_event_mod(&ev, fd_in, want_in & ~fd_in->ready);
+	core_event_mod(&ev, fd_out, want_out & ~fd_out->ready);
+      }
+
+      if (ready_work) {
+	zero.tv_sec = zero.tv_usec = 0;
+	timeout = &zero;
+      }
+      else
+	timeout = hold_wait;
+      spin = 0;
+
+      ret = core_event_wait(&ev, timeout);
+      if (ret < 0) {			/* something went wrong (maybe a legal signal) */
+	if (errno == EINTR)
+	  goto handle_signal;
+	perror("select(core_readwrite)");
+	exit(EXIT_FAILURE);
+      }
+      debug(("ret=%d\n", ret));
+    }
+
+    /* reading from stdin the incoming data.  The data is moved from the
+       kernel's receiving queue to the free space of our sending queue, with
+       a single call even if the free space wraps around the end of the
+       queue.  Datagrams from the other socket are received in a batch. */
+    if ((want_in & NC_EV_READ) && (fd_in->ready & NC_EV_READ)) {
+      bool direct = (direct_in != CORE_DIRECT_NONE);
+
+      if (direct) {
+	read_ret = core_direct_send(fd_sock.fd, fd_in->fd, direct_in,
+				    (send_allow < CORE_DIRECT_CHUNK ? send_allow :
+				     CORE_DIRECT_CHUNK));
+	debug_dv(("sendfile(stdin) = %d", read_ret));
+
+	/* the kernel may refuse some descriptors, if nothing was sent yet
+	   it's safe to go back to the buffered copy */
+	if ((read_ret < 0) && ((errno == EINVAL) || (errno == ENOSYS)) &&
+	    (stats_sent.bytes == 0)) {
+	  debug_v(("direct stdin refused, falling back to read()"));
+	  direct_in = CORE_DIRECT_NONE;
+	  direct = FALSE;
+	}
+      }
+      else if (dgram_slave) {
+	read_ret = core_dgram_recv(&dg_send, fd_in->fd);
+	debug_dv(("recvmmsg(stdin) = %d", read_ret));
+
+	/* a short batch means that the socket was drained */
+	if ((read_ret > 0) && (read_ret < dg_send.depth))
+	  fd_in->ready &= ~NC_EV_READ;
+	if (read_ret > 0)
+	  stats_sent.packets += read_ret;
+      }
+      if (generating) {
+	iovcnt = netcat_buffer_space(sendq, iov);
+	read_ret = netcat_pattern_read(&gen, iov, iovcnt);
+	debug_dv(("generate = %d", read_ret));
+      }
+      else if (!direct && !dgram_slave) {
+	iovcnt = netcat_buffer_space(sendq, iov);
+	read_ret = readv(fd_in->fd, iov, iovcnt);
+	debug_dv(("read(stdin) = %d", read_ret));
+      }
+      if (!generating)
+	stats_sent.calls++;
+
+      if ((read_ret < 0) && (errno == EAGAIN)) {
+	/* a pipe may be non-blocking, so find out which side would block */
+	if (direct && ((direct_in == CORE_DIRECT_FILE) ||
+		       !core_writable_now(fd_sock.fd)))
+	  fd_sock.ready &= ~NC_EV_WRITE;	/* the socket is full */
+	else
+	  fd_in->ready &= ~NC_EV_READ;	/* drained */
+      }
+      else if (read_ret < 0) {
+	perror(direct ? "sendfile(stdin)" : "read(stdin)");
+	exit(EXIT_FAILURE);
+      }
+      else if (read_ret == 0) {
+	/* when we receive EOF and this is a tunnel say goodbye, otherwise
+	   it means that stdin has finished its input. */
+	if ((netcat_mode == NETCAT_TUNNEL) || opt_eofclose) {
+	  debug_v(("EOF Received from stdin! (exiting from loop..)"));
+	  eof_in = TRUE;
+	}
+	else {
+	  debug_v(("EOF Received from stdin! (removing from lookups..)"));
+	  if (generating)
+	    gen_done = TRUE;
+	  else
+	    use_stdin = FALSE;
+	  if ((stats_sent.bytes == 0) && (sendq->len == 0) && !dgram_main)
+	    netcat_socket_fastopen_start(fd_sock.fd);
+	}
+	fd_in->ready &= ~NC_EV_READ;
+      }
+      else if (direct) {
+	stats_sent.bytes += read_ret;		/* update statistics */
+	netcat_bucket_take(&rate_send, read_ret);
+      }
+      else if (!dgram_slave) {
+	netcat_buffer_fill(sendq, read_ret);
+	CORE_STATS_QUEUE(&stats_sent, sendq);
+	if (nc_slave->domain != PF_UNSPEC)
+	  netcat_socket_quickack(fd_in->fd);
+      }
+    }
+
+    /* now write the sending queue to the net.  If this is a delayed output
+       (-i) only the first line is sent, and the rest waits for the next
+       interval.  The telnet answers go along with the queued data. */
+    if (((sendq->len > 0) || (nc_main->telnet.reply_len > 0)) && !hold_send &&
+	(fd_sock.ready & NC_EV_WRITE)) {
+      int queued = 0;
+
+      debug_v(("there are %d data bytes in main->sendq", sendq->len));
+
+      /* a stream is sent as a batch of datagrams, unless each write must
+         be shown, delayed or transformed on its own */
+      if (dgram_main && !opt_hexdump && !opt_interval && !xlat.on) {
+	write_ret = core_dgram_send_queue(&dg_send, fd_sock.fd, sendq,
+					  send_dgrams, send_allow);
+	debug_dv(("sendmmsg(net) = %d", write_ret));
+	if (write_ret > 0) {
+	  int sent = (write_ret + CORE_UDP_CHUNK - 1) / CORE_UDP_CHUNK;
+
+	  netcat_bucket_take(&pps_send, sent);
+	  stats_sent.packets += sent;
+	}
+	iovcnt = 0;
+      }
+      else {
+	/* a datagram always goes as a whole, the bucket takes the debt */
+	iovcnt = 0;
+	if (sendq->len > 0)
+	  iovcnt = core_queue_iov(sendq, iov, dgram_main, dgram_slave);
+	if (!dgram_main)
+	  iovcnt = core_iov_limit(iov, iovcnt, send_allow);
+
+	if (opt_interval && (iovcnt > 0)) {
+	  int i;
+
+	  for (i = 0; i < iovcnt; i++) {
+	    unsigned char *nl = memchr(iov[i].iov_base, '\n', iov[i].iov_len);
+
+	    if (nl) {
+	      iov[i].iov_len = nl - (unsigned char *) iov[i].iov_base + 1;
+	      iovcnt = i + 1;
+	      break;
+	    }
+	  }
+	  gettimeofday(&delay_end, NULL);
+	  delay_end.tv_sec += opt_interval;
+	  delaying = TRUE;
+	}
+
+#ifdef USE_ZEROCOPY
+	if (zc.on || (zc.count > 0))
+	  write_ret = core_zc_writev(&zc, fd_sock.fd, iov, iovcnt);
+	else
+#endif
+	if (xlat.on)
+	  write_ret = core_xlat_writev(&xlat, fd_sock.fd, &nc_main->telnet,
+				       iov, iovcnt, &queued);
+	else
+	  write_ret = writev(fd_sock.fd, iov, iovcnt);
+	debug_dv(("write(net) = %d", write_ret));
+      }
 
       if (write_ret < 0) {
-	perror("write(stdout)");
+	if (errno == EAGAIN) {
+	  write_ret = 0;	/* write would block, wait for the engine */
+	  fd_sock.ready &= ~NC_EV_WRITE;
+	}
+	else {
+	  perror("write(net)");
+	  exit(EXIT_FAILURE);
+	}
+      }
+
+      if (!xlat.on)
+	queued = write_ret;
+      stats_sent.bytes += write_ret;		/* update statistics */
+      stats_sent.calls++;
+      netcat_bucket_take(&rate_send, write_ret);
+      if (dgram_main && (write_ret > 0) && (iovcnt || xlat.on)) {
+	netcat_bucket_take(&pps_send, 1);	/* a single datagram */
+	stats_sent.packets++;
+      }
+
+      /* if the option is set, hexdump the sent data */
+      if (opt_hexdump && (write_ret > 0))
+	netcat_capture('>', (xlat.on ? xlat.dump : iov[0].iov_base),
+		       write_ret, "Sent %u bytes to the socket\n", write_ret);
+
+#ifdef USE_ZEROCOPY
+      if (zc.count > 0)
+	netcat_buffer_pin(sendq, queued);	/* still used by the kernel */
+      else
+#endif
+      netcat_buffer_drop(sendq, queued);
+      debug_v(("there are %d data bytes left in the queue", sendq->len));
+    }
+    else if (CORE_DGRAM_PENDING(&dg_send) && !hold_send &&
+	     (fd_sock.ready & NC_EV_WRITE)) {
+      unsigned char *data = core_dgram_peek(&dg_send);
+      int max = core_dgram_fit(&dg_send, send_allow), first = dg_send.next;
+
+      /* the datagrams are shown one by one and delayed one by one */
+      if (opt_hexdump || opt_interval)
+	max = 1;
+      write_ret = core_dgram_flush(&dg_send, fd_sock.fd, dgram_main,
+				   (max < send_dgrams ? max : send_dgrams), NULL);
+      debug_dv(("sendmmsg(net) = %d", write_ret));
+      netcat_bucket_take(&pps_send, dg_send.next - first);
+      if (opt_interval) {
+	gettimeofday(&delay_end, NULL);
+	delay_end.tv_sec += opt_interval;
+	delaying = TRUE;
+      }
+
+      if (write_ret < 0) {
+	if (errno != EAGAIN) {
+	  perror("write(net)");
+	  exit(EXIT_FAILURE);
+	}
+	write_ret = 0;		/* write would block, wait for the engine */
+	fd_sock.ready &= ~NC_EV_WRITE;
+      }
+      stats_sent.bytes += write_ret;		/* update statistics */
+      stats_sent.calls++;
+      netcat_bucket_take(&rate_send, write_ret);
+
+      if (opt_hexdump && (write_ret > 0))
+	netcat_capture('>', data, write_ret, "Sent %u bytes to the socket\n",
+		       write_ret);
+    }				/* end of reading from stdin section */
+
+    /* reading from the socket (net). */
+    if ((want_sock & NC_EV_READ) && (fd_sock.ready & NC_EV_READ)) {
+      iovcnt = netcat_buffer_space(recvq, iov);
+
+      /* the telnet codes are stripped in place, so the data must be in one
+         piece */
+      if (opt_telnet)
+	iovcnt = 1;
+
+      if (dgram_main) {
+	read_ret = core_dgram_recv(&dg_recv, fd_sock.fd);
+	debug_dv(("recvmmsg(net) = %d", read_ret));
+
+	/* a short batch means that the socket was drained */
+	if ((read_ret > 0) && (read_ret < dg_recv.depth))
+	  fd_sock.ready &= ~NC_EV_READ;
+	if (read_ret > 0)
+	  stats_recv.packets += read_ret;
+      }
+      else if (direct_out != CORE_DIRECT_NONE) {
+	/* straight to stdout, without passing through the queue */
+	read_ret = core_direct_recv(fd_out->fd, direct_out, fd_sock.fd,
+				    direct_pipe, (recv_allow < direct_len ?
+						  recv_allow : direct_len));
+	debug_dv(("splice(net) = %d", read_ret));
+	if ((read_ret < 0) && (errno == EINVAL) && (stats_recv.bytes == 0)) {
+	  debug_v(("direct stdout refused, falling back to read()"));
+	  direct_out = CORE_DIRECT_NONE;
+	  read_ret = readv(fd_sock.fd, iov, iovcnt);
+	}
+      }
+      else {
+	/* common file read fallback */
+	read_ret = readv(fd_sock.fd, iov, iovcnt);
+	debug_dv(("read(net) = %d", read_ret));
+      }
+      stats_recv.calls++;
+
+      if ((read_ret < 0) && (errno == EAGAIN)) {
+	if ((direct_out == CORE_DIRECT_PIPE) && !core_writable_now(fd_out->fd))
+	  fd_out->ready &= ~NC_EV_WRITE;	/* the output pipe is full */
+	else
+	  fd_sock.ready &= ~NC_EV_READ;	/* drained */
+      }
+      else if (read_ret < 0) {
+	perror("read(net)");
 	exit(EXIT_FAILURE);
       }
+      else if (read_ret == 0) {
+	debug_v(("EOF Received from the net"));
+	eof_net = TRUE;
+      }
+      else if (dgram_main) {
+	/* check for telnet codes (if enabled) in each datagram */
+	if (opt_telnet)
+	  core_dgram_telnet(&dg_recv, nc_main);
+      }
+      else if (direct_out != CORE_DIRECT_NONE) {
+	stats_recv.bytes += read_ret;		/* update statistics */
+	netcat_bucket_take(&rate_recv, read_ret);
+      }
+      else {
+	/* check for telnet codes (if enabled).  The answers go through the
+	   sending queue, like the rest of the data sent */
+	if (opt_telnet)
+	  netcat_telnet_parse(nc_main, iov[0].iov_base, &read_ret);
+	netcat_buffer_fill(recvq, read_ret);
+	CORE_STATS_QUEUE(&stats_recv, recvq);
+      }
+
+      /* the kernel goes back to delayed acknowledgments on its own */
+      if ((read_ret > 0) && !dgram_main)
+	netcat_socket_quickack(fd_sock.fd);
+    }
 
-      /* FIXME: unhandled exception */
-      assert((write_ret > 0) && (write_ret <= data_len));
+    /* and finally write the receiving queue to the output */
+    if ((recvq->len > 0) && !hold_recv && (fd_out->ready & NC_EV_WRITE)) {
+      debug_v(("there are %d data bytes in main->recvq", recvq->len));
+      iovcnt = core_queue_iov(recvq, iov, dgram_slave, dgram_main);
+      if (!dgram_slave)
+	iovcnt = core_iov_limit(iov, iovcnt, recv_allow);
 
-      if (write_ret < data_len) {
-	debug_v(("Damn! I wanted to send to stdout %d bytes but it only sent %d",
-		data_len, write_ret));
-	data_len = write_ret;
+      if (sinking)
+	write_ret = core_sink_writev(&sink, iov, iovcnt);
+      else
+	write_ret = writev(fd_out->fd, iov, iovcnt);
+      debug_dv(("write(stdout) = %d", write_ret));
+
+      if (write_ret < 0) {
+	if (errno != EAGAIN) {
+	  perror("write(stdout)");
+	  exit(EXIT_FAILURE);
+	}
+	write_ret = 0;		/* wait for the engine */
+	fd_out->ready &= ~NC_EV_WRITE;
+      }
+      stats_recv.bytes += write_ret;		/* update statistics */
+      if (!sinking)
+	stats_recv.calls++;
+      netcat_bucket_take(&rate_recv, write_ret);
+      if (dgram_slave && (write_ret > 0)) {
+	netcat_bucket_take(&pps_recv, 1);	/* a single datagram */
+	stats_recv.packets++;
       }
 
       /* if option is set, hexdump the received data */
-      if (opt_hexdump) {
-#ifndef USE_OLD_HEXDUMP
-	if ((nc_main->proto == NETCAT_PROTO_UDP) && opt_zero)
-	  fprintf(output_fp, "Received %d bytes from %s:%d\n", write_ret,
-		  netcat_inet_ntop(&recv_addr.sin_addr), ntohs(recv_addr.sin_port));
-	else
-	  fprintf(output_fp, "Received %d bytes from the socket\n", write_ret);
-#endif
-	netcat_fhexdump(output_fp, '<', data, write_ret);
-      }
+      if (opt_hexdump && (write_ret > 0))
+	netcat_capture('<', iov[0].iov_base, write_ret,
+		       "Received %d bytes from the socket\n", write_ret);
 
-      /* update the queue */
-      my_sendq->len -= data_len;
-      my_sendq->pos += data_len;
+      netcat_buffer_drop(recvq, write_ret);
+      debug_v(("there are %d data bytes left in the queue", recvq->len));
+    }
+    else if (CORE_DGRAM_PENDING(&dg_recv) && !hold_recv &&
+	     (fd_out->ready & NC_EV_WRITE)) {
+      unsigned char *data = core_dgram_peek(&dg_recv);
+      struct sockaddr_in *addr = &dg_recv.addrs[dg_recv.next];
+      int max = core_dgram_fit(&dg_recv, recv_allow), first = dg_recv.next;
+
+      /* every datagram gets its own hexdump */
+      if (opt_hexdump)
+	max = 1;
+      write_ret = core_dgram_flush(&dg_recv, fd_out->fd, dgram_slave,
+				   (max < recv_dgrams ? max : recv_dgrams),
+				   (sinking ? &sink : NULL));
+      debug_dv(("write(stdout) = %d", write_ret));
+      netcat_bucket_take(&pps_recv, dg_recv.next - first);
 
-      debug_v(("there are %d data bytes left in the queue", my_sendq->len));
-      if (my_sendq->len == 0) {
-	free(my_sendq->head);
-	memset(my_sendq, 0, sizeof(*my_sendq));
+      if (write_ret < 0) {
+	if (errno != EAGAIN) {
+	  perror("write(stdout)");
+	  exit(EXIT_FAILURE);
+	}
+	write_ret = 0;		/* wait for the engine */
+	fd_out->ready &= ~NC_EV_WRITE;
       }
-      else if (!my_sendq->head) {
-	my_sendq->head = malloc(my_sendq->len);
-	memcpy(my_sendq->head, my_sendq->pos, my_sendq->len);
-	my_sendq->pos = my_sendq->head;
+      stats_recv.bytes += write_ret;		/* update statistics */
+      if (!sinking)
+	stats_recv.calls++;
+      netcat_bucket_take(&rate_recv, write_ret);
+
+      if (opt_hexdump && (write_ret > 0)) {
+	if (opt_zero)
+	  netcat_capture('<', data, write_ret, "Received %d bytes from %s:%d\n",
+			 write_ret, netcat_inet_ntop(&addr->sin_addr),
+			 ntohs(addr->sin_port));
+	else
+	  netcat_capture('<', data, write_ret,
+			 "Received %d bytes from the socket\n", write_ret);
       }
     }				/* end of reading from the socket section */
 
  handle_signal:			/* FIXME: i'm not sure this is the right place */
+    /* level-triggered readiness is only valid for a single round */
+    if (!fd_sock.edge)
+      fd_sock.ready &= ~NC_EV_READ;
+    if (!fd_in->edge)
+      fd_in->ready &= ~NC_EV_READ;
+
+    netcat_stats_tick();
     if (got_sigusr1) {
       debug_v(("LOCAL printstats!"));
       netcat_printstats(TRUE);
       got_sigusr1 = FALSE;
     }
     continue;
-  }				/* end of while (inloop) */
+  }				/* end of while (TRUE) */
+
+  if (sinking && (sink.check.type != NETCAT_PATTERN_NONE)) {
+    if (sink.bad > 0)
+      ncprint(NCPRINT_ERROR, _("%llu of the %llu bytes received don't match "
+	      "the pattern"), sink.bad, sink.check.offset);
+    else
+      ncprint(NCPRINT_VERB1, _("All the %llu bytes received match the "
+	      "pattern"), sink.check.offset);
+  }
+
+  core_stdio_restore();
+  netcat_event_close(&ev);
+  netcat_buffer_free(recvq);
+#ifdef USE_ZEROCOPY
+  /* the kernel may still read the pages of the zero-copy writes, so their
+     memory must stay untouched until it says it's done.  If it takes too
+     long, the queue is left allocated instead. */
+  if ((zc.count > 0) && !core_zc_drain(&zc, fd_sock.fd, sendq)) {
+    ncprint(NCPRINT_VERB2, _("Zero-copy sends still in flight, leaving the "
+			     "sending queue allocated"));
+    memset(sendq, 0, sizeof(*sendq));
+  }
+#endif
+  assert(sendq->pinned == 0);
+  netcat_buffer_free(sendq);
+  free(xlat.dump);
+  core_dgram_free(&dg_recv);
+  core_dgram_free(&dg_send);
+  if (direct_pipe[0] >= 0) {
+    close(direct_pipe[0]);
+    close(direct_pipe[1]);
+  }
 
-  /* we've got an EOF from the net, close the sockets */
-  shutdown(fd_sock, SHUT_RDWR);
-  close(fd_sock);
+  /* we've got an EOF from the net, close the sockets.  If the EOF came from
+     the other side instead, the data still queued in the kernel must get
+     through. */
+  if (eof_in)
+    netcat_socket_linger_off(fd_sock.fd);
+  shutdown(fd_sock.fd, SHUT_RDWR);
+  close(fd_sock.fd);
   nc_main->fd = -1;
 
   /* close the slave socket only if it wasn't a simulation */
   if (nc_slave->domain != PF_UNSPEC) {
-    shutdown(fd_stdin, SHUT_RDWR);
-    close(fd_stdin);
+    if (eof_net)
+      netcat_socket_linger_off(fd_in->fd);
+    shutdown(fd_in->fd, SHUT_RDWR);
+    close(fd_in->fd);
     nc_slave->fd = -1;
   }
 
@@ -915,3 +2549,886 @@ int core_readwrite(nc_sock_t *nc_main, nc_sock_t *nc_slave)
 
   return 0;
 }				/* end of core_readwrite() */
+
+/* A client of the keep-open server (-k).  Every client has its own socket,
+   with the queue of the input that still has to be sent to it, and its own
+   statistics. */
+
+typedef struct core_session {
+  nc_sock_t sock;
+  core_fd_t cfd;
+  core_xlat_t xlat;
+  unsigned long long bytes_sent, bytes_recv;
+  struct core_session *next;
+} core_session_t;
+
+/* Closes the session `s' and releases it.  The totals of the session are
+   already accounted in the global statistics. */
+
+static void core_session_close(nc_evloop_t *ev, core_session_t *s)
+{
+  ncprint(NCPRINT_VERB1, _("Connection from %s:%hu closed (received %llu "
+	  "bytes, sent %llu bytes)"), s->sock.host.addrs[0], s->sock.port.num,
+	  s->bytes_recv, s->bytes_sent);
+  netcat_event_del(ev, s->cfd.fd);
+  shutdown(s->cfd.fd, SHUT_RDWR);
+  close(s->cfd.fd);
+  netcat_buffer_free(&s->sock.sendq);
+  free(s->xlat.dump);
+  free(s);
+}
+
+/* Serves the clients connecting to the listening socket described by
+   `ncsock' until interrupted, all of them from the same event loop.  The data
+   received from every client is written to stdout, one read at a time so
+   that the streams are interleaved but never mixed inside a chunk, while
+   stdin is sent to all the clients connected at the time it's read.  The
+   input is only read when all the clients can take it, so a slow client
+   slows down the others, and not at all while nobody is connected.
+   With the -c switch, an EOF from stdin closes each client after its queue
+   has been flushed and then ends the server.
+   Returns 0 when interrupted, or -1 if no client connected before the
+   timeout (-w). */
+
+int core_server(nc_sock_t *ncsock)
+{
+  int sock_listen, sessions = 0, ret = 0;
+  bool accepting = TRUE, accepted = FALSE, eof_in = !use_stdin;
+  bool out_full = FALSE;
+  unsigned char *inbuf;
+  nc_evloop_t ev;
+  nc_buffer_t outq;
+  core_fd_t fd_listen, fd_stdin, fd_stdout;
+  core_session_t *list = NULL, *s, **sp;
+  struct timeval deadline;
+  debug_v(("core_server(ncsock=%p)", (void *)ncsock));
+
+  sock_listen = core_tcp_listen_socket(ncsock);
+  if (sock_listen < 0)
+    return -1;
+
+  memset(&outq, 0, sizeof(outq));
+  inbuf = malloc(opt_buffer_size);
+  if (!inbuf || !netcat_buffer_init(&outq, opt_buffer_size))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+
+  /* every descriptor is watched in level-triggered mode, since there can be
+     many of them and only a few are usually active */
+  memset(&fd_listen, 0, sizeof(fd_listen));
+  memset(&fd_stdin, 0, sizeof(fd_stdin));
+  memset(&fd_stdout, 0, sizeof(fd_stdout));
+  netcat_event_init(&ev, opt_engine);
+  fd_listen.fd = sock_listen;
+  fd_stdin.fd = STDIN_FILENO;
+  fd_stdout.fd = STDOUT_FILENO;
+  core_set_nonblock(sock_listen);
+  if (!eof_in)
+    core_stdio_nonblock(STDIN_FILENO);
+  core_stdio_nonblock(STDOUT_FILENO);
+  core_event_add(&ev, &fd_listen);
+  if (!eof_in)
+    core_event_add(&ev, &fd_stdin);
+  core_event_add(&ev, &fd_stdout);
+
+  gettimeofday(&deadline, NULL);
+  deadline.tv_sec += ncsock->timeout;
+
+  ncprint(NCPRINT_VERB2, _("Serving multiple clients (%s engine)"),
+	  netcat_event_name(ev.engine));
+  netcat_stats_start();
+  signal_handler = FALSE;
+
+  while (TRUE) {
+    int room = opt_buffer_size, want_in = 0, want_out = 0;
+    bool ready_work;
+    struct timeval now, wait, *timeout = NULL;
+
+    /* if we received an interrupt signal break this function */
+    if (got_sigint) {
+      got_sigint = FALSE;
+      break;
+    }
+    /* if we received a terminating signal we must terminate */
+    if (got_sigterm)
+      break;
+
+    /* with -c, the server is over when the last input has been delivered */
+    if (eof_in && opt_eofclose && accepted && !sessions)
+      break;
+
+    /* find out what every descriptor is waiting for.  The clients are read
+       until the output queue fills up, and then again when it has been
+       drained down to its low watermark.  The input is only read as much as
+       the fullest client queue can take. */
+    core_event_mod(&ev, &fd_listen, (accepting ? NC_EV_READ : 0));
+    core_queue_room(&outq, &out_full);
+    for (s = list; s; s = s->next) {
+      int mask = 0;
+
+      if (!out_full)
+	mask |= NC_EV_READ;
+      if ((s->sock.sendq.len > 0) || (s->sock.telnet.reply_len > 0))
+	mask |= NC_EV_WRITE;
+      if (s->sock.sendq.size - s->sock.sendq.len < room)
+	room = s->sock.sendq.size - s->sock.sendq.len;
+      core_event_mod(&ev, &s->cfd, mask);
+    }
+    if (!eof_in && sessions && (room > 0))
+      want_in = NC_EV_READ;
+    if (outq.len > 0)
+      want_out = NC_EV_WRITE;
+    if (!eof_in)
+      core_event_mod(&ev, &fd_stdin, want_in);
+    core_event_mod(&ev, &fd_stdout, want_out);
+
+    /* files can't be polled, they are always ready */
+    ready_work = ((want_in & fd_stdin.ready) || (want_out & fd_stdout.ready));
+    if (ready_work) {
+      wait.tv_sec = wait.tv_usec = 0;
+      timeout = &wait;
+    }
+    else if (!accepted && (ncsock->timeout > 0)) {
+      gettimeofday(&now, NULL);
+      wait = deadline;
+      netcat_timeval_sub(&wait, &now);
+      timeout = &wait;
+    }
+
+    ret = core_event_wait(&ev, timeout);
+    if (ret < 0) {
+      if (errno == EINTR) {
+	ret = 0;
+	goto handle_signal;
+      }
+      perror("select(core_server)");
+      exit(EXIT_FAILURE);
+    }
+    if ((ret == 0) && !ready_work && !accepted && timeout) {
+      errno = ETIMEDOUT;
+      ret = -1;
+      break;
+    }
+    ret = 0;
+
+    /* accept all the pending clients */
+    while (fd_listen.ready & NC_EV_READ) {
+      struct sockaddr_in my_addr;
+      unsigned int my_len = sizeof(my_addr);
+      int sock_accept;
+
+      sock_accept = accept(sock_listen, (struct sockaddr *)&my_addr, &my_len);
+      if (sock_accept < 0) {
+	/* out of descriptors: stop accepting until a client goes away */
+	if ((errno == EMFILE) || (errno == ENFILE)) {
+	  ncprint(NCPRINT_VERB1 | NCPRINT_WARNING,
+		  _("Couldn't accept more connections: %s"), strerror(errno));
+	  accepting = FALSE;
+	}
+	break;
+      }
+
+      if (!core_tcp_accept_allowed(ncsock, &my_addr) ||
+	  !(s = calloc(1, sizeof(*s))) ||
+	  !netcat_buffer_init(&s->sock.sendq, opt_buffer_size)) {
+	free(s);
+	shutdown(sock_accept, SHUT_RDWR);
+	close(sock_accept);
+	continue;
+      }
+      s->sock.domain = PF_INET;
+      s->sock.proto = NETCAT_PROTO_TCP;
+      s->sock.fd = s->cfd.fd = sock_accept;
+      core_xlat_init(&s->xlat);
+      memcpy(&s->sock.host.iaddrs[0], &my_addr.sin_addr,
+	     sizeof(s->sock.host.iaddrs[0]));
+      strcpy(s->sock.host.addrs[0], netcat_inet_ntop(&my_addr.sin_addr));
+      netcat_getport(&s->sock.port, NULL, ntohs(my_addr.sin_port));
+      netcat_socket_tune(sock_accept, SOCK_STREAM);
+      netcat_socket_report(sock_accept);
+      core_set_nonblock(sock_accept);
+      core_event_add(&ev, &s->cfd);
+      s->next = list;
+      list = s;
+      sessions++;
+      accepted = TRUE;
+    }
+
+    /* write the received data to stdout */
+    if (want_out & fd_stdout.ready) {
+      struct iovec iov[2];
+      int write_ret, iovcnt = netcat_buffer_data(&outq, iov);
+
+      write_ret = writev(fd_stdout.fd, iov, iovcnt);
+      debug_dv(("write(stdout) = %d", write_ret));
+      stats_recv.calls++;
+      if (write_ret < 0) {
+	if (errno != EAGAIN) {
+	  perror("write(stdout)");
+	  exit(EXIT_FAILURE);
+	}
+      }
+      else
+	netcat_buffer_drop(&outq, write_ret);
+    }
+
+    /* read stdin and queue the data for every client */
+    if (want_in & fd_stdin.ready) {
+      int read_ret = read(fd_stdin.fd, inbuf, room);
+
+      debug_dv(("read(stdin) = %d", read_ret));
+      stats_sent.calls++;
+      if (read_ret < 0) {
+	if (errno != EAGAIN) {
+	  perror("read(stdin)");
+	  exit(EXIT_FAILURE);
+	}
+      }
+      else if (read_ret == 0) {
+	debug_v(("EOF Received from stdin! (removing from lookups..)"));
+	netcat_event_del(&ev, fd_stdin.fd);
+	eof_in = TRUE;
+      }
+      else
+	for (s = list; s; s = s->next) {
+	  netcat_buffer_put(&s->sock.sendq, inbuf, read_ret);
+	  CORE_STATS_QUEUE(&stats_sent, &s->sock.sendq);
+	}
+    }
+
+    /* now every client */
+    for (sp = &list; (s = *sp); ) {
+      struct iovec iov[2];
+      int iovcnt, read_ret, write_ret;
+      bool drop = FALSE;
+
+      if ((s->cfd.ready & NC_EV_WRITE) &&
+	  ((s->sock.sendq.len > 0) || (s->sock.telnet.reply_len > 0))) {
+	int queued;
+
+	iovcnt = netcat_buffer_data(&s->sock.sendq, iov);
+	if (opt_hexdump && (iovcnt > 1))
+	  iovcnt = 1;
+	if (s->xlat.on)
+	  write_ret = core_xlat_writev(&s->xlat, s->cfd.fd, &s->sock.telnet,
+				       iov, iovcnt, &queued);
+	else
+	  write_ret = queued = writev(s->cfd.fd, iov, iovcnt);
+	debug_dv(("write(net) = %d", write_ret));
+	stats_sent.calls++;
+	if (write_ret > 0) {
+	  s->bytes_sent += write_ret;
+	  stats_sent.bytes += write_ret;	/* update statistics */
+	  if (opt_hexdump)
+	    netcat_capture('>', (s->xlat.on ? s->xlat.dump : iov[0].iov_base),
+			   write_ret, "Sent %u bytes to %s\n", write_ret,
+			   netcat_strid(&s->sock.host, &s->sock.port));
+	  netcat_buffer_drop(&s->sock.sendq, queued);
+	}
+	else if (errno != EAGAIN) {
+	  debug_v(("write(net) failed: %s", strerror(errno)));
+	  drop = TRUE;
+	}
+      }
+
+      if (!drop && (s->cfd.ready & NC_EV_READ) && (outq.len < outq.size)) {
+	iovcnt = netcat_buffer_space(&outq, iov);
+
+	/* the telnet codes and the hexdump need the data in one piece */
+	if (opt_telnet || opt_hexdump)
+	  iovcnt = 1;
+	read_ret = readv(s->cfd.fd, iov, iovcnt);
+	debug_dv(("read(net) = %d", read_ret));
+	stats_recv.calls++;
+	if (read_ret > 0) {
+	  if (opt_telnet)
+	    netcat_telnet_parse(&s->sock, iov[0].iov_base, &read_ret);
+	  s->bytes_recv += read_ret;
+	  stats_recv.bytes += read_ret;	/* update statistics */
+	  if (opt_hexdump)
+	    netcat_capture('<', iov[0].iov_base, read_ret,
+			   "Received %d bytes from %s\n", read_ret,
+			   netcat_strid(&s->sock.host, &s->sock.port));
+	  netcat_buffer_fill(&outq, read_ret);
+	  CORE_STATS_QUEUE(&stats_recv, &outq);
+	}
+	else if ((read_ret == 0) || (errno != EAGAIN)) {
+	  debug_v(("EOF Received from the net"));
+	  drop = TRUE;
+	}
+      }
+
+      /* with -c, an EOF from stdin closes the clients that got all of it */
+      if (eof_in && opt_eofclose && (s->sock.sendq.len == 0) && !drop) {
+	netcat_socket_linger_off(s->cfd.fd);
+	drop = TRUE;
+      }
+
+      if (drop) {
+	*sp = s->next;
+	core_session_close(&ev, s);
+	sessions--;
+	accepting = TRUE;
+      }
+      else
+	sp = &s->next;
+    }
+
+ handle_signal:
+    /* level-triggered readiness is only valid for a single round */
+    fd_listen.ready = 0;
+    if (fd_stdin.pollable)
+      fd_stdin.ready = 0;
+    if (fd_stdout.pollable)
+      fd_stdout.ready = 0;
+    for (s = list; s; s = s->next)
+      s->cfd.ready = 0;
+
+    netcat_stats_tick();
+    if (got_sigusr1) {
+      debug_v(("LOCAL printstats!"));
+      netcat_printstats(TRUE);
+      got_sigusr1 = FALSE;
+    }
+  }				/* end of while (TRUE) */
+
+  /* flush what was received from the clients, then close everything.  A
+     write may be cut short (or refused, if stdout was left non-blocking by
+     someone else), so go on until it's all out. */
+  core_stdio_restore();
+  while (outq.len > 0) {
+    struct iovec iov[2];
+    int ret;
+
+    ret = writev(STDOUT_FILENO, iov, netcat_buffer_data(&outq, iov));
+    debug_dv(("write(stdout) = %d", ret));
+    if (ret > 0)
+      netcat_buffer_drop(&outq, ret);
+    else if ((ret < 0) && ((errno == EINTR) || (errno == EAGAIN))) {
+      struct pollfd pfd;
+
+      pfd.fd = STDOUT_FILENO;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+    }
+    else {
+      perror("write(stdout)");
+      break;
+    }
+  }
+  while (list) {
+    s = list;
+    list = s->next;
+    core_session_close(&ev, s);
+  }
+  netcat_event_close(&ev);
+  netcat_buffer_free(&outq);
+  free(inbuf);
+  close(sock_listen);
+
+  /* restore the extarnal signal handler */
+  signal_handler = TRUE;
+
+  return ret;
+}				/* end of core_server() */
+
+#ifdef USE_THREADS
+/* The tunnel server (--workers) runs a number of worker threads, each one
+   with its own listening socket bound to the same port and its own event
+   loop, and the kernel spreads the incoming connections among them.  Every
+   accepted client gets its own connection to the target, and the two are
+   relayed independently of all the others.  The main thread only handles
+   the signals. */
+
+/* State shared by all the workers */
+
+typedef struct {
+  nc_sock_t *listen, *target;
+  char target_name[MAXHOSTNAMELEN + 16];
+  int stop_pipe[2];
+} core_tunnel_t;
+
+/* A worker thread.  The counters are only written by the worker itself, but
+   the main thread reads them at any time, so both sides access them with
+   relaxed atomics (which also keeps the 64 bits values whole on 32 bits
+   hosts). */
+
+#define CORE_WORKER_ADD(var, n) \
+  __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define CORE_WORKER_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+typedef struct {
+  pthread_t thread;
+  core_tunnel_t *tunnel;
+  int sock_listen;
+  nc_stats_t recv, sent;
+  unsigned long long waits;
+} core_worker_t;
+
+/* A client relayed to the target.  Index 0 is the client and index 1 the
+   connection to the target, while q[i] holds the data read from side `i'
+   that must still be written to the other side.  Relays closed while some
+   events for them may still be pending are parked in a list and only freed
+   at the end of the round. */
+
+typedef struct core_relay {
+  core_fd_t cfd[2];
+  nc_buffer_t q[2];
+  bool connecting, eof[2], shut[2];
+  char peer[NETCAT_ADDRSTRLEN];
+  unsigned short peer_port;
+  unsigned long long bytes_sent, bytes_recv;
+  struct core_relay *next;
+} core_relay_t;
+
+/* Registers the descriptor of the side `i' of the relay `r' in the event loop
+   `ev'.  Sockets can always be polled, and they are watched in edge-triggered
+   mode so that a busy worker doesn't have to update the event engine. */
+
+static void core_relay_add(nc_evloop_t *ev, core_relay_t *r, int i)
+{
+  r->cfd[i].edge = TRUE;
+  r->cfd[i].pollable = TRUE;
+  if (netcat_event_add(ev, r->cfd[i].fd, 0, TRUE, r) != 0)
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Critical system request failed: %s"),
+	    strerror(errno));
+}
+
+/* Closes the relay `r'.  The memory is released later by the caller. */
+
+static void core_relay_close(nc_evloop_t *ev, core_relay_t *r)
+{
+  int i;
+
+  ncprint(NCPRINT_VERB1, _("Connection from %s:%hu closed (received %llu "
+	  "bytes, sent %llu bytes)"), r->peer, r->peer_port, r->bytes_recv,
+	  r->bytes_sent);
+  for (i = 0; i < 2; i++) {
+    if (r->cfd[i].fd >= 0) {
+      netcat_event_del(ev, r->cfd[i].fd);
+      close(r->cfd[i].fd);
+      r->cfd[i].fd = -1;
+    }
+    netcat_buffer_free(&r->q[i]);
+  }
+}
+
+/* Moves as much data as possible through the relay `r', in both directions,
+   until every descriptor would block or its queue is full.  The end of the
+   data from one side is forwarded to the other one with shutdown(2).
+   Returns FALSE when the relay is over and must be closed. */
+
+static bool core_relay_pump(core_worker_t *w, nc_evloop_t *ev,
+			    core_relay_t *r)
+{
+  bool progress;
+  int i;
+
+  /* wait for the connection to the target to be established */
+  if (r->connecting) {
+    int get_ret = 0;
+    unsigned int get_len = sizeof(get_ret);	/* socklen_t */
+
+    if (!(r->cfd[1].ready & NC_EV_WRITE))
+      return TRUE;
+    if ((getsockopt(r->cfd[1].fd, SOL_SOCKET, SO_ERROR, &get_ret,
+		    &get_len) < 0) || (get_ret > 0)) {
+      ncprint(NCPRINT_VERB1, "%s: %s", w->tunnel->target_name,
+	      strerror(get_ret ? get_ret : errno));
+      return FALSE;
+    }
+    r->connecting = FALSE;
+  }
+
+  do {
+    progress = FALSE;
+    for (i = 0; i < 2; i++) {
+      core_fd_t *src = &r->cfd[i], *dst = &r->cfd[1 - i];
+      nc_buffer_t *q = &r->q[i];
+      unsigned long long *counter =
+	(i == 0 ? &r->bytes_recv : &r->bytes_sent);
+      nc_stats_t *total = (i == 0 ? &w->recv : &w->sent);
+      struct iovec iov[2];
+      int ret;
+
+      /* flush the queue first, so that there's room for reading */
+      if ((q->len > 0) && (dst->ready & NC_EV_WRITE)) {
+	ret = writev(dst->fd, iov, netcat_buffer_data(q, iov));
+	debug_dv(("write(relay) = %d", ret));
+	CORE_WORKER_ADD(total->calls, 1);
+	if (ret > 0) {
+	  netcat_buffer_drop(q, ret);
+	  *counter += ret;		/* update statistics */
+	  CORE_WORKER_ADD(total->bytes, ret);
+	  progress = TRUE;
+	}
+	else if (errno == EAGAIN)
+	  dst->ready &= ~NC_EV_WRITE;
+	else
+	  return FALSE;
+      }
+
+      if (!r->eof[i] && (q->len < q->size) && (src->ready & NC_EV_READ)) {
+	ret = readv(src->fd, iov, netcat_buffer_space(q, iov));
+	debug_dv(("read(relay) = %d", ret));
+	CORE_WORKER_ADD(total->calls, 1);
+	if (ret > 0) {
+	  netcat_buffer_fill(q, ret);
+	  if (q->len > CORE_WORKER_GET(total->queue_peak))
+	    __atomic_store_n(&total->queue_peak, q->len, __ATOMIC_RELAXED);
+	  progress = TRUE;
+	}
+	else if (ret == 0) {
+	  r->eof[i] = TRUE;
+	  progress = TRUE;
+	}
+	else if (errno == EAGAIN)
+	  src->ready &= ~NC_EV_READ;
+	else
+	  return FALSE;
+      }
+
+      /* everything from this side was delivered, pass the EOF along */
+      if (r->eof[i] && !r->shut[i] && (q->len == 0)) {
+	shutdown(dst->fd, SHUT_WR);
+	r->shut[i] = TRUE;
+      }
+    }
+  } while (progress);
+
+  if (r->shut[0] && r->shut[1])
+    return FALSE;
+
+  /* the select engine needs to know what we are waiting for */
+  for (i = 0; i < 2; i++) {
+    int mask = 0;
+
+    if (!r->eof[i] && (r->q[i].len < r->q[i].size))
+      mask |= NC_EV_READ;
+    if (r->q[1 - i].len > 0)
+      mask |= NC_EV_WRITE;
+    core_event_mod(ev, &r->cfd[i], mask);
+  }
+  return TRUE;
+}
+
+/* Accepts the client `sock' and starts the connection to the target.
+   Returns the new relay, or NULL if the client was refused. */
+
+static core_relay_t *core_relay_new(core_tunnel_t *t, nc_evloop_t *ev,
+				    int sock, struct sockaddr_in *addr)
+{
+  nc_sock_t *target = t->target;
+  core_relay_t *r = NULL;
+  char peer[NETCAT_ADDRSTRLEN];
+  int i;
+
+  /* netcat_inet_ntop() is not reentrant */
+#ifdef HAVE_INET_NTOP
+  inet_ntop(AF_INET, &addr->sin_addr, peer, sizeof(peer));
+#else
+  strncpy(peer, inet_ntoa(addr->sin_addr), sizeof(peer) - 1);
+  peer[sizeof(peer) - 1] = 0;
+#endif
+
+  /* the same filter of the listen mode */
+  if ((t->listen->host.iaddrs[0].s_addr && memcmp(&t->listen->host.iaddrs[0],
+       &addr->sin_addr, sizeof(addr->sin_addr))) ||
+      (netcat_flag_count() && !netcat_flag_get(ntohs(addr->sin_port)))) {
+    ncprint(NCPRINT_VERB2, _("Unwanted connection from %s:%hu (refused)"),
+	    peer, ntohs(addr->sin_port));
+    goto err;
+  }
+  ncprint(NCPRINT_VERB1, _("Connection from %s:%hu"), peer,
+	  ntohs(addr->sin_port));
+
+  r = calloc(1, sizeof(*r));
+  if (!r || !netcat_buffer_init(&r->q[0], opt_buffer_size) ||
+      !netcat_buffer_init(&r->q[1], opt_buffer_size)) {
+    ncprint(NCPRINT_VERB1 | NCPRINT_WARNING,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+    goto err;
+  }
+  strcpy(r->peer, peer);
+  r->peer_port = ntohs(addr->sin_port);
+
+  r->cfd[0].fd = sock;
+  r->cfd[1].fd = netcat_socket_new_connect(PF_INET, SOCK_STREAM,
+	&target->host.iaddrs[0], target->port.netnum,
+	(target->local_host.iaddrs[0].s_addr ? &target->local_host.iaddrs[0] :
+	NULL), target->local_port.netnum);
+  if (r->cfd[1].fd < 0) {
+    ncprint(NCPRINT_VERB1, "%s: %s", t->target_name, strerror(errno));
+    goto err;
+  }
+  netcat_socket_linger_off(r->cfd[1].fd);
+  netcat_socket_tune(sock, SOCK_STREAM);
+  netcat_socket_report(sock);
+  core_set_nonblock(sock);
+  r->connecting = TRUE;
+  for (i = 0; i < 2; i++)
+    core_relay_add(ev, r, i);
+  core_event_mod(ev, &r->cfd[1], NC_EV_WRITE);
+  return r;
+
+ err:
+  if (r) {
+    netcat_buffer_free(&r->q[0]);
+    netcat_buffer_free(&r->q[1]);
+    free(r);
+  }
+  close(sock);
+  return NULL;
+}
+
+/* Body of a worker thread: accepts the clients on its own listening socket
+   and relays them until the main thread asks to stop. */
+
+static void *core_worker_main(void *arg)
+{
+  core_worker_t *w = arg;
+  core_tunnel_t *t = w->tunnel;
+  core_relay_t *list = NULL, *dead = NULL, *r, **rp;
+  core_fd_t fd_listen;
+  nc_evloop_t ev;
+  nc_event_t events[64];
+  bool accepting = TRUE, stop = FALSE;
+
+  memset(&fd_listen, 0, sizeof(fd_listen));
+  fd_listen.fd = w->sock_listen;
+  netcat_event_init(&ev, opt_engine);
+  core_event_add(&ev, &fd_listen);
+  core_event_mod(&ev, &fd_listen, NC_EV_READ);
+  if (netcat_event_add(&ev, t->stop_pipe[0], NC_EV_READ, FALSE, NULL) != 0)
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Critical system request failed: %s"),
+	    strerror(errno));
+
+  while (!stop) {
+    int i, ret;
+
+    ret = netcat_event_wait(&ev, events, sizeof(events) / sizeof(events[0]),
+			    NULL);
+    CORE_WORKER_ADD(w->waits, 1);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("select(core_worker)");
+      exit(EXIT_FAILURE);
+    }
+
+    /* first merge all the events, a relay may appear more than once */
+    for (i = 0; i < ret; i++) {
+      if (events[i].fd == fd_listen.fd)
+	fd_listen.ready |= events[i].events;
+      else if (events[i].fd == t->stop_pipe[0])
+	stop = TRUE;
+      else {
+	r = events[i].data;
+	r->cfd[events[i].fd == r->cfd[0].fd ? 0 : 1].ready |= events[i].events;
+      }
+    }
+
+    for (i = 0; i < ret; i++) {
+      if ((events[i].fd == fd_listen.fd) || (events[i].fd == t->stop_pipe[0]))
+	continue;
+      r = events[i].data;
+      if (r->cfd[0].fd < 0)
+	continue;			/* already closed in this round */
+      if (!core_relay_pump(w, &ev, r)) {
+	core_relay_close(&ev, r);
+	for (rp = &list; *rp != r; rp = &(*rp)->next);
+	*rp = r->next;
+	r->next = dead;
+	dead = r;
+	if (!accepting) {
+	  accepting = TRUE;
+	  core_event_mod(&ev, &fd_listen, NC_EV_READ);
+	}
+      }
+    }
+
+    /* accept all the pending clients */
+    while (accepting && (fd_listen.ready & NC_EV_READ)) {
+      struct sockaddr_in my_addr;
+      unsigned int my_len = sizeof(my_addr);
+      int sock_accept;
+
+      sock_accept = accept(w->sock_listen, (struct sockaddr *)&my_addr,
+			   &my_len);
+      if (sock_accept < 0) {
+	/* out of descriptors: stop accepting until a relay is closed */
+	if ((errno == EMFILE) || (errno == ENFILE)) {
+	  ncprint(NCPRINT_VERB1 | NCPRINT_WARNING,
+		  _("Couldn't accept more connections: %s"), strerror(errno));
+	  accepting = FALSE;
+	  core_event_mod(&ev, &fd_listen, 0);
+	}
+	/* with a shared socket another worker may have been faster */
+	fd_listen.ready = 0;
+	break;
+      }
+
+      r = core_relay_new(t, &ev, sock_accept, &my_addr);
+      if (r) {
+	r->next = list;
+	list = r;
+      }
+    }
+
+    while (dead) {
+      r = dead;
+      dead = r->next;
+      free(r);
+    }
+  }
+
+  while (list) {
+    r = list;
+    list = r->next;
+    core_relay_close(&ev, r);
+    free(r);
+  }
+  netcat_event_close(&ev);
+  return NULL;
+}
+
+/* Collects the statistics of the workers into the global ones.  The workers
+   don't stop updating their own, so this is just a snapshot. */
+
+static void core_workers_stats(core_worker_t *workers)
+{
+  int i, j;
+
+  memset(&stats_recv, 0, sizeof(stats_recv));
+  memset(&stats_sent, 0, sizeof(stats_sent));
+  stats_waits = 0;
+  for (i = 0; i < opt_workers; i++) {
+    for (j = 0; j < 2; j++) {
+      nc_stats_t *dst = (j ? &stats_sent : &stats_recv);
+      nc_stats_t *src = (j ? &workers[i].sent : &workers[i].recv);
+
+      int queue_peak = CORE_WORKER_GET(src->queue_peak);
+
+      dst->bytes += CORE_WORKER_GET(src->bytes);
+      dst->packets += CORE_WORKER_GET(src->packets);
+      dst->calls += CORE_WORKER_GET(src->calls);
+      if (queue_peak > dst->queue_peak)
+	dst->queue_peak = queue_peak;
+    }
+    stats_waits += CORE_WORKER_GET(workers[i].waits);
+  }
+}
+
+/* Runs the tunnel server, which relays every client connecting to `nc_listen'
+   to the target `nc_target' with opt_workers threads, until interrupted.
+   Returns 0 on success or -1 on error. */
+
+int core_tunnel_server(nc_sock_t *nc_listen, nc_sock_t *nc_target)
+{
+  int i, ret;
+  core_tunnel_t tunnel;
+  core_worker_t *workers;
+  sigset_t sigs, old_sigs;
+  debug_v(("core_tunnel_server(nc_listen=%p, nc_target=%p)", (void *)nc_listen,
+	  (void *)nc_target));
+
+  memset(&tunnel, 0, sizeof(tunnel));
+  tunnel.listen = nc_listen;
+  tunnel.target = nc_target;
+  strncpy(tunnel.target_name, netcat_strid(&nc_target->host, &nc_target->port),
+	  sizeof(tunnel.target_name) - 1);
+  workers = calloc(opt_workers, sizeof(*workers));
+  if (!workers || (pipe(tunnel.stop_pipe) < 0))
+    return -1;
+
+  /* every worker has its own socket, all of them bound to the port of the
+     first one.  Without SO_REUSEPORT they have to share a single socket. */
+  for (i = 0; i < opt_workers; i++) {
+    int sock;
+
+    workers[i].tunnel = &tunnel;
+#ifndef SO_REUSEPORT
+    if (i > 0) {
+      workers[i].sock_listen = workers[0].sock_listen;
+      continue;
+    }
+#endif
+    sock = netcat_socket_new_listen(PF_INET, &nc_listen->local_host.iaddrs[0],
+				    nc_listen->local_port.netnum, TRUE);
+    if (sock < 0)
+      ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	      _("Couldn't setup listening socket (err=%d)"), sock);
+
+    if (nc_listen->local_port.num == 0) {
+      struct sockaddr_in myaddr;
+      unsigned int myaddr_len = sizeof(myaddr);
+
+      if (getsockname(sock, (struct sockaddr *)&myaddr, &myaddr_len) < 0)
+	return -1;
+      netcat_getport(&nc_listen->local_port, NULL, ntohs(myaddr.sin_port));
+    }
+    netcat_socket_linger_off(sock);
+    core_set_nonblock(sock);
+    workers[i].sock_listen = sock;
+  }
+
+  ncprint(NCPRINT_VERB2, _("Listening on %s"),
+	  netcat_strid(&nc_listen->local_host, &nc_listen->local_port));
+  ncprint(NCPRINT_VERB2, _("Relaying to %s with %d worker threads"),
+	  tunnel.target_name, opt_workers);
+
+  /* the signals are only delivered to this thread, which waits for them */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+  signal_handler = FALSE;
+
+  for (i = 0; i < opt_workers; i++) {
+    ret = pthread_create(&workers[i].thread, NULL, core_worker_main,
+			 &workers[i]);
+    if (ret != 0)
+      ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	      _("Couldn't start the worker threads: %s"), strerror(ret));
+  }
+
+  /* the rates are only sampled when a signal wakes us up, so they are as
+     precise as --stats-interval */
+  netcat_stats_start();
+  while (!got_sigint && !got_sigterm) {
+    sigsuspend(&old_sigs);
+
+    core_workers_stats(workers);
+    netcat_stats_tick();
+    if (got_sigusr1) {
+      debug_v(("LOCAL printstats!"));
+      netcat_printstats(TRUE);
+      got_sigusr1 = FALSE;
+    }
+  }
+  got_sigint = FALSE;
+
+  /* wake up all the workers at once and collect their totals */
+  while (write(tunnel.stop_pipe[1], "", 1) < 0)
+    if (errno != EINTR)
+      ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	      _("Couldn't stop the worker threads: %s"), strerror(errno));
+  for (i = 0; i < opt_workers; i++)
+    pthread_join(workers[i].thread, NULL);
+  core_workers_stats(workers);
+
+  for (i = 0; i < opt_workers; i++)
+    if ((i == 0) || (workers[i].sock_listen != workers[0].sock_listen))
+      close(workers[i].sock_listen);
+  close(tunnel.stop_pipe[0]);
+  close(tunnel.stop_pipe[1]);
+  free(workers);
+
+  pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+  signal_handler = TRUE;
+
+  return 0;
+}				/* end of core_tunnel_server() */
+#endif	/* USE_THREADS */
@@ -0,0 +1,357 @@
+/*
+ * event.c -- I/O event notification engines for the core loop
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/* The event loop object hides the differences between the notification
+   engines.  Every descriptor is registered with a mask of the interesting
+   events and an opaque `data' pointer that is handed back when the
+   descriptor becomes ready.  The registration table is indexed by the
+   descriptor itself, so lookups never need to scan it.
+   Descriptors may be registered in edge-triggered mode, in which case the
+   engine reports each readiness transition only once and the caller must
+   keep track of it until a read or write returns EAGAIN.  The select engine
+   is level-triggered only and silently ignores this flag. */
+
+/* Makes sure that the registration table can hold the descriptor `fd'.
+   Returns TRUE on success or FALSE if the memory couldn't be allocated. */
+
+static bool event_table_grow(nc_evloop_t *ev, int fd)
+{
+  int newlen;
+  nc_evreg_t *p;
+
+  if (fd < ev->regs_len)
+    return TRUE;
+
+  for (newlen = (ev->regs_len ? ev->regs_len : 16); newlen <= fd; newlen *= 2);
+  p = realloc(ev->regs, newlen * sizeof(*p));
+  if (!p)
+    return FALSE;
+  memset(&p[ev->regs_len], 0, (newlen - ev->regs_len) * sizeof(*p));
+  ev->regs = p;
+  ev->regs_len = newlen;
+  return TRUE;
+}
+
+#ifdef USE_EPOLL
+/* Translates our event mask into the epoll one.  Edge-triggered descriptors
+   are always watched for both directions. */
+
+static unsigned int event_epoll_mask(int mask, bool edge)
+{
+  unsigned int ret = 0;
+
+  if (mask & NC_EV_READ)
+    ret |= EPOLLIN;
+  if (mask & NC_EV_WRITE)
+    ret |= EPOLLOUT;
+  if (edge)
+    ret = EPOLLIN | EPOLLOUT | EPOLLET;
+  return ret;
+}
+#endif
+
+/* Returns the name of the specified engine, as accepted on the command line */
+
+const char *netcat_event_name(nc_evengine_t engine)
+{
+  switch (engine) {
+  case NETCAT_EVENT_SELECT:
+    return "select";
+  case NETCAT_EVENT_EPOLL:
+    return "epoll";
+  case NETCAT_EVENT_URING:
+    return "io_uring";
+  }
+  return "unknown";
+}
+
+/* Initializes the event loop object pointed to by `ev' using the engine
+   `engine'.  If the requested engine is not available on this system, it
+   falls back to the select engine, which is always available.  The io_uring
+   engine only drives the data pump (see uring.c), so where an event loop is
+   needed anyway it is served by epoll.
+   Returns TRUE on success or FALSE if the engine couldn't be initialized,
+   in which case errno is set. */
+
+bool netcat_event_init(nc_evloop_t *ev, nc_evengine_t engine)
+{
+  debug_v(("netcat_event_init(ev=%p, engine=%s)", (void *)ev,
+	  netcat_event_name(engine)));
+
+  memset(ev, 0, sizeof(*ev));
+  ev->fd = -1;
+  ev->engine = NETCAT_EVENT_SELECT;
+
+#ifdef USE_EPOLL
+  if ((engine == NETCAT_EVENT_EPOLL) || (engine == NETCAT_EVENT_URING)) {
+    ev->fd = epoll_create(16);
+    if (ev->fd >= 0) {
+      ev->engine = NETCAT_EVENT_EPOLL;
+      return TRUE;
+    }
+    ncprint(NCPRINT_VERB2 | NCPRINT_WARNING,
+	    _("Couldn't initialize the epoll engine (%s), using select"),
+	    strerror(errno));
+  }
+#endif
+
+  return TRUE;
+}
+
+/* Releases all the resources held by the event loop object.  Registered
+   descriptors are NOT closed. */
+
+void netcat_event_close(nc_evloop_t *ev)
+{
+  if (ev->fd >= 0)
+    close(ev->fd);
+  free(ev->regs);
+  memset(ev, 0, sizeof(*ev));
+  ev->fd = -1;
+}
+
+/* Registers the descriptor `fd' for the events in `mask'.  If `edge' is TRUE
+   and the engine supports it, readiness is reported in edge-triggered mode.
+   Returns 0 on success, 1 if the descriptor can't be polled at all (regular
+   files, which are always ready, fall in this category) or -1 on error. */
+
+int netcat_event_add(nc_evloop_t *ev, int fd, int mask, bool edge, void *data)
+{
+  nc_evreg_t *reg;
+  debug_v(("netcat_event_add(ev=%p, fd=%d, mask=%d, edge=%s)", (void *)ev, fd,
+	  mask, BOOL_TO_STR(edge)));
+
+  assert(fd >= 0);
+  if (!event_table_grow(ev, fd))
+    return -1;
+  reg = &ev->regs[fd];
+
+#ifdef USE_EPOLL
+  if (ev->engine == NETCAT_EVENT_EPOLL) {
+    struct epoll_event ee;
+
+    memset(&ee, 0, sizeof(ee));
+    ee.events = event_epoll_mask(mask, edge);
+    ee.data.fd = fd;
+
+    /* the first registration also tells us if this descriptor supports
+       polling at all */
+    if (epoll_ctl(ev->fd, EPOLL_CTL_ADD, fd, &ee) < 0) {
+      if (errno == EPERM)
+	return 1;
+      return -1;
+    }
+
+    /* a level-triggered descriptor with no interesting events is not kept in
+       the kernel's interest list, otherwise hangups would be reported over
+       and over */
+    if (!mask && !edge)
+      epoll_ctl(ev->fd, EPOLL_CTL_DEL, fd, &ee);
+  }
+  else
+#endif
+  {
+    if (fd >= FD_SETSIZE) {
+      errno = EMFILE;
+      return -1;
+    }
+    if (fd >= ev->maxfd)
+      ev->maxfd = fd + 1;
+  }
+
+  reg->used = TRUE;
+  reg->edge = edge;
+  reg->mask = mask;
+  reg->data = data;
+  return 0;
+}
+
+/* Changes the events of interest for the already registered descriptor
+   `fd'.  Edge-triggered descriptors are always watched for every event, so
+   for them this function only records the new mask.
+   Returns 0 on success or -1 on error. */
+
+int netcat_event_mod(nc_evloop_t *ev, int fd, int mask)
+{
+  nc_evreg_t *reg;
+
+  assert((fd >= 0) && (fd < ev->regs_len) && ev->regs[fd].used);
+  reg = &ev->regs[fd];
+  if (reg->mask == mask)
+    return 0;
+
+#ifdef USE_EPOLL
+  if ((ev->engine == NETCAT_EVENT_EPOLL) && !reg->edge) {
+    struct epoll_event ee;
+    int op = EPOLL_CTL_MOD;
+
+    memset(&ee, 0, sizeof(ee));
+    ee.events = event_epoll_mask(mask, FALSE);
+    ee.data.fd = fd;
+    if (reg->mask == 0)
+      op = EPOLL_CTL_ADD;
+    else if (mask == 0)
+      op = EPOLL_CTL_DEL;
+    if (epoll_ctl(ev->fd, op, fd, &ee) < 0)
+      return -1;
+  }
+#endif
+
+  reg->mask = mask;
+  return 0;
+}
+
+/* Unregisters the descriptor `fd' from the event loop.  This MUST be called
+   before closing a registered descriptor. */
+
+void netcat_event_del(nc_evloop_t *ev, int fd)
+{
+  nc_evreg_t *reg;
+
+  if ((fd < 0) || (fd >= ev->regs_len) || !ev->regs[fd].used)
+    return;
+  reg = &ev->regs[fd];
+
+#ifdef USE_EPOLL
+  if ((ev->engine == NETCAT_EVENT_EPOLL) && (reg->mask || reg->edge)) {
+    struct epoll_event ee;	/* pre-2.6.9 kernels want a non-NULL pointer */
+
+    epoll_ctl(ev->fd, EPOLL_CTL_DEL, fd, &ee);
+  }
+#endif
+
+  memset(reg, 0, sizeof(*reg));
+  if (fd + 1 == ev->maxfd)
+    while ((ev->maxfd > 0) && !ev->regs[ev->maxfd - 1].used)
+      ev->maxfd--;
+}
+
+/* Waits for events on the registered descriptors and fills up to `max'
+   elements of the `events' array with them.  If `timeout' is not NULL it
+   specifies the maximum time to wait, and it is never modified.  Errors and
+   hangups are reported as both read and write events, so that the next I/O
+   call on that descriptor will return the actual failure.
+   Returns the number of events, 0 if the timeout expired or -1 on error. */
+
+int netcat_event_wait(nc_evloop_t *ev, nc_event_t *events, int max,
+		      struct timeval *timeout)
+{
+  int i, ret, count = 0;
+
+#ifdef USE_EPOLL
+  if (ev->engine == NETCAT_EVENT_EPOLL) {
+    struct epoll_event ee[64];
+    int ms = -1;
+
+    if (max > (int) (sizeof(ee) / sizeof(ee[0])))
+      max = sizeof(ee) / sizeof(ee[0]);
+
+    /* round up, otherwise we would spin with sub-millisecond timeouts */
+    if (timeout)
+      ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+    ret = epoll_wait(ev->fd, ee, max, ms);
+    if (ret < 0)
+      return -1;
+
+    for (i = 0; i < ret; i++) {
+      int fd = ee[i].data.fd, mask = 0;
+
+      if (ee[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+	mask |= NC_EV_READ;
+      if (ee[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+	mask |= NC_EV_WRITE;
+
+      /* the descriptor may have been unregistered in the meanwhile */
+      if ((fd >= ev->regs_len) || !ev->regs[fd].used)
+	continue;
+
+      events[count].fd = fd;
+      events[count].events = mask;
+      events[count].data = ev->regs[fd].data;
+      count++;
+    }
+    return count;
+  }
+#endif
+
+  /* the select engine.  Rebuild the descriptors sets from the table */
+  {
+    fd_set ins, outs;
+    struct timeval tt;
+
+    FD_ZERO(&ins);
+    FD_ZERO(&outs);
+    for (i = 0; i < ev->maxfd; i++) {
+      if (!ev->regs[i].used)
+	continue;
+      if (ev->regs[i].mask & NC_EV_READ)
+	FD_SET(i, &ins);
+      if (ev->regs[i].mask & NC_EV_WRITE)
+	FD_SET(i, &outs);
+    }
+
+    /* linux select(2) updates the timeout, so work on a copy */
+    if (timeout) {
+      tt.tv_sec = timeout->tv_sec;
+      tt.tv_usec = timeout->tv_usec;
+    }
+
+    debug(("[select] entering with timeout=%d:%d ...",
+	   (timeout ? (int) timeout->tv_sec : -1),
+	   (timeout ? (int) timeout->tv_usec : -1)));
+    ret = select(ev->maxfd, &ins, &outs, NULL, (timeout ? &tt : NULL));
+    if (ret <= 0)
+      return ret;
+
+    for (i = 0; (i < ev->maxfd) && (count < max); i++) {
+      int mask = 0;
+
+      if (!ev->regs[i].used)
+	continue;
+      if (FD_ISSET(i, &ins))
+	mask |= NC_EV_READ;
+      if (FD_ISSET(i, &outs))
+	mask |= NC_EV_WRITE;
+      if (!mask)
+	continue;
+
+      events[count].fd = i;
+      events[count].events = mask;
+      events[count].data = ev->regs[i].data;
+      count++;
+    }
+  }
+
+  return count;
+}
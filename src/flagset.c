@@ -28,8 +28,46 @@
 
 #include "netcat.h"
 
-static char *flagset = NULL;
-static size_t flagset_len = 0;
+
+/* The flags are kept in 64 bits words, so that a whole word of clear flags
+   is skipped at once, and the first flag set in a word is found with a
+   single instruction.  The number of flags set is kept up to date by
+   netcat_flag_set(), so that netcat_flag_count() costs nothing. */
+
+typedef unsigned long long flag_word_t;
+
+#define FLAG_BITS 64
+#define FLAG_WORD(port) ((port) / FLAG_BITS)
+#define FLAG_MASK(port) ((flag_word_t) 1 << ((port) % FLAG_BITS))
+
+#ifdef __GNUC__
+# define FLAG_CTZ(w) __builtin_ctzll(w)
+# define FLAG_POPCOUNT(w) __builtin_popcountll(w)
+#else
+static int FLAG_CTZ(flag_word_t w)
+{
+  int ret = 0;
+
+  while (!(w & 1)) {
+    w >>= 1;
+    ret++;
+  }
+  return ret;
+}
+
+static int FLAG_POPCOUNT(flag_word_t w)
+{
+  int ret = 0;
+
+  for (; w; w &= w - 1)
+    ret++;
+  return ret;
+}
+#endif
+
+static flag_word_t *flagset = NULL;
+static size_t flagset_words = 0;
+static int flagset_count = 0;
 
 /* Initializes the flagset to the given len. */
 
@@ -39,21 +77,16 @@ bool netcat_flag_init(unsigned int len)
   if (flagset)
     return TRUE;
 
-  /* calculates the block len needed */
+  /* calculates the number of words needed */
   len++;		/* the first bit is reserved (FIXME?) */
-  flagset_len = (size_t) (len / 8) + (len % 8 ? 1 : 0);
-  if (flagset_len == 0) {
-    free(flagset);
-    flagset = NULL;
-    return TRUE;
-  }
+  flagset_words = (size_t) (len / FLAG_BITS) + (len % FLAG_BITS ? 1 : 0);
 
   /* since we may be asking a big amount of memory, this call could fail */
-  flagset = malloc(flagset_len);
+  flagset = calloc(flagset_words, sizeof(*flagset));
   if (!flagset)
     return FALSE;
 
-  memset(flagset, 0, flagset_len);
+  flagset_count = 0;
   return TRUE;
 }
 
@@ -61,26 +94,27 @@ bool netcat_flag_init(unsigned int len)
 
 void netcat_flag_set(unsigned short port, bool flag)
 {
-  register char *p = flagset + (int) (port / 8);
-  register int offset = port % 8;
+  flag_word_t *p = flagset + FLAG_WORD(port);
 
   assert(flagset);
-  assert(port < (flagset_len * 8));
-  if (flag)
-    *p |= 1 << offset;
-  else
-    *p &= ~(1 << offset);
+  assert(FLAG_WORD(port) < flagset_words);
+  if (flag && !(*p & FLAG_MASK(port))) {
+    *p |= FLAG_MASK(port);
+    flagset_count++;
+  }
+  else if (!flag && (*p & FLAG_MASK(port))) {
+    *p &= ~FLAG_MASK(port);
+    flagset_count--;
+  }
 }
 
 /* Returns the boolean value of the specified flag `port' */
 
 bool netcat_flag_get(unsigned short port)
 {
-  register char *p = flagset + (int) (port / 8);
-
   assert(flagset);
-  assert(port < (flagset_len * 8));
-  if (*p & (1 << (port % 8)))
+  assert(FLAG_WORD(port) < flagset_words);
+  if (flagset[FLAG_WORD(port)] & FLAG_MASK(port))
     return TRUE;
   else
     return FALSE;
@@ -91,75 +125,30 @@ bool netcat_flag_get(unsigned short port)
 
 unsigned short netcat_flag_next(unsigned short port)
 {
-  register int offset, pos = (int) (++port / 8);
+  unsigned int pos = (unsigned int) port + 1;
+  size_t i = FLAG_WORD(pos);
+  flag_word_t w;
 
   assert(flagset);
-  assert(port < (flagset_len * 8));
-  if (port == 0)			/* just invalid data */
+  if (i >= flagset_words)
     return 0;
 
-  /* the given port could be inside one byte, so we first need to check each
-     single bit after this one in order to complete the byte.  After that, we
-     can start with the fast byte check. */
-  while ((offset = port % 8)) {
-    if (flagset[pos] & (1 << offset))
-      return port;
-    if (port == 65535)
+  /* the first word without the bits up to `port', then whole words */
+  w = flagset[i] & ~(FLAG_MASK(pos) - 1);
+  while (!w) {
+    if (++i == flagset_words)
       return 0;
-    port++;
+    w = flagset[i];
   }
-
-  pos = (int) (port / 8);		/* update the byte position */
-
-  /* fast checking. leaves the port variable set to the the beginning of the
-     next block containing at least one bit set, OR to the beginning of the
-     LAST block. */
-  while ((flagset[pos] == 0) && (port < 65528)) {	/* FIXME */
-    pos++;
-    port += 8;
-  }
-
-  /* parse this last byte carefully, but we are NOT sure that there is at
-     least one bit set */
-  offset = 0;
-  do {
-    if ((flagset[pos] & (1 << offset++)))
-      return port;
-  } while (port++ < 65535);			/* FIXME */
-
-  return 0;
+  return (unsigned short) (i * FLAG_BITS + FLAG_CTZ(w));
 }
 
 /* Returns the number of flags that are set to TRUE in the full flagset */
 
 int netcat_flag_count(void)
 {
-  register char c;
-  register int i;
-  int ret = 0;
-
   assert(flagset);
-  /* scan the flagset for set bits, if found, it counts them */
-  for (i = 0; i < flagset_len; i++) {
-    c = flagset[i];		/* if c is 0, all these 8 bits are FALSE */
-    while (c) {
-      /* FIXME Ok, here it comes the big trouble. We are in the following
-	 situation:
-		ret = 0
-		c   = 1234 5678
-
-	We will loop and shift bits away until the number `c' becomes 0 (and
-	it will of course become 0, soon or late).
-
-	Assumed that the bit number 1 is the sign, and that we will shift the
-	bit 1 (or the bit that takes its place later) until the the most right,
-	WHY it has to keep the wrong sign? */
-      ret -= (c >> 7);
-      c <<= 1;
-    }
-  }
-
-  return ret;
+  return flagset_count;
 }
 
 /* Returns the position of a random flag set to TRUE.  The returned flag is
@@ -169,28 +158,34 @@ int netcat_flag_count(void)
 
 unsigned short netcat_flag_rand(void)
 {
-  int rand, randmax = netcat_flag_count() - 1;
-  unsigned short ret = 0;
+  int rand, n;
+  size_t i;
+  flag_word_t w;
+  unsigned short ret;
 
   assert(flagset);
 
   /* if there are no other flags set */
-  if (randmax < 0)
+  if (flagset_count == 0)
     return 0;
 
 #ifdef USE_RANDOM
   /* fetch a random number from the high-order bits */
-  rand = 1 + (int) ((float)randmax * RAND() / (RAND_MAX + 1.0));
+  rand = (int) ((double) flagset_count * RAND() / (RAND_MAX + 1.0));
 #else
 # ifdef __GNUC__
 #  warning "random routines not found, removed random support"
 # endif
-  rand = 1;				/* simulates a random number */
+  rand = 0;				/* simulates a random number */
 #endif
 
-  /* loop until we find the specified flag */
-  while (rand--)
-    ret = netcat_flag_next(ret);
+  /* skip the whole words holding less flags than the ones to skip, then
+     the flags set before the chosen one inside its word */
+  for (i = 0; rand >= (n = FLAG_POPCOUNT(flagset[i])); i++)
+    rand -= n;
+  for (w = flagset[i]; rand > 0; rand--)
+    w &= w - 1;
+  ret = (unsigned short) (i * FLAG_BITS + FLAG_CTZ(w));
 
   /* don't return this same flag again */
   netcat_flag_set(ret, FALSE);
@@ -27,94 +27,126 @@
 #endif
 
 #include "netcat.h"
+#include <time.h>		/* clock_gettime() */
 
-/* Hexdump `datalen' bytes starting at `data' to the file pointed to by `stream'.
-   If the given block generates a partial line it's rounded up with blank spaces.
-   This function was written by Giovanni Giacobbi for The GNU Netcat project,
-   credits must be given for any use of this code outside this project */
+/* The hexdump is formatted a whole line at a time with lookup tables, into
+   a buffer which is written out when it's full and at the end of each call,
+   so that a large block takes a few writes instead of one for each line.
+   The offsets go on from a call to the next one, separately for the data
+   received ('<') and sent (anything else). */
 
-int netcat_fhexdump(FILE *stream, char c, const void *data, size_t datalen)
-{
-  size_t pos;
-  char buf[80], *ascii_dump, *p = NULL;
-  int flag = 0;
+#define HEXDUMP_LINE 80			/* room for a line with its newline */
+#define HEXDUMP_BUFSIZE (256 * HEXDUMP_LINE)
 
-#ifndef USE_OLD_HEXDUMP
-  buf[78] = 0;
-  ascii_dump = &buf[62];
-#else
-  buf[77] = 0;
-  ascii_dump = &buf[61];
-#endif
+static char hexdump_hex[256][2], hexdump_ascii[256];
+static unsigned long hexdump_offset[2];
 
-  for (pos = 0; pos < datalen; pos++) {
-    unsigned char x;
+/* Fills the lookup tables, the first time it's called */
 
-    /* save the offset */
-    if ((flag = pos % 16) == 0) {
-      /* we are at the beginning of the line, reset output buffer */
-      p = buf;
+static void hexdump_init(void)
+{
 #ifndef USE_OLD_HEXDUMP
-      p += sprintf(p, "%08X  ", (unsigned int) pos);
+  const char *digits = "0123456789ABCDEF";
 #else
-      p += sprintf(p, "%c %08X ", c, (unsigned int) pos);
+  const char *digits = "0123456789abcdef";
 #endif
-    }
+  int i;
+
+  if (hexdump_ascii[0])
+    return;
+  for (i = 0; i < 256; i++) {
+    hexdump_hex[i][0] = digits[i >> 4];
+    hexdump_hex[i][1] = digits[i & 15];
+    hexdump_ascii[i] = (((i < 32) || (i > 126)) ? '.' : i);
+  }
+}
 
-    x = *((unsigned char *)((unsigned char *)data + pos));
-#ifndef USE_OLD_HEXDUMP
-    p += sprintf(p, "%02hhX ", x);
-#else
-    p += sprintf(p, "%02hhx ", x);
-#endif
+/* Formats at `p' the line of the hexdump for the `len' bytes (up to 16) at
+   `data', which start at the offset `offset' of the stream.  A short line is
+   padded with blank spaces.  Returns the end of the line. */
 
-    if ((x < 32) || (x > 126))
-      ascii_dump[flag] = '.';
-    else
-      ascii_dump[flag] = x;
+static char *hexdump_line(char *p, char c, unsigned int offset,
+			  const unsigned char *data, int len)
+{
+  static const char upper[] = "0123456789ABCDEF";
+  int i;
 
+#ifdef USE_OLD_HEXDUMP
+  *p++ = c;
+  *p++ = ' ';
+#endif
+  for (i = 28; i >= 0; i -= 4)
+    *p++ = upper[(offset >> i) & 15];
+  *p++ = ' ';
 #ifndef USE_OLD_HEXDUMP
-    if ((pos + 1) % 4 == 0)
-      *p++ = ' ';
+  *p++ = ' ';
 #endif
 
-    /* if the offset is 15 then we go for the newline */
-    if (flag == 15) {
-#ifdef USE_OLD_HEXDUMP
-      *p++ = '#';
+  for (i = 0; i < 16; i++) {
+    if (i < len) {
+      *p++ = hexdump_hex[data[i]][0];
+      *p++ = hexdump_hex[data[i]][1];
+    }
+    else {
+      *p++ = ' ';
       *p++ = ' ';
-#endif
-      fprintf(stream, "%s\n", buf);
     }
-  }
-
-  /* if last line was incomplete (len % 16) != 0, complete it */
-  for (pos = datalen; (flag = pos % 16); pos++) {
-    ascii_dump[flag] = ' ';
-    strcpy(p, "   ");
-    p += 3;
-
+    *p++ = ' ';
 #ifndef USE_OLD_HEXDUMP
-    if (((pos + 1) % 4) == 0)
+    if ((i & 3) == 3)
       *p++ = ' ';
 #endif
-
-    if (flag == 15) {
+  }
 #ifdef USE_OLD_HEXDUMP
-      *p++ = '#';
-      *p++ = ' ';
+  *p++ = '#';
+  *p++ = ' ';
 #endif
-      fprintf(stream, "%s\n", buf);
+
+  for (i = 0; i < 16; i++)
+    *p++ = (i < len ? hexdump_ascii[data[i]] : ' ');
+  *p++ = '\n';
+  return p;
+}
+
+/* Hexdump `datalen' bytes starting at `data' to the file pointed to by `stream'.
+   If the given block generates a partial line it's rounded up with blank spaces.
+   If `data' is NULL the bytes are skipped, only moving the offset on.
+   This function was written by Giovanni Giacobbi for The GNU Netcat project,
+   credits must be given for any use of this code outside this project */
+
+int netcat_fhexdump(FILE *stream, char c, const void *data, size_t datalen)
+{
+  static char buf[HEXDUMP_BUFSIZE];
+  const unsigned char *d = data;
+  unsigned long *offset = &hexdump_offset[c == '<' ? 0 : 1];
+  char *p = buf;
+  size_t pos;
+
+  if (!data) {
+    *offset += datalen;
+    return 0;
+  }
+
+  hexdump_init();
+  for (pos = 0; pos < datalen; pos += 16) {
+    int len = (datalen - pos < 16 ? datalen - pos : 16);
+
+    if (p - buf > HEXDUMP_BUFSIZE - HEXDUMP_LINE) {
+      fwrite(buf, 1, p - buf, stream);
+      p = buf;
     }
+    p = hexdump_line(p, c, (unsigned int) (*offset + pos), d + pos, len);
   }
+  *offset += datalen;
 
+  fwrite(buf, 1, p - buf, stream);
   fflush(stream);
   return 0;
 }
 
 /* Fills the buffer pointed to by `str' with the formatted value of `number' */
 
-int netcat_snprintnum(char *str, size_t size, unsigned long number)
+int netcat_snprintnum(char *str, size_t size, unsigned long long number)
 {
   char *p = "\0kMGT";
 
@@ -122,7 +154,9 @@ int netcat_snprintnum(char *str, size_t size, unsigned long number)
     number = (number + 500) / 1000;
     p++;
   }
-  return snprintf(str, size, "%lu%c", number, *p);
+  if (!*p)
+    return snprintf(str, size, "%llu", number);
+  return snprintf(str, size, "%llu%c", number, *p);
 }
 
 /* This is an advanced function for printing normal and error messages for the
@@ -206,32 +240,6 @@ void ncprint(int type, const char *fmt, ...)
     exit(EXIT_FAILURE);
 }
 
-/* prints statistics to stderr with the right verbosity level.  If `force' is
-   TRUE, then the verbosity level is overridden and the statistics are printed
-   anyway. */
-
-void netcat_printstats(bool force)
-{
-  char *p, str_recv[64], str_sent[64];
-
-  /* fill in the buffers but preserve the space for adding the label */
-  netcat_snprintnum(str_recv, 32, bytes_recv);
-  assert(str_recv[0]);
-  for (p = str_recv; *(p + 1); p++);	/* find the last char */
-  if ((bytes_recv > 0) && !isdigit((int)*p))
-    snprintf(++p, sizeof(str_recv) - 32, " (%lu)", bytes_recv);
-
-  netcat_snprintnum(str_sent, 32, bytes_sent);
-  assert(str_sent[0]);
-  for (p = str_sent; *(p + 1); p++);	/* find the last char */
-  if ((bytes_sent > 0) && !isdigit((int)*p))
-    snprintf(++p, sizeof(str_sent) - 32, " (%lu)", bytes_sent);
-
-  ncprint(NCPRINT_NONEWLINE | (force ? 0 : NCPRINT_VERB2),
-	  _("Total received bytes: %s\nTotal sent bytes: %s\n"),
-	  str_recv, str_sent);
-}
-
 /* This is a safe string split function.  It will return a valid pointer
    whatever input parameter was used.  In normal behaviour, it will return a
    null-terminated string containing the first word of the string pointer to by
@@ -311,20 +319,43 @@ void netcat_printhelp(char *argv0)
   printf("\n");
   printf(_("Mandatory arguments to long options are mandatory for short options too.\n"));
   printf(_("Options:\n"
+"      --buffer-size=SIZE     size of the data queues (k, M suffixes allowed)\n"
 "  -c, --close                close connection on EOF from stdin\n"
+"      --concurrency=NUM      scan NUM ports at once with -z (default 1)\n"
+"      --congestion=NAME      TCP congestion control algorithm (e.g. bbr)\n"
+"      --cork                 send only full TCP segments (TCP_CORK)\n"
+"      --crlf                 send bare LF line ends as CR LF (CR LF is kept)\n"
 "  -e, --exec=PROGRAM         program to exec after connect\n"
+"      --fastopen[=NUM]       TCP Fast Open (NUM pending SYNs when listening)\n"
 "  -g, --gateway=LIST         source-routing hop point[s], up to 8\n"
 "  -G, --pointer=NUM          source-routing pointer: 4, 8, 12, ...\n"
+"      --generate[=SIZE:PAT]  send generated data (zero, seq, random), not stdin\n"
 "  -h, --help                 display this help and exit\n"
 "  -i, --interval=SECS        delay interval for lines sent, ports scanned\n"
+"      --io-engine=NAME       engine for the data pump: select, epoll, io_uring\n"
+"  -k, --keep-open            serve many clients at once in listen mode\n"
 "  -l, --listen               listen mode, for inbound connects\n"));
   printf(_(""
 "  -L, --tunnel=ADDRESS:PORT  forward local port to remote address\n"
+"      --mss=NUM              TCP maximum segment size\n"
 "  -n, --dont-resolve         numeric-only IP addresses, no DNS\n"
+"      --nodelay              send small TCP segments at once (TCP_NODELAY)\n"
+"      --no-splice            don't use zero-copy splice(2) and sendfile(2)\n"
 "  -o, --output=FILE          output hexdump traffic to FILE (implies -x)\n"
 "  -p, --local-port=NUM       local port number\n"
+"      --ping[=NUM]           measure NUM round trips, echo them when listening\n"
+"      --ping-size=SIZE       bytes of each round trip (default 64)\n"
+"      --pps=NUM              datagrams per second in each direction\n"
+"      --priority=NUM         priority of the sent packets (SO_PRIORITY)\n"
+"      --quickack             don't delay the TCP acknowledgments\n"
 "  -r, --randomize            randomize local and remote ports\n"
-"  -s, --source=ADDRESS       local source address (ip or hostname)\n"));
+"      --rate=SIZE            bytes per second in each direction (k, M, G)\n"
+"      --rcvbuf=SIZE          socket receive buffer size (k, M suffixes)\n"
+"  -s, --source=ADDRESS       local source address (ip or hostname)\n"
+"      --sink[=PATTERN]       discard the received data, checking the PATTERN\n"
+"      --sndbuf=SIZE          socket send buffer size (k, M suffixes)\n"
+"      --stats-format=FORMAT  statistics format: text (default) or json\n"
+"      --stats-interval=SECS  print the statistics every SECS seconds\n"));
 #ifndef USE_OLD_COMPAT
   printf(_(""
 "  -t, --tcp                  TCP mode (default)\n"
@@ -336,12 +367,16 @@ void netcat_printhelp(char *argv0)
 "  -T                         same as --telnet (compat)\n"));
 #endif
   printf(_(""
+"      --tos=NUM              IP type of service, also in hex (e.g. 0x10)\n"
 "  -u, --udp                  UDP mode\n"
+"      --udp-batch=NUM        datagrams moved by each system call (1-1024)\n"
 "  -v, --verbose              verbose (use twice to be more verbose)\n"
 "  -V, --version              output version information and exit\n"
 "  -x, --hexdump              hexdump incoming and outgoing traffic\n"
 "  -w, --wait=SECS            timeout for connects and final net reads\n"
-"  -z, --zero                 zero-I/O mode (used for scanning)\n"));
+"      --workers=NUM          relay the tunnel clients with NUM threads\n"
+"  -z, --zero                 zero-I/O mode (used for scanning)\n"
+"      --zerocopy             send the queued data with MSG_ZEROCOPY\n"));
   printf("\n");
   printf(_("Remote port number can also be specified as range.  "
 	   "Example: '1-1024'\n"));
@@ -386,36 +421,82 @@ const char *debug_fmt(const char *fmt, ...)
 }
 #endif
 
-#ifndef USE_LINUX_SELECT
-#define TIMEVAL_DIFF(__t1, __t2) {			\
-    (__t1)->tv_usec -= (__t2)->tv_usec;			\
-    if ((__t1)->tv_usec < 0) {				\
-      (__t1)->tv_usec += 1000000L;			\
-      (__t1)->tv_sec -= 1;				\
-    }							\
-    (__t1)->tv_sec -= (__t2)->tv_sec;			\
-    if ((__t1)->tv_sec < 0) {				\
-      (__t1)->tv_sec = 0;				\
-      (__t1)->tv_usec = 0;				\
-    }							\
-  }
+/* Parses the size specified in the string `str', which may be followed by
+   one of the (binary) multiplier suffixes k, M or G, and stores it in the
+   location pointed to by `size'.  Returns TRUE on success. */
 
-void update_timeval(struct timeval *target)
+bool netcat_strtosize(const char *str, unsigned long *size)
 {
-  static struct timeval dd_start;
-  struct timeval dd_end;
-  struct timezone dd_zone;
-
-  if (target == NULL) {			/* just initialize the seed */
-    if (gettimeofday(&dd_start, &dd_zone))
-      return;				/* can't handle this type of error */
+  char *end;
+  unsigned long ret;
+  int shift = 0;
+
+  if (!isdigit((int)*str))
+    return FALSE;
+
+  errno = 0;
+  ret = strtoul(str, &end, 10);
+  if (errno)
+    return FALSE;
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    shift = 10;
+    break;
+  case 'm':
+  case 'M':
+    shift = 20;
+    break;
+  case 'g':
+  case 'G':
+    shift = 30;
+    break;
   }
-  else {
-    if (gettimeofday(&dd_end, &dd_zone))
-      return;				/* can't handle this type of error */
+  if (shift)
+    end++;
+
+  /* reject trailing garbage and overflows */
+  if (*end || (ret > (ULONG_MAX >> shift)))
+    return FALSE;
+  *size = ret << shift;
+  return TRUE;
+}
 
-    TIMEVAL_DIFF(&dd_end, &dd_start);	/* get the spent time */
-    TIMEVAL_DIFF(target, &dd_end);	/* and update the target struct */
+/* Subtracts the time interval `t2' from `t1', storing the result in `t1'.
+   Negative results are rounded to zero, which is what the timeouts handling
+   routines expect. */
+
+void netcat_timeval_sub(struct timeval *t1, const struct timeval *t2)
+{
+  t1->tv_usec -= t2->tv_usec;
+  if (t1->tv_usec < 0) {
+    t1->tv_usec += 1000000L;
+    t1->tv_sec -= 1;
+  }
+  t1->tv_sec -= t2->tv_sec;
+  if (t1->tv_sec < 0) {
+    t1->tv_sec = 0;
+    t1->tv_usec = 0;
   }
 }
+
+/* Returns the current time in seconds, with microsecond precision at least.
+   The clock is the monotonic one where available, which doesn't jump when
+   the system time is set, so it's only good for measuring intervals. */
+
+double netcat_clock(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 #endif
+  {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+}
@@ -47,18 +47,80 @@ bool commandline_need_newline = FALSE;	/* fancy output handling */
 nc_mode_t netcat_mode = 0;	/* Netcat working modality */
 bool opt_eofclose = FALSE;	/* close connection on EOF from stdin */
 bool opt_debug = FALSE;		/* debugging output */
+bool opt_keepopen = FALSE;	/* keep listening and serve many clients */
 bool opt_numeric = FALSE;	/* don't resolve hostnames */
 bool opt_random = FALSE;	/* use random ports */
 bool opt_udpmode = FALSE;	/* use udp protocol instead of tcp */
 bool opt_telnet = FALSE;	/* answer in telnet mode */
 bool opt_hexdump = FALSE;	/* hexdump traffic */
 bool opt_zero = FALSE;		/* zero I/O mode (don't expect anything) */
+bool opt_splice = TRUE;		/* zero-copy tunnel relaying if available */
+bool opt_zerocopy = FALSE;	/* send the queued data with MSG_ZEROCOPY */
 int opt_interval = 0;		/* delay (in seconds) between lines/ports */
 int opt_verbose = 0;		/* be verbose (> 1 to be MORE verbose) */
 int opt_wait = 0;		/* wait time */
+int opt_buffer_size = 65536;	/* size of each direction's data queue */
+int opt_udp_batch = 16;		/* datagrams moved by each system call */
+int opt_workers = 0;		/* threads of the tunnel server (0 = off) */
+unsigned long opt_rate = 0;	/* bytes per second in each direction */
+int opt_pps = 0;		/* datagrams per second in each direction */
+int opt_sndbuf = 0;		/* SO_SNDBUF of the sockets (0 = default) */
+int opt_rcvbuf = 0;		/* SO_RCVBUF of the sockets (0 = default) */
+bool opt_nodelay = FALSE;	/* disable the Nagle algorithm */
+bool opt_cork = FALSE;		/* send only full TCP segments */
+bool opt_crlf = FALSE;		/* send the line ends as CR LF */
+bool opt_quickack = FALSE;	/* don't delay the TCP acknowledgments */
+char *opt_congestion = NULL;	/* TCP congestion control algorithm */
+int opt_mss = 0;		/* TCP maximum segment size (0 = default) */
+int opt_tos = -1;		/* IP type of service (-1 = default) */
+int opt_priority = -1;		/* SO_PRIORITY of the sockets (-1 = default) */
+int opt_fastopen = 0;		/* TCP Fast Open queue length (0 = off) */
+int opt_ping = 0;		/* round trips to measure (0 = off) */
+int opt_ping_size = NETCAT_PING_SIZE; /* bytes of each round trip */
+int opt_concurrency = 1;	/* ports scanned at once with -z */
+bool opt_stats_json = FALSE;	/* print the statistics as JSON */
+double opt_stats_interval = 0;	/* seconds between the statistics (0 = off) */
+nc_pattern_t opt_generate;	/* generated data instead of stdin */
+bool opt_sink = FALSE;		/* discard the received data */
+nc_pattern_type_t opt_sink_pattern = NETCAT_PATTERN_NONE; /* check of the sink */
 char *opt_outputfile = NULL;	/* hexdump output file */
 char *opt_exec = NULL;		/* program to exec after connecting */
 nc_proto_t opt_proto = NETCAT_PROTO_TCP; /* protocol to use for connections */
+#ifdef USE_EPOLL
+nc_evengine_t opt_engine = NETCAT_EVENT_EPOLL; /* core loop event engine */
+#else
+nc_evengine_t opt_engine = NETCAT_EVENT_SELECT;
+#endif
+
+/* values returned by getopt_long() for the switches without a short form */
+enum {
+  OPT_IO_ENGINE = 256,
+  OPT_NO_SPLICE,
+  OPT_BUFFER_SIZE,
+  OPT_UDP_BATCH,
+  OPT_WORKERS,
+  OPT_RATE,
+  OPT_PPS,
+  OPT_ZEROCOPY,
+  OPT_SNDBUF,
+  OPT_RCVBUF,
+  OPT_NODELAY,
+  OPT_CORK,
+  OPT_QUICKACK,
+  OPT_CONGESTION,
+  OPT_MSS,
+  OPT_TOS,
+  OPT_PRIORITY,
+  OPT_FASTOPEN,
+  OPT_STATS_FORMAT,
+  OPT_STATS_INTERVAL,
+  OPT_GENERATE,
+  OPT_SINK,
+  OPT_PING,
+  OPT_PING_SIZE,
+  OPT_CRLF,
+  OPT_CONCURRENCY
+};
 
 
 /* signal handling */
@@ -139,6 +201,8 @@ int main(int argc, char *argv[])
 {
   int c, glob_ret = EXIT_FAILURE;
   int total_ports, left_ports, accept_ret = -1, connect_ret = -1;
+  unsigned long size_arg;
+  char *endptr;
   struct sigaction sv;
   nc_port_t local_port;		/* local port specified with -p option */
   nc_host_t local_host;		/* local host for bind()ing operations */
@@ -171,6 +235,11 @@ int main(int argc, char *argv[])
   sigaction(SIGTERM, &sv, NULL);
   sv.sa_handler = got_usr1;
   sigaction(SIGUSR1, &sv, NULL);
+  /* the statistics timer (--stats-interval) fires often, so it shouldn't
+     interrupt the system calls that can be restarted */
+  sv.sa_flags = SA_RESTART;
+  sigaction(SIGALRM, &sv, NULL);
+  sv.sa_flags = 0;
   /* ignore some boring signals */
   sv.sa_handler = SIG_IGN;
   sigaction(SIGPIPE, &sv, NULL);
@@ -184,22 +253,46 @@ int main(int argc, char *argv[])
   while (TRUE) {
     int option_index = 0;
     static const struct option long_options[] = {
+	{ "buffer-size", required_argument,	NULL, OPT_BUFFER_SIZE },
 	{ "close",	no_argument,		NULL, 'c' },
+	{ "concurrency", required_argument,	NULL, OPT_CONCURRENCY },
+	{ "congestion",	required_argument,	NULL, OPT_CONGESTION },
+	{ "cork",	no_argument,		NULL, OPT_CORK },
+	{ "crlf",	no_argument,		NULL, OPT_CRLF },
 	{ "debug",	no_argument,		NULL, 'd' },
 	{ "exec",	required_argument,	NULL, 'e' },
+	{ "fastopen",	optional_argument,	NULL, OPT_FASTOPEN },
 	{ "gateway",	required_argument,	NULL, 'g' },
+	{ "generate",	optional_argument,	NULL, OPT_GENERATE },
 	{ "pointer",	required_argument,	NULL, 'G' },
 	{ "help",	no_argument,		NULL, 'h' },
 	{ "interval",	required_argument,	NULL, 'i' },
+	{ "io-engine",	required_argument,	NULL, OPT_IO_ENGINE },
+	{ "keep-open",	no_argument,		NULL, 'k' },
 	{ "listen",	no_argument,		NULL, 'l' },
 	{ "tunnel",	required_argument,	NULL, 'L' },
+	{ "mss",	required_argument,	NULL, OPT_MSS },
 	{ "dont-resolve", no_argument,		NULL, 'n' },
+	{ "nodelay",	no_argument,		NULL, OPT_NODELAY },
+	{ "no-splice",	no_argument,		NULL, OPT_NO_SPLICE },
 	{ "output",	required_argument,	NULL, 'o' },
+	{ "ping",	optional_argument,	NULL, OPT_PING },
+	{ "ping-size",	required_argument,	NULL, OPT_PING_SIZE },
 	{ "local-port",	required_argument,	NULL, 'p' },
 	{ "tunnel-port", required_argument,	NULL, 'P' },
+	{ "pps",	required_argument,	NULL, OPT_PPS },
+	{ "priority",	required_argument,	NULL, OPT_PRIORITY },
+	{ "quickack",	no_argument,		NULL, OPT_QUICKACK },
 	{ "randomize",	no_argument,		NULL, 'r' },
+	{ "rate",	required_argument,	NULL, OPT_RATE },
+	{ "rcvbuf",	required_argument,	NULL, OPT_RCVBUF },
+	{ "sink",	optional_argument,	NULL, OPT_SINK },
 	{ "source",	required_argument,	NULL, 's' },
+	{ "sndbuf",	required_argument,	NULL, OPT_SNDBUF },
+	{ "stats-format", required_argument,	NULL, OPT_STATS_FORMAT },
+	{ "stats-interval", required_argument,	NULL, OPT_STATS_INTERVAL },
 	{ "tunnel-source", required_argument,	NULL, 'S' },
+	{ "tos",	required_argument,	NULL, OPT_TOS },
 #ifndef USE_OLD_COMPAT
 	{ "tcp",	no_argument,		NULL, 't' },
 	{ "telnet",	no_argument,		NULL, 'T' },
@@ -208,15 +301,22 @@ int main(int argc, char *argv[])
 	{ "telnet",	no_argument,		NULL, 't' },
 #endif
 	{ "udp",	no_argument,		NULL, 'u' },
+	{ "udp-batch",	required_argument,	NULL, OPT_UDP_BATCH },
 	{ "verbose",	no_argument,		NULL, 'v' },
 	{ "version",	no_argument,		NULL, 'V' },
 	{ "hexdump",	no_argument,		NULL, 'x' },
 	{ "wait",	required_argument,	NULL, 'w' },
+#ifdef USE_THREADS
+	{ "workers",	required_argument,	NULL, OPT_WORKERS },
+#endif
 	{ "zero",	no_argument,		NULL, 'z' },
+#ifdef USE_ZEROCOPY
+	{ "zerocopy",	no_argument,		NULL, OPT_ZEROCOPY },
+#endif
 	{ 0, 0, 0, 0 }
     };
 
-    c = getopt_long(argc, argv, "cde:g:G:hi:lL:no:p:P:rs:S:tTuvVxw:z",
+    c = getopt_long(argc, argv, "cde:g:G:hi:klL:no:p:P:rs:S:tTuvVxw:z",
 		    long_options, &option_index);
     if (c == -1)
       break;
@@ -247,6 +347,9 @@ int main(int argc, char *argv[])
 	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
 		_("Invalid interval time \"%s\""), optarg);
       break;
+    case 'k':			/* serve many clients in listen mode */
+      opt_keepopen = TRUE;
+      break;
     case 'l':			/* mode flag: listen mode */
       if (netcat_mode != NETCAT_UNSPEC)
 	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
@@ -349,6 +452,165 @@ int main(int argc, char *argv[])
 		_("`-L' and `-z' options are incompatible"));
       opt_zero = TRUE;
       break;
+    case OPT_IO_ENGINE:		/* event engine for the core loop */
+      if (!strcmp(optarg, "select"))
+	opt_engine = NETCAT_EVENT_SELECT;
+#ifdef USE_EPOLL
+      else if (!strcmp(optarg, "epoll"))
+	opt_engine = NETCAT_EVENT_EPOLL;
+#endif
+#ifdef USE_URING
+      else if (!strcmp(optarg, "io_uring"))
+	opt_engine = NETCAT_EVENT_URING;
+#endif
+      else
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid or unsupported I/O engine: %s"), optarg);
+      break;
+    case OPT_NO_SPLICE:		/* always copy the data through our queues */
+      opt_splice = FALSE;
+      break;
+    case OPT_BUFFER_SIZE:	/* size of the data queues */
+      if (!netcat_strtosize(optarg, &size_arg) || (size_arg == 0) ||
+	  (size_arg > NETCAT_BUFFER_MAX))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid buffer size: %s"), optarg);
+      opt_buffer_size = size_arg;
+      break;
+    case OPT_UDP_BATCH:		/* datagrams per system call */
+      opt_udp_batch = atoi(optarg);
+      if ((opt_udp_batch <= 0) || (opt_udp_batch > NETCAT_UDP_BATCH_MAX))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid UDP batch size: %s"), optarg);
+      break;
+    case OPT_WORKERS:		/* threads of the tunnel server */
+      opt_workers = atoi(optarg);
+      if ((opt_workers <= 0) || (opt_workers > NETCAT_WORKERS_MAX))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid number of workers: %s"), optarg);
+      break;
+    case OPT_CONCURRENCY:	/* connects in flight when scanning */
+      opt_concurrency = atoi(optarg);
+      if ((opt_concurrency <= 0) ||
+	  (opt_concurrency > NETCAT_CONCURRENCY_MAX))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid concurrency: %s"), optarg);
+      break;
+    case OPT_RATE:		/* bandwidth limit */
+      if (!netcat_strtosize(optarg, &opt_rate) || (opt_rate == 0))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Invalid rate: %s"), optarg);
+      break;
+    case OPT_PPS:		/* datagram rate limit */
+      opt_pps = atoi(optarg);
+      if (opt_pps <= 0)
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid datagram rate: %s"), optarg);
+      break;
+    case OPT_ZEROCOPY:		/* zero-copy sends from the queue */
+      opt_zerocopy = TRUE;
+      break;
+    case OPT_SNDBUF:		/* socket buffer sizes */
+    case OPT_RCVBUF:
+      if (!netcat_strtosize(optarg, &size_arg) || (size_arg == 0) ||
+	  (size_arg > INT_MAX))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid socket buffer size: %s"), optarg);
+      if (c == OPT_SNDBUF)
+	opt_sndbuf = size_arg;
+      else
+	opt_rcvbuf = size_arg;
+      break;
+    case OPT_NODELAY:		/* TCP tuning switches */
+      opt_nodelay = TRUE;
+      break;
+    case OPT_CORK:
+      opt_cork = TRUE;
+      break;
+    case OPT_CRLF:		/* LF to CR LF in the data sent */
+      opt_crlf = TRUE;
+      break;
+    case OPT_QUICKACK:
+      opt_quickack = TRUE;
+      break;
+    case OPT_CONGESTION:	/* TCP congestion control algorithm */
+      if (!*optarg)
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid congestion control algorithm: %s"), optarg);
+      opt_congestion = strdup(optarg);
+      break;
+    case OPT_MSS:		/* TCP maximum segment size */
+      opt_mss = atoi(optarg);
+      if ((opt_mss <= 0) || (opt_mss > 65535))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid segment size: %s"), optarg);
+      break;
+    case OPT_TOS:		/* IP type of service, also in hex */
+      opt_tos = strtol(optarg, &endptr, 0);
+      if (!*optarg || *endptr || (opt_tos < 0) || (opt_tos > 255))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid type of service: %s"), optarg);
+      break;
+    case OPT_PRIORITY:		/* SO_PRIORITY of the sockets */
+      opt_priority = strtol(optarg, &endptr, 10);
+      if (!*optarg || *endptr || (opt_priority < 0))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid socket priority: %s"), optarg);
+      break;
+    case OPT_STATS_FORMAT:	/* text or JSON statistics */
+      if (!strcmp(optarg, "json"))
+	opt_stats_json = TRUE;
+      else if (!strcmp(optarg, "text"))
+	opt_stats_json = FALSE;
+      else
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid statistics format: %s"), optarg);
+      break;
+    case OPT_STATS_INTERVAL:	/* print the statistics periodically */
+      opt_stats_interval = strtod(optarg, &endptr);
+      if (!*optarg || *endptr || !(opt_stats_interval > 0) ||
+	  (opt_stats_interval > INT_MAX))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid statistics interval: %s"), optarg);
+      break;
+    case OPT_FASTOPEN:		/* TCP Fast Open, optionally its queue */
+      opt_fastopen = NETCAT_FASTOPEN_QLEN;
+      if (optarg) {
+	opt_fastopen = strtol(optarg, &endptr, 10);
+	if (!*optarg || *endptr || (opt_fastopen <= 0))
+	  ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		  _("Invalid Fast Open queue length: %s"), optarg);
+      }
+      break;
+    case OPT_GENERATE:		/* send generated data instead of stdin */
+      if (!netcat_pattern_parse(&opt_generate, optarg))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid data generator: %s"), optarg);
+      break;
+    case OPT_PING:		/* measure the round trip times */
+      opt_ping = NETCAT_PING_COUNT;
+      if (optarg) {
+	opt_ping = strtol(optarg, &endptr, 10);
+	if (!*optarg || *endptr || (opt_ping <= 0))
+	  ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		  _("Invalid number of round trips: %s"), optarg);
+      }
+      break;
+    case OPT_PING_SIZE:		/* size of the round trip messages */
+      if (!netcat_strtosize(optarg, &size_arg) || (size_arg == 0) ||
+	  (size_arg > NETCAT_BUFFER_MAX))
+	ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		_("Invalid message size: %s"), optarg);
+      opt_ping_size = size_arg;
+      break;
+    case OPT_SINK:		/* discard (and check) the received data */
+      opt_sink = TRUE;
+      if (optarg) {
+	opt_sink_pattern = netcat_pattern_type(optarg);
+	if (opt_sink_pattern == NETCAT_PATTERN_NONE)
+	  ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+		  _("Invalid data pattern: %s"), optarg);
+      }
+      break;
     default:
       ncprint(NCPRINT_EXIT, _("Try `%s --help' for more information."), argv[0]);
     }
@@ -386,6 +648,7 @@ int main(int argc, char *argv[])
   }
   else
     output_fp = stderr;
+  netcat_capture_start(NETCAT_CAPTURE_SIZE);
 
   debug_v(("Trying to parse non-args parameters (argc=%d, optind=%d)", argc,
 	  optind));
@@ -446,6 +709,98 @@ int main(int argc, char *argv[])
   }
 
   debug_dv(("Arguments parsing complete! Total ports=%d", netcat_flag_count()));
+
+  /* the keep-open server only knows about TCP clients and the standard I/O */
+  if (opt_keepopen && ((netcat_mode != NETCAT_LISTEN) ||
+      (opt_proto != NETCAT_PROTO_TCP) || opt_exec || opt_zero))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`-k' is only supported in TCP listen mode, without `-e' and `-z'"));
+
+  /* the workers relay the raw data and nothing else */
+  if (opt_workers && ((netcat_mode != NETCAT_TUNNEL) ||
+      (opt_proto != NETCAT_PROTO_TCP) ||
+      (connect_sock.proto != NETCAT_PROTO_TCP) || opt_hexdump ||
+      opt_telnet || opt_crlf || opt_interval))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--workers' is only supported in TCP tunnel mode, without `-i', `-T', `-x' and `--crlf'"));
+
+  /* only the TCP port scan can try many ports at once */
+  if ((opt_concurrency > 1) && ((netcat_mode != NETCAT_UNSPEC) ||
+      (opt_proto != NETCAT_PROTO_TCP) || !opt_zero || opt_interval))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--concurrency' is only supported in TCP connect mode with `-z', without `-i'"));
+
+  /* the servers don't do any shaping */
+  if ((opt_rate || opt_pps) && (opt_keepopen || opt_workers))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--rate' and `--pps' can't be used with `-k' and `--workers'"));
+  if (opt_zerocopy && (opt_keepopen || opt_workers))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--zerocopy' can't be used with `-k' and `--workers'"));
+
+  /* the generated data replaces the standard input of a single session */
+  if ((opt_generate.type != NETCAT_PATTERN_NONE) &&
+      ((netcat_mode == NETCAT_TUNNEL) || opt_keepopen || opt_exec || opt_zero))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--generate' can't be used with `-e', `-k', `-L' and `-z'"));
+  if (opt_sink &&
+      ((netcat_mode == NETCAT_TUNNEL) || opt_keepopen || opt_exec || opt_zero))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--sink' can't be used with `-e', `-k', `-L' and `-z'"));
+
+  /* the round trips replace the data pump of a single connection */
+  if (opt_ping && ((netcat_mode == NETCAT_TUNNEL) || opt_keepopen ||
+		   opt_exec || opt_zero))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--ping' can't be used with `-e', `-k', `-L' and `-z'"));
+  if (opt_ping && (opt_sink || (opt_generate.type != NETCAT_PATTERN_NONE)))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--ping' can't be used with `--generate' and `--sink'"));
+
+  /* with Fast Open the connect succeeds before the handshake, so it can't
+     tell whether a port is open */
+  if (opt_fastopen && (opt_zero || ((opt_proto != NETCAT_PROTO_TCP) &&
+      (connect_sock.proto != NETCAT_PROTO_TCP))))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("`--fastopen' is only supported with TCP, without `-z'"));
+
+  /* try the socket tuning on a scratch socket, so that an unsupported option
+     or a wrong value (like an unknown congestion control) is reported now
+     instead of failing every connection */
+  if (opt_sndbuf || opt_rcvbuf || opt_nodelay || opt_cork || opt_quickack ||
+      opt_congestion || opt_mss || (opt_tos >= 0) || (opt_priority >= 0) ||
+      opt_fastopen) {
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    const char *name = NULL;
+
+    if (sock >= 0) {
+      name = netcat_socket_tune(sock, SOCK_STREAM);
+      if (!name && (netcat_mode != NETCAT_LISTEN))
+	name = netcat_socket_fastopen(sock, FALSE);
+      if (!name && (netcat_mode != NETCAT_CONNECT))
+	name = netcat_socket_fastopen(sock, TRUE);
+    }
+    if (name)
+      ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Couldn't set %s: %s"), name,
+	      strerror(errno));
+    if (sock >= 0)
+      close(sock);
+  }
+
+  /* Linux only does Fast Open for the sides enabled by the administrator,
+     bit 1 for the clients and bit 2 for the servers */
+  if (opt_fastopen) {
+    FILE *fp = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    int sysctl;
+
+    if (fp && (fscanf(fp, "%d", &sysctl) == 1) &&
+	(((netcat_mode != NETCAT_LISTEN) && !(sysctl & 1)) ||
+	 ((netcat_mode != NETCAT_CONNECT) && !(sysctl & 2))))
+      ncprint(NCPRINT_WARNING,
+	      _("Fast Open is disabled by net.ipv4.tcp_fastopen (%d)"), sysctl);
+    if (fp)
+      fclose(fp);
+  }
 #if 0
   /* pure debugging code */
   c = 0;
@@ -473,6 +828,24 @@ int main(int argc, char *argv[])
     memcpy(&listen_sock.local_host, &local_host, sizeof(listen_sock.local_host));
     memcpy(&listen_sock.local_port, &local_port, sizeof(listen_sock.local_port));
     memcpy(&listen_sock.host, &remote_host, sizeof(listen_sock.host));
+
+    /* the keep-open server handles everything by itself */
+    if (opt_keepopen) {
+      if (core_server(&listen_sock) < 0)
+	ncprint(NCPRINT_VERB1 | NCPRINT_EXIT, _("Listen mode failed: %s"),
+		strerror(errno));
+      goto main_exit;
+    }
+
+    /* and so does the tunnel server */
+    if (opt_workers) {
+      if (core_tunnel_server(&listen_sock, &connect_sock) < 0)
+	ncprint(NCPRINT_VERB1 | NCPRINT_EXIT, _("Tunnel mode failed: %s"),
+		strerror(errno));
+      glob_ret = EXIT_SUCCESS;
+      goto main_exit;
+    }
+
     accept_ret = core_listen(&listen_sock);
 
     /* in zero I/O mode the core_tcp_listen() call will always return -1
@@ -496,7 +869,10 @@ int main(int argc, char *argv[])
 	ncprint(NCPRINT_VERB2, _("Passing control to the specified program"));
 	ncexec(&listen_sock);		/* this won't return */
       }
-      core_readwrite(&listen_sock, &stdio_sock);
+      if (opt_ping)
+	netcat_ping_echo(&listen_sock);
+      else
+	core_readwrite(&listen_sock, &stdio_sock);
       debug_dv(("Listen: EXIT"));
     }
     else {
@@ -541,6 +917,20 @@ int main(int argc, char *argv[])
     ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
 	    _("No ports specified for connection"));
 
+  /* with --concurrency the ports are scanned many at once */
+  if (opt_concurrency > 1) {
+    connect_sock.proto = opt_proto;
+    connect_sock.timeout = opt_wait;
+    memcpy(&connect_sock.local_host, &local_host,
+	   sizeof(connect_sock.local_host));
+    memcpy(&connect_sock.local_port, &local_port,
+	   sizeof(connect_sock.local_port));
+    memcpy(&connect_sock.host, &remote_host, sizeof(connect_sock.host));
+    if (netcat_scan(&connect_sock, total_ports) > 0)
+      glob_ret = EXIT_SUCCESS;
+    goto main_exit;
+  }
+
   c = 0;			/* must be set to 0 for netcat_flag_next() */
   left_ports = total_ports;
   while (left_ports > 0) {
@@ -596,7 +986,10 @@ int main(int argc, char *argv[])
 	ncprint(NCPRINT_VERB2, _("Passing control to the specified program"));
 	ncexec(&connect_sock);		/* this won't return */
       }
-      core_readwrite(&connect_sock, &stdio_sock);
+      if (opt_ping)
+	netcat_ping_client(&connect_sock);
+      else
+	core_readwrite(&connect_sock, &stdio_sock);
       /* FIXME: add a small delay */
       debug_v(("Connect: EXIT"));
 
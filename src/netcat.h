@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>		/* basic types definition */
 #include <sys/time.h>		/* timeval, time_t */
 #include <sys/socket.h>
@@ -95,6 +96,83 @@
 # endif
 #endif
 
+/* The epoll(7) event notification engine is only found on Linux, and it is
+   preferred over select(2) when available. */
+#ifdef HAVE_SYS_EPOLL_H
+# define USE_EPOLL
+#endif
+
+/* splice(2) lets the tunnel mode and the standard I/O exchange data with
+   the sockets without copying it to user space (Linux only) */
+#ifdef HAVE_SPLICE
+# define USE_SPLICE
+#endif
+
+/* sendfile(2) feeds a regular file straight into a socket */
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+# define USE_SENDFILE
+#endif
+
+/* recvmmsg(2) and sendmmsg(2) move a whole batch of UDP datagrams with a
+   single system call */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+# define USE_MMSG
+#endif
+
+/* io_uring(7) can drive the whole data pump with a few system calls, using
+   registered buffers and multishot receives (Linux 5.19 or later) */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STRUCT_IO_URING_BUF_REG)
+# define USE_URING
+#endif
+
+/* MSG_ZEROCOPY sends the data straight from the pages of the sending queue
+   and reports on the socket error queue when they can be reused (Linux) */
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && \
+    defined(SO_ZEROCOPY)
+# define USE_ZEROCOPY
+#endif
+
+/* POSIX threads let the tunnel server spread the connections on all the
+   processors */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+# define USE_THREADS
+#endif
+
+/* The data queues of the core loop can't be larger than this (bytes) */
+#define NETCAT_BUFFER_MAX (256 * 1024 * 1024)
+
+/* Maximum number of datagrams moved in a single batch */
+#define NETCAT_UDP_BATCH_MAX 1024
+
+/* A token bucket holds the tokens of this many milliseconds at most, so
+   this is how long a burst can be after an idle period */
+#define NETCAT_BUCKET_BURST 100
+
+/* An empty token bucket hands out the tokens of this many milliseconds at
+   once, so that a shaped stream moves in slices rather than a few bytes for
+   each system call */
+#define NETCAT_BUCKET_SLICE 10
+
+/* Maximum number of worker threads of the tunnel server */
+#define NETCAT_WORKERS_MAX 256
+
+/* Default length of the queue of pending TCP Fast Open requests */
+#define NETCAT_FASTOPEN_QLEN 16
+
+/* Memory for the hexdump waiting to be written to the -o file (bytes) */
+#define NETCAT_CAPTURE_SIZE (8 * 1024 * 1024)
+
+/* Default number and size (bytes) of the messages sent by --ping */
+#define NETCAT_PING_COUNT 1000
+#define NETCAT_PING_SIZE 64
+
+/* Maximum number of connects in flight when scanning (--concurrency) */
+#define NETCAT_CONCURRENCY_MAX 65535
+
+/* Room for the telnet replies that weren't sent yet.  An option is refused
+   at most once for each side, 3 bytes each time. */
+#define NETCAT_TELNET_REPLY (2 * 256 * 3)
+
 /* MAXINETADDR defines the maximum number of host aliases that are saved after
    a successfully hostname lookup. Please not that this value will also take
    a significant role in the memory usage. Approximately one struct takes:
@@ -150,19 +228,58 @@ typedef enum {
   NETCAT_PROTO_UDP
 } nc_proto_t;
 
-/* used for queues buffering and data tracking purposes.  The `head' field is
-   a pointer to the begin of the buffer segment, while `pos' indicates the
-   actual position of the data stream.  If `head' is NULL, it means that there
-   is no dynamically-allocated data in this buffer, *BUT* it MAY still contain
-   some local data segment (for example allocated inside the stack).
-   `len' indicates the length of the buffer starting from `pos'. */
+/* used for queues buffering and data tracking purposes.  The queue is a ring
+   buffer: `head' points to a memory area of `size' bytes, which holds `len'
+   bytes of data starting at the offset `pos' and possibly wrapping around
+   the end of the area.  If `head' is NULL the queue wasn't allocated yet.
+   The `pinned' bytes right before `pos' were already sent, but their memory
+   still belongs to the kernel (zero-copy sends), so it can't be reused. */
 
 typedef struct {
   unsigned char *head;
-  unsigned char *pos;
-  int len;
+  int size, pos, len, pinned;
 } nc_buffer_t;
 
+/* a token bucket, which limits the rate of some kind of units (bytes or
+   datagrams).  `tokens' is refilled at `rate' units per second up to `burst',
+   and it may become negative when a whole datagram was let through.  Once
+   empty, the bucket waits until it holds `slice' tokens.  A rate of 0 means
+   that the bucket never runs out of tokens. */
+
+typedef struct {
+  double rate, burst, slice, tokens, last;
+} nc_bucket_t;
+
+/* the statistics of one direction of the data flow: the data received from
+   the net and written to the output, or the data read from the input and
+   sent to the net.  The counters are 64 bits wide on every system.
+   `packets' counts the datagrams (it stays 0 between two streams), `calls'
+   the system calls (or io_uring requests) that moved the data, and
+   `queue_peak' is the most data ever found waiting in the queue. */
+
+typedef struct {
+  unsigned long long bytes, packets, calls;
+  int queue_peak;
+} nc_stats_t;
+
+/* Patterns of the generated data */
+
+typedef enum {
+  NETCAT_PATTERN_NONE,
+  NETCAT_PATTERN_ZERO,
+  NETCAT_PATTERN_SEQ,
+  NETCAT_PATTERN_RANDOM
+} nc_pattern_type_t;
+
+/* a stream of generated data (--generate).  Each byte only depends on its
+   position in the stream, and `offset' is the position of the next one.
+   The stream ends after `limit' bytes, or never if it's 0. */
+
+typedef struct {
+  nc_pattern_type_t type;
+  unsigned long long offset, limit;
+} nc_pattern_t;
+
 /* this is the standard netcat hosts record.  It contains an "authoritative"
    `name' field, which may be empty, and a list of IP addresses in the network
    notation and in the dotted string notation. */
@@ -184,6 +301,19 @@ typedef struct {
   in_port_t netnum;			/* port number in network byte order */
 } nc_port_t;
 
+/* the state of the telnet codes parser of a socket: the first bytes of a
+   code that was cut off by the end of the data received so far, the options
+   already refused (a bit for each option, for WILL and for DO), and the
+   replies that weren't sent yet */
+
+typedef struct {
+  unsigned char code[3];
+  int len;
+  unsigned char refused[2][32];
+  unsigned char reply[NETCAT_TELNET_REPLY];
+  int reply_len;
+} nc_telnet_t;
+
 /* This is a more complex struct that holds socket records. [...] */
 
 typedef struct {
@@ -192,8 +322,45 @@ typedef struct {
   nc_host_t local_host, host;
   nc_port_t local_port, port;
   nc_buffer_t sendq, recvq;
+  nc_telnet_t telnet;
 } nc_sock_t;
 
+/* I/O event notification engines available to the core loop */
+
+typedef enum {
+  NETCAT_EVENT_SELECT,
+  NETCAT_EVENT_EPOLL,
+  NETCAT_EVENT_URING
+} nc_evengine_t;
+
+/* events of interest for the event loop descriptors */
+#define NC_EV_READ	0x01
+#define NC_EV_WRITE	0x02
+
+/* registration record of a descriptor inside the event loop object */
+
+typedef struct {
+  bool used, edge;
+  int mask;
+  void *data;
+} nc_evreg_t;
+
+/* The event loop object.  `fd' is the kernel object used by the engine (if
+   any), while `regs' is the registration table, indexed by descriptor. */
+
+typedef struct {
+  nc_evengine_t engine;
+  int fd, maxfd, regs_len;
+  nc_evreg_t *regs;
+} nc_evloop_t;
+
+/* an event returned by netcat_event_wait() */
+
+typedef struct {
+  int fd, events;
+  void *data;
+} nc_event_t;
+
 /* Netcat includes */
 
 #include "proto.h"
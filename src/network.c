@@ -29,6 +29,29 @@
 #include "netcat.h"
 #include <netdb.h>		/* hostent, gethostby*, getservby* */
 #include <fcntl.h>		/* fcntl() */
+#include <netinet/tcp.h>	/* TCP_NODELAY, TCP_MAXSEG, ... */
+
+/* Some of the tuning options are Linux extensions.  Where they are missing
+   they get an invalid value, so that setting them fails and reading them
+   reports -1. */
+#ifndef SO_PRIORITY
+# define SO_PRIORITY -1
+#endif
+#ifndef TCP_CORK
+# define TCP_CORK -1
+#endif
+#ifndef TCP_QUICKACK
+# define TCP_QUICKACK -1
+#endif
+#ifndef TCP_CONGESTION
+# define TCP_CONGESTION -1
+#endif
+#ifndef TCP_FASTOPEN
+# define TCP_FASTOPEN -1
+#endif
+#ifndef TCP_FASTOPEN_CONNECT
+# define TCP_FASTOPEN_CONNECT -1
+#endif
 
 /* Fills the structure pointed to by `dst' with the valid DNS information
    for the target identified by `name', which can be an hostname or a valid IP
@@ -340,9 +363,166 @@ const char *netcat_inet_ntop(const void *src)
   return ret;
 }			/* end of netcat_inet_ntop() */
 
+/* Sets the integer option `name' of the socket `sock' to `val'.
+   Returns TRUE on success, otherwise FALSE and errno is set. */
+
+static bool netcat_sockopt_set(int sock, int level, int name, int val)
+{
+  if (name < 0) {
+    errno = ENOPROTOOPT;
+    return FALSE;
+  }
+  return (setsockopt(sock, level, name, &val, sizeof(val)) == 0);
+}
+
+/* Returns the value of the integer option `name' of the socket `sock', or
+   -1 if it can't be read. */
+
+static int netcat_sockopt_get(int sock, int level, int name)
+{
+  int val;
+  unsigned int len = sizeof(val);	/* socklen_t */
+
+  if ((name < 0) || (getsockopt(sock, level, name, &val, &len) < 0))
+    return -1;
+  return val;
+}
+
+/* Applies the tuning options given on the command line to the socket
+   `sock' of the specified `type'.  The TCP options are skipped for other
+   kinds of sockets.  TCP_QUICKACK isn't permanent, the kernel clears it on
+   its own, so it only holds until the next call (see
+   netcat_socket_quickack()).
+   Returns NULL on success, otherwise the name of the option that couldn't
+   be set, and errno is set. */
+
+const char *netcat_socket_tune(int sock, int type)
+{
+  if (opt_sndbuf && !netcat_sockopt_set(sock, SOL_SOCKET, SO_SNDBUF,
+					opt_sndbuf))
+    return "SO_SNDBUF";
+  if (opt_rcvbuf && !netcat_sockopt_set(sock, SOL_SOCKET, SO_RCVBUF,
+					opt_rcvbuf))
+    return "SO_RCVBUF";
+  if ((opt_tos >= 0) && !netcat_sockopt_set(sock, IPPROTO_IP, IP_TOS,
+					    opt_tos))
+    return "IP_TOS";
+  if ((opt_priority >= 0) && !netcat_sockopt_set(sock, SOL_SOCKET,
+						 SO_PRIORITY, opt_priority))
+    return "SO_PRIORITY";
+  if (type != SOCK_STREAM)
+    return NULL;
+
+  if (opt_nodelay && !netcat_sockopt_set(sock, IPPROTO_TCP, TCP_NODELAY, 1))
+    return "TCP_NODELAY";
+  if (opt_cork && !netcat_sockopt_set(sock, IPPROTO_TCP, TCP_CORK, 1))
+    return "TCP_CORK";
+  if (opt_quickack && !netcat_sockopt_set(sock, IPPROTO_TCP, TCP_QUICKACK, 1))
+    return "TCP_QUICKACK";
+  if (opt_mss && !netcat_sockopt_set(sock, IPPROTO_TCP, TCP_MAXSEG, opt_mss))
+    return "TCP_MAXSEG";
+  if (opt_congestion) {
+    if (TCP_CONGESTION < 0) {
+      errno = ENOPROTOOPT;
+      return "TCP_CONGESTION";
+    }
+    if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, opt_congestion,
+		   strlen(opt_congestion)) < 0)
+      return "TCP_CONGESTION";
+  }
+  return NULL;
+}
+
+/* Enables TCP Fast Open on the stream socket `sock', if it was requested.
+   A listening socket (`listen' is TRUE) accepts data in the SYN of up to
+   opt_fastopen clients whose handshake isn't complete yet.  For a
+   connecting socket, once the kernel has a cookie for the peer, connect(2)
+   succeeds at once and the SYN is only sent with the data of the first
+   write.
+   Returns NULL on success, otherwise the name of the option that couldn't
+   be set, and errno is set. */
+
+const char *netcat_socket_fastopen(int sock, bool listen)
+{
+  if (!opt_fastopen)
+    return NULL;
+  if (listen) {
+    if (!netcat_sockopt_set(sock, IPPROTO_TCP, TCP_FASTOPEN, opt_fastopen))
+      return "TCP_FASTOPEN";
+  }
+  else if (!netcat_sockopt_set(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1))
+    return "TCP_FASTOPEN_CONNECT";
+  return NULL;
+}
+
+/* Starts the handshake of the connecting socket `sock' if Fast Open is
+   still holding the SYN back for the data of the first write.  This is
+   needed when there is nothing to send, otherwise the peer would never hear
+   from us.  An empty send(2) has no effect on a connected socket. */
+
+void netcat_socket_fastopen_start(int sock)
+{
+  if (opt_fastopen)
+    send(sock, "", 0, 0);		/* EINPROGRESS is expected */
+}
+
+/* Sets TCP_QUICKACK again on the socket `sock' if it was requested, since
+   the kernel goes back to delayed acknowledgments on its own */
+
+void netcat_socket_quickack(int sock)
+{
+  if (opt_quickack)
+    netcat_sockopt_set(sock, IPPROTO_TCP, TCP_QUICKACK, 1);
+}
+
+/* Sets TCP_NODELAY on the socket `sock' whatever the options say, for the
+   exchanges of small messages where each one must go out at once */
+
+void netcat_socket_nodelay(int sock)
+{
+  if (!netcat_sockopt_set(sock, IPPROTO_TCP, TCP_NODELAY, 1))
+    ncprint(NCPRINT_VERB1 | NCPRINT_WARNING,
+	    _("Couldn't set TCP_NODELAY: %s"), strerror(errno));
+}
+
+/* Prints with verbosity level 2 the effective values of the tunable options
+   of the socket `sock', which may differ from the requested ones (Linux
+   doubles the buffer sizes, for example).  Options that can't be read are
+   shown as -1. */
+
+void netcat_socket_report(int sock)
+{
+  char buf[256], cong[32];
+  unsigned int len = sizeof(cong) - 1;	/* socklen_t */
+  int n;
+
+  if (opt_verbose < 2)
+    return;
+
+  n = snprintf(buf, sizeof(buf), "sndbuf=%d rcvbuf=%d tos=0x%02x priority=%d",
+	       netcat_sockopt_get(sock, SOL_SOCKET, SO_SNDBUF),
+	       netcat_sockopt_get(sock, SOL_SOCKET, SO_RCVBUF),
+	       netcat_sockopt_get(sock, IPPROTO_IP, IP_TOS) & 0xff,
+	       netcat_sockopt_get(sock, SOL_SOCKET, SO_PRIORITY));
+
+  if (netcat_sockopt_get(sock, SOL_SOCKET, SO_TYPE) == SOCK_STREAM) {
+    memset(cong, 0, sizeof(cong));
+    if ((TCP_CONGESTION < 0) ||
+	(getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, cong, &len) < 0))
+      strcpy(cong, "-1");
+    snprintf(buf + n, sizeof(buf) - n,
+	     " nodelay=%d cork=%d mss=%d congestion=%s",
+	     netcat_sockopt_get(sock, IPPROTO_TCP, TCP_NODELAY),
+	     netcat_sockopt_get(sock, IPPROTO_TCP, TCP_CORK),
+	     netcat_sockopt_get(sock, IPPROTO_TCP, TCP_MAXSEG), cong);
+  }
+  ncprint(NCPRINT_VERB2, _("Socket options: %s"), buf);
+}
+
 /* Backend for the socket(2) system call.  This function wraps the creation of
    new sockets and sets the common SO_REUSEADDR socket option, and the useful
-   SO_LINGER option (if system available) handling eventual errors.
+   SO_LINGER option (if system available) handling eventual errors.  The
+   tuning options given by the user are applied too.
    Returns -1 if the socket(2) call failed, -2 if the setsockopt() call failed;
    otherwise the return value is a descriptor referencing the new socket. */
 
@@ -372,17 +552,40 @@ int netcat_socket_new(int domain, int type)
     return -2;
   }
 
+  /* and then the ones requested by the user.  They must be set before
+     connecting (or listening), so that the buffer sizes and the segment size
+     are taken into account by the handshake. */
+  if (netcat_socket_tune(sock, type)) {
+    close(sock);
+    return -2;
+  }
+
   return sock;
 }
 
+/* Clears the SO_LINGER option that netcat_socket_new() sets.  A connection
+   which is closed because our side is done (a relay whose both sides are
+   done, or the EOF from stdin with -c) may still have some data to deliver
+   in the kernel, and a linger time of 0 would reset the connection and
+   throw it away. */
+
+void netcat_socket_linger_off(int sock)
+{
+  struct linger fix_ling;
+
+  fix_ling.l_onoff = 0;
+  fix_ling.l_linger = 0;
+  setsockopt(sock, SOL_SOCKET, SO_LINGER, &fix_ling, sizeof(fix_ling));
+}
+
 /* Creates a full outgoing async socket connection in the specified `domain'
    and `type' to the specified `addr' and `port'.  The connection is
    originated using the optionally specified `local_addr' and `local_port'.
    If `local_addr' is NULL and `local_port' is 0 the bind(2) call is skipped.
    Returns the descriptor referencing the new socket on success, otherwise
-   returns -1 or -2 if socket creation failed (see netcat_socket_new()),
-   or -3 if the bind(2) call failed, -4 if the fcntl(2) call failed, or -5
-   if the connect(2) call failed. */
+   returns -1 or -2 if socket creation failed (see netcat_socket_new()) or
+   Fast Open couldn't be enabled, or -3 if the bind(2) call failed, -4 if
+   the fcntl(2) call failed, or -5 if the connect(2) call failed. */
 
 int netcat_socket_new_connect(int domain, int type, const struct in_addr *addr,
 		in_port_t port, const struct in_addr *local_addr,
@@ -432,6 +635,11 @@ int netcat_socket_new_connect(int domain, int type, const struct in_addr *addr,
     }
   }
 
+  if ((type == SOCK_STREAM) && netcat_socket_fastopen(sock, FALSE)) {
+    ret = -2;
+    goto err;
+  }
+
   /* add the non-blocking flag to this socket */
   if ((ret = fcntl(sock, F_GETFL, 0)) >= 0)
     ret = fcntl(sock, F_SETFL, ret | O_NONBLOCK);
@@ -472,18 +680,23 @@ int netcat_socket_new_connect(int domain, int type, const struct in_addr *addr,
    `addr' parameter is optional and specifies the local interface at which
    socket should be bound to.  If `addr' is NULL, it defaults to INADDR_ANY,
    which is a valid value as well.
+   If `shared' is TRUE other sockets may be bound to the same address and port
+   (SO_REUSEPORT), and the kernel spreads the incoming connections among them.
+   Such sockets are meant to serve many clients, so they get a longer queue
+   of pending connections.  TCP Fast Open is enabled here if requested.
    Returns the descriptor referencing the listening socket on success,
    otherwise returns -1 or -2 if socket creation failed (see
    netcat_socket_new()), -3 if the bind(2) call failed, or -4 if the listen(2)
    call failed. */
 
 int netcat_socket_new_listen(int domain, const struct in_addr *addr,
-			     in_port_t port)
+			     in_port_t port, bool shared)
 {
   int sock, ret, my_family;
   struct sockaddr_in my_addr;
 
-  debug_dv(("netcat_socket_new_listen(addr=%p, port=%hu)", (void *)addr, port));
+  debug_dv(("netcat_socket_new_listen(addr=%p, port=%hu, shared=%s)",
+	   (void *)addr, port, BOOL_TO_STR(shared)));
 
   /* selects the currently supported domains */
   if (domain == PF_INET)
@@ -506,6 +719,23 @@ int netcat_socket_new_listen(int domain, const struct in_addr *addr,
   if (sock < 0)
     return sock;		/* forward the error code */
 
+#ifdef SO_REUSEPORT
+  if (shared) {
+    int sockopt = 1;
+
+    ret = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt));
+    if (ret < 0) {
+      ret = -2;
+      goto err;
+    }
+  }
+#endif
+
+  if (netcat_socket_fastopen(sock, TRUE)) {
+    ret = -2;
+    goto err;
+  }
+
   /* bind it to the specified address (can be INADDY_ANY) */
   ret = bind(sock, (struct sockaddr *)&my_addr, sizeof(my_addr));
   if (ret < 0) {
@@ -514,7 +744,7 @@ int netcat_socket_new_listen(int domain, const struct in_addr *addr,
   }
 
   /* now make it listening, with a reasonable backlog value */
-  ret = listen(sock, 4);
+  ret = listen(sock, (shared ? SOMAXCONN : 4));
   if (ret < 0) {
     ret = -4;
     goto err;
@@ -586,6 +816,8 @@ int netcat_socket_accept(int s, int timeout)
 
     new_sock = accept(s, NULL, NULL);
     debug_v(("Connection received (new fd=%d)", new_sock));
+    if (new_sock >= 0)
+      netcat_socket_tune(new_sock, SOCK_STREAM);
 
     /* NOTE: as accept() could fail, new_sock might also be a negative value.
        It's application's work to handle the right errno. */
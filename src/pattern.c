@@ -0,0 +1,205 @@
+/*
+ * pattern.c -- generated data streams
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+
+/* Each byte of a pattern only depends on its offset in the stream, so that
+   the data can be produced (and checked) in pieces of any size.  The random
+   pattern is made of 64 bits words, each one obtained by mixing its own
+   index with the splitmix64 finalizer, and stored least significant byte
+   first, so it's the same on every system. */
+
+static const struct {
+  const char *name;
+  nc_pattern_type_t type;
+} pattern_names[] = {
+  { "zero",	NETCAT_PATTERN_ZERO },
+  { "seq",	NETCAT_PATTERN_SEQ },
+  { "random",	NETCAT_PATTERN_RANDOM },
+  { NULL,	NETCAT_PATTERN_NONE }
+};
+
+/* Returns the word number `index' of the random pattern */
+
+static unsigned long long pattern_word(unsigned long long index)
+{
+  unsigned long long z = (index + 1) * 0x9E3779B97F4A7C15ULL;
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/* Stores in `buf' the `len' bytes of the pattern `type' that start at the
+   offset `offset' of the stream */
+
+static void pattern_fill(nc_pattern_type_t type, unsigned long long offset,
+			 unsigned char *buf, size_t len)
+{
+  static unsigned char seq[512];
+  size_t n;
+
+  switch (type) {
+  case NETCAT_PATTERN_SEQ:
+    if (!seq[1]) {
+      for (n = 0; n < sizeof(seq); n++)
+	seq[n] = (unsigned char) n;
+    }
+    while (len > 0) {
+      n = (len < 256 ? len : 256);
+      memcpy(buf, seq + (offset & 255), n);
+      buf += n;
+      len -= n;
+      offset += n;
+    }
+    break;
+  case NETCAT_PATTERN_RANDOM:
+    /* the bytes up to the next word boundary, then whole words */
+    while ((len > 0) && (offset & 7)) {
+      *buf++ = (unsigned char) (pattern_word(offset >> 3) >> ((offset & 7) * 8));
+      len--;
+      offset++;
+    }
+    while (len > 0) {
+      unsigned long long w = pattern_word(offset >> 3);
+
+      n = (len < 8 ? len : 8);
+      len -= n;
+      offset += n;
+      while (n-- > 0) {
+	*buf++ = (unsigned char) w;
+	w >>= 8;
+      }
+    }
+    break;
+  default:
+    memset(buf, 0, len);
+  }
+}
+
+/* Returns the pattern called `name', or NETCAT_PATTERN_NONE if there is no
+   such pattern */
+
+nc_pattern_type_t netcat_pattern_type(const char *name)
+{
+  int i;
+
+  for (i = 0; pattern_names[i].name; i++)
+    if (!strcmp(name, pattern_names[i].name))
+      break;
+  return pattern_names[i].type;
+}
+
+/* Parses the specification of a generated stream in `str', in the form
+   [SIZE][:PATTERN], and stores it in `p'.  A missing or 0 size means that
+   the stream never ends, while the default pattern is "zero".  `str' may be
+   NULL, which stands for an endless stream of zeros.
+   Returns TRUE on success. */
+
+bool netcat_pattern_parse(nc_pattern_t *p, const char *str)
+{
+  const char *name = (str ? strchr(str, ':') : NULL);
+  unsigned long size = 0;
+  int ret;
+
+  memset(p, 0, sizeof(*p));
+  p->type = NETCAT_PATTERN_ZERO;
+  if (!str)
+    return TRUE;
+
+  if (name != str) {
+    char *tmp = strdup(str);
+
+    if (!tmp)
+      return FALSE;
+    if (name)
+      tmp[name - str] = 0;
+    ret = netcat_strtosize(tmp, &size);
+    free(tmp);
+    if (!ret)
+      return FALSE;
+  }
+  p->limit = size;
+
+  if (name) {
+    p->type = netcat_pattern_type(name + 1);
+    if (p->type == NETCAT_PATTERN_NONE)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Produces the next bytes of the generated stream `p' into the `iovcnt'
+   buffers of `iov', as readv(2) would do.  Returns the number of bytes
+   produced, which is 0 once the stream is over. */
+
+int netcat_pattern_read(nc_pattern_t *p, struct iovec *iov, int iovcnt)
+{
+  int i, ret = 0;
+
+  for (i = 0; i < iovcnt; i++) {
+    size_t len = iov[i].iov_len;
+
+    if (p->limit && (len > p->limit - p->offset))
+      len = p->limit - p->offset;
+    pattern_fill(p->type, p->offset, iov[i].iov_base, len);
+    p->offset += len;
+    ret += len;
+  }
+  return ret;
+}
+
+/* Compares the `len' bytes at `data' with the next bytes of the stream `p',
+   which moves on past them.  The expected data is made up in small pieces,
+   so that the comparison stays in the cache.  Returns the number of bytes
+   that don't match, storing the offset of the first one in `bad'. */
+
+size_t netcat_pattern_verify(nc_pattern_t *p, const void *data, size_t len,
+			     unsigned long long *bad)
+{
+  const unsigned char *d = data;
+  unsigned char expect[1024];
+  size_t i, n, ret = 0;
+
+  while (len > 0) {
+    n = (len < sizeof(expect) ? len : sizeof(expect));
+    pattern_fill(p->type, p->offset, expect, n);
+    if (memcmp(d, expect, n)) {
+      for (i = 0; i < n; i++) {
+	if (d[i] == expect[i])
+	  continue;
+	if (ret++ == 0)
+	  *bad = p->offset + i;
+      }
+    }
+    d += n;
+    len -= n;
+    p->offset += n;
+  }
+  return ret;
+}
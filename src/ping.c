@@ -0,0 +1,394 @@
+/*
+ * ping.c -- round trip time measurement
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+#include <poll.h>
+
+/* With --ping the connecting side sends a message, waits for the listening
+   side to send it back, and measures the time in between.  The round trip
+   times are kept in a histogram with logarithmic buckets, each power of two
+   split in PING_SUB linear steps, which keeps the error below 1% at any
+   scale with a fixed amount of memory.  The times are in nanoseconds. */
+
+#define PING_SUB_BITS 7
+#define PING_SUB (1 << PING_SUB_BITS)
+#define PING_BUCKETS ((64 - PING_SUB_BITS + 1) * PING_SUB)
+
+/* A datagram that didn't come back after this many milliseconds is lost,
+   unless -w says otherwise */
+#define PING_UDP_TIMEOUT 1000
+
+typedef struct {
+  unsigned long long counts[PING_BUCKETS];
+  unsigned long long count, min, max;
+  double sum;
+} ping_hist_t;
+
+/* Returns the bucket of the value `v'.  The values below 2 * PING_SUB have
+   a bucket each, the larger ones are shifted down to PING_SUB_BITS + 1
+   significant bits. */
+
+static int ping_bucket(unsigned long long v)
+{
+  int shift = 0;
+
+  while ((v >> shift) >= 2 * PING_SUB)
+    shift++;
+  if (shift == 0)
+    return (int) v;
+  return (shift + 1) * PING_SUB + (int) (v >> shift) - PING_SUB;
+}
+
+/* Returns the largest value that falls in the bucket `b' */
+
+static unsigned long long ping_bucket_max(int b)
+{
+  int shift = b / PING_SUB - 1;
+
+  if (shift <= 0)
+    return b;
+  return ((unsigned long long) (b % PING_SUB + PING_SUB + 1) << shift) - 1;
+}
+
+static void ping_hist_add(ping_hist_t *h, unsigned long long v)
+{
+  h->counts[ping_bucket(v)]++;
+  if ((h->count == 0) || (v < h->min))
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+  h->sum += v;
+  h->count++;
+}
+
+/* Returns the value below which falls the percentage `p' of the samples,
+   as the top of its bucket but within the exact minimum and maximum */
+
+static unsigned long long ping_hist_percentile(const ping_hist_t *h, double p)
+{
+  unsigned long long rank, seen = 0, v;
+  int b;
+
+  if (h->count == 0)
+    return 0;
+  rank = (unsigned long long) (p / 100 * h->count + 0.999999);
+  if (rank < 1)
+    rank = 1;
+  for (b = 0; b < PING_BUCKETS - 1; b++) {
+    seen += h->counts[b];
+    if (seen >= rank)
+      break;
+  }
+  v = ping_bucket_max(b);
+  if (v > h->max)
+    v = h->max;
+  if (v < h->min)
+    v = h->min;
+  return v;
+}
+
+/* Prints the results of the measure, as text or as a line of JSON */
+
+static void ping_report(const ping_hist_t *h, int size,
+			unsigned long long lost)
+{
+  unsigned long long p50 = ping_hist_percentile(h, 50),
+    p99 = ping_hist_percentile(h, 99), p999 = ping_hist_percentile(h, 99.9);
+  double avg = (h->count ? h->sum / h->count : 0);
+
+  if (opt_stats_json)
+    ncprint(NCPRINT_NORMAL, "{\"rtt\":{\"count\":%llu,\"lost\":%llu,"
+	    "\"size\":%d,\"min_ns\":%llu,\"avg_ns\":%.0f,\"p50_ns\":%llu,"
+	    "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}}", h->count,
+	    lost, size, h->min, avg, p50, p99, p999, h->max);
+  else
+    ncprint(NCPRINT_NORMAL, _("%llu round trips of %d bytes, %llu lost\n"
+	    "RTT min/avg/p50/p99/p99.9/max = %.1f/%.1f/%.1f/%.1f/%.1f/%.1f us"),
+	    h->count, size, lost, h->min / 1e3, avg / 1e3, p50 / 1e3,
+	    p99 / 1e3, p999 / 1e3, h->max / 1e3);
+}
+
+/* Waits until `fd' has some data to read, for up to `timeout' milliseconds
+   (-1 means forever).  The signals that need some action stop the wait.
+   Returns TRUE if there is data to read. */
+
+static bool ping_wait(int fd, int timeout)
+{
+  struct pollfd pfd;
+  int ret;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  ret = poll(&pfd, 1, timeout);
+  if ((ret < 0) && (errno != EINTR)) {
+    perror("poll");
+    exit(EXIT_FAILURE);
+  }
+  return (ret > 0);
+}
+
+/* Prints the statistics if SIGUSR1 (or the interval timer) asked for them */
+
+static void ping_signals(void)
+{
+  netcat_stats_tick();
+  if (got_sigusr1) {
+    netcat_printstats(TRUE);
+    got_sigusr1 = FALSE;
+  }
+}
+
+/* Sends `opt_ping' messages of `opt_ping_size' bytes to the socket `ncsock'
+   one at a time, each one after the previous one came back.  On datagram
+   sockets the first 8 bytes of the message hold its number (if it's large
+   enough), so that a late answer isn't taken for the current one.
+   Returns 0 when the measure was completed, -1 if it was cut short. */
+
+int netcat_ping_client(nc_sock_t *ncsock)
+{
+  int fd = ncsock->fd, size = opt_ping_size, timeout = -1, count;
+  bool dgram = (ncsock->proto == NETCAT_PROTO_UDP), stop = FALSE;
+  unsigned char *msg, *reply;
+  unsigned long long lost = 0;
+  ping_hist_t *hist;
+  nc_pattern_t pat;
+  struct iovec iov;
+  debug_v(("netcat_ping_client(ncsock=%p)", (void *)ncsock));
+
+  msg = malloc(size);
+  reply = malloc(size);
+  hist = calloc(1, sizeof(*hist));
+  if (!msg || !reply || !hist)
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+  memset(&pat, 0, sizeof(pat));
+  pat.type = NETCAT_PATTERN_SEQ;
+  iov.iov_base = msg;
+  iov.iov_len = size;
+  netcat_pattern_read(&pat, &iov, 1);
+
+  if (opt_wait > 0)
+    timeout = opt_wait * 1000;
+  else if (dgram)
+    timeout = PING_UDP_TIMEOUT;
+
+  /* the last segment of a message larger than the MSS mustn't wait for the
+     previous ones to be acknowledged (Nagle), or the delayed ACK of the
+     other side would be added to the round trip */
+  if (!dgram)
+    netcat_socket_nodelay(fd);
+
+  netcat_stats_start();
+  signal_handler = FALSE;
+
+  for (count = 0; (count < opt_ping) && !stop && !got_sigint && !got_sigterm;
+       count++) {
+    double start, deadline;
+    int ret, got = 0;
+
+    if ((count > 0) && opt_interval)
+      sleep(opt_interval);
+
+    if (dgram && (size >= 8)) {
+      int i;
+
+      for (i = 0; i < 8; i++)
+	msg[i] = (unsigned char) ((unsigned long long) count >> (56 - i * 8));
+    }
+
+    start = netcat_clock();
+    deadline = start + timeout / 1000.0;
+    while (got < size) {
+      ret = write(fd, msg + got, size - got);
+      if (ret < 0) {
+	/* the refusal of an earlier datagram is reported here */
+	if ((errno == EINTR) || (dgram && (errno == ECONNREFUSED)))
+	  continue;
+	perror("write(net)");
+	exit(EXIT_FAILURE);
+      }
+      got += ret;
+      stats_sent.calls++;
+    }
+    stats_sent.bytes += size;
+    if (dgram)
+      stats_sent.packets++;
+
+    /* now wait for all of it to come back */
+    for (got = 0; (got < size) && !got_sigint && !got_sigterm;) {
+      int left = -1;
+
+      if (timeout >= 0) {
+	left = (int) ((deadline - netcat_clock()) * 1000);
+	if (left < 0)
+	  left = 0;
+      }
+      if (!ping_wait(fd, left)) {
+	if (got_sigint || got_sigterm || (left != 0))
+	  continue;
+	if (!dgram) {
+	  ncprint(NCPRINT_ERROR, _("No answer after %d seconds"),
+		  timeout / 1000);
+	  stop = TRUE;
+	}
+	break;
+      }
+
+      ret = read(fd, reply + got, size - got);
+      if (ret < 0) {
+	/* nobody is listening for the datagrams, they are lost */
+	if ((errno == EINTR) || (errno == EAGAIN) ||
+	    (dgram && (errno == ECONNREFUSED)))
+	  continue;
+	perror("read(net)");
+	exit(EXIT_FAILURE);
+      }
+      if (ret == 0) {
+	ncprint(NCPRINT_VERB1, _("Connection closed by the other side"));
+	stop = TRUE;
+	break;
+      }
+      stats_recv.bytes += ret;
+      stats_recv.calls++;
+      if (dgram) {
+	stats_recv.packets++;
+	/* a late answer to a message that was given up already */
+	if ((size >= 8) && memcmp(reply, msg, 8))
+	  continue;
+	ret = size;
+      }
+      got += ret;
+    }
+
+    if (got == size)
+      ping_hist_add(hist, (unsigned long long)
+		    ((netcat_clock() - start) * 1e9 + 0.5));
+    else if (dgram && !stop && !got_sigint && !got_sigterm)
+      lost++;
+    ping_signals();
+  }
+
+  signal_handler = TRUE;
+  ping_report(hist, size, lost);
+  free(msg);
+  free(reply);
+  free(hist);
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+  return ((stop || got_sigint || got_sigterm) ? -1 : 0);
+}
+
+/* Sends back everything received from the socket `ncsock' (the other side
+   of --ping), starting with the data already received by the listen
+   function, until the connection is closed.  With -w it also stops after
+   that many seconds without any data. */
+
+int netcat_ping_echo(nc_sock_t *ncsock)
+{
+  int fd = ncsock->fd, len = 0, timeout = (opt_wait > 0 ? opt_wait * 1000 : -1);
+  bool dgram = (ncsock->proto == NETCAT_PROTO_UDP);
+  unsigned char *buf;
+  debug_v(("netcat_ping_echo(ncsock=%p)", (void *)ncsock));
+
+  buf = malloc(opt_buffer_size);
+  if (!buf)
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+
+  /* a message read in pieces is sent back in pieces too, and the last ones
+     mustn't be held back by Nagle */
+  if (!dgram)
+    netcat_socket_nodelay(fd);
+
+  netcat_stats_start();
+  signal_handler = FALSE;
+
+  /* the first datagram in UDP mode */
+  if (ncsock->recvq.len > 0) {
+    struct iovec iov[2];
+    int i, n = netcat_buffer_data(&ncsock->recvq, iov);
+
+    for (i = 0; (i < n) && (len + (int) iov[i].iov_len <= opt_buffer_size);
+	 i++) {
+      memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+      len += iov[i].iov_len;
+    }
+    netcat_buffer_free(&ncsock->recvq);
+    stats_recv.bytes += len;
+    stats_recv.packets++;
+  }
+
+  while (!got_sigint && !got_sigterm) {
+    int ret, sent;
+
+    for (sent = 0; sent < len; sent += ret) {
+      ret = write(fd, buf + sent, len - sent);
+      if (ret < 0) {
+	if (errno == EINTR) {
+	  ret = 0;
+	  continue;
+	}
+	perror("write(net)");
+	exit(EXIT_FAILURE);
+      }
+      stats_sent.calls++;
+    }
+    stats_sent.bytes += len;
+    if (dgram && (len > 0))
+      stats_sent.packets++;
+    ping_signals();
+
+    if (!ping_wait(fd, timeout)) {
+      if (!got_sigint && !got_sigterm && (timeout >= 0))
+	break;
+      len = 0;
+      continue;
+    }
+    len = read(fd, buf, opt_buffer_size);
+    if (len < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN)) {
+	len = 0;
+	continue;
+      }
+      perror("read(net)");
+      exit(EXIT_FAILURE);
+    }
+    if (len == 0)
+      break;
+    stats_recv.bytes += len;
+    stats_recv.calls++;
+    if (dgram)
+      stats_recv.packets++;
+  }
+
+  signal_handler = TRUE;
+  free(buf);
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+  return 0;
+}
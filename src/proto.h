@@ -22,11 +22,44 @@
  *                                                                         *
  ***************************************************************************/
 
+/* bucket.c */
+void netcat_bucket_init(nc_bucket_t *b, unsigned long rate);
+int netcat_bucket_avail(nc_bucket_t *b);
+void netcat_bucket_take(nc_bucket_t *b, int n);
+void netcat_bucket_wait(nc_bucket_t *b, struct timeval *tv);
+
+/* buffer.c */
+bool netcat_buffer_init(nc_buffer_t *buf, int size);
+void netcat_buffer_free(nc_buffer_t *buf);
+int netcat_buffer_data(nc_buffer_t *buf, struct iovec iov[2]);
+int netcat_buffer_space(nc_buffer_t *buf, struct iovec iov[2]);
+void netcat_buffer_fill(nc_buffer_t *buf, int len);
+void netcat_buffer_drop(nc_buffer_t *buf, int len);
+void netcat_buffer_pin(nc_buffer_t *buf, int len);
+void netcat_buffer_unpin(nc_buffer_t *buf, int len);
+int netcat_buffer_put(nc_buffer_t *buf, const void *data, int len);
+
+/* capture.c */
+void netcat_capture_start(unsigned long size);
+void netcat_capture(char dir, const void *data, size_t len,
+		    const char *fmt, ...);
+
 /* core.c */
-extern unsigned long bytes_sent, bytes_recv;
 int core_connect(nc_sock_t *ncsock);
 int core_listen(nc_sock_t *ncsock);
 int core_readwrite(nc_sock_t *nc_main, nc_sock_t *nc_slave);
+int core_server(nc_sock_t *ncsock);
+int core_tunnel_server(nc_sock_t *nc_listen, nc_sock_t *nc_target);
+
+/* event.c */
+const char *netcat_event_name(nc_evengine_t engine);
+bool netcat_event_init(nc_evloop_t *ev, nc_evengine_t engine);
+void netcat_event_close(nc_evloop_t *ev);
+int netcat_event_add(nc_evloop_t *ev, int fd, int mask, bool edge, void *data);
+int netcat_event_mod(nc_evloop_t *ev, int fd, int mask);
+void netcat_event_del(nc_evloop_t *ev, int fd);
+int netcat_event_wait(nc_evloop_t *ev, nc_event_t *events, int max,
+		      struct timeval *timeout);
 
 /* flagset.c */
 bool netcat_flag_init(unsigned int len);
@@ -38,9 +71,8 @@ unsigned short netcat_flag_rand(void);
 
 /* misc.c */
 int netcat_fhexdump(FILE *stream, char c, const void *data, size_t datalen);
-int netcat_snprintnum(char *str, size_t size, unsigned long number);
+int netcat_snprintnum(char *str, size_t size, unsigned long long number);
 void ncprint(int type, const char *fmt, ...);
-void netcat_printstats(bool force);
 char *netcat_string_split(char **buf);
 void netcat_commandline_read(int *argc, char ***argv);
 void netcat_printhelp(char *argv0);
@@ -48,17 +80,27 @@ void netcat_printversion(void);
 #ifdef DEBUG
 const char *debug_fmt(const char *fmt, ...);
 #endif
-#ifndef USE_LINUX_SELECT
-void update_timeval(struct timeval *target);
-#endif
+void netcat_timeval_sub(struct timeval *t1, const struct timeval *t2);
+double netcat_clock(void);
+bool netcat_strtosize(const char *str, unsigned long *size);
 
 /* netcat.c */
 extern nc_mode_t netcat_mode;
-extern bool opt_eofclose, opt_debug, opt_numeric, opt_random, opt_hexdump,
-	opt_telnet, opt_zero;
-extern int opt_interval, opt_verbose, opt_wait;
-extern char *opt_outputfile;
+extern bool opt_eofclose, opt_debug, opt_keepopen, opt_numeric, opt_random,
+	opt_hexdump, opt_telnet, opt_zero, opt_splice, opt_zerocopy, opt_nodelay,
+	opt_cork, opt_crlf, opt_quickack, opt_stats_json;
+extern int opt_interval, opt_verbose, opt_wait, opt_buffer_size,
+	opt_udp_batch, opt_workers, opt_pps, opt_sndbuf, opt_rcvbuf, opt_mss,
+	opt_tos, opt_priority, opt_fastopen, opt_ping, opt_ping_size,
+	opt_concurrency;
+extern unsigned long opt_rate;
+extern double opt_stats_interval;
+extern nc_pattern_t opt_generate;
+extern bool opt_sink;
+extern nc_pattern_type_t opt_sink_pattern;
+extern char *opt_outputfile, *opt_congestion;
 extern nc_proto_t opt_proto;
+extern nc_evengine_t opt_engine;
 extern FILE *output_fp;
 extern bool use_stdin, signal_handler, got_sigterm, got_sigint, got_sigusr1,
 	commandline_need_newline;
@@ -70,16 +112,44 @@ bool netcat_getport(nc_port_t *dst, const char *port_string,
 const char *netcat_strid(const nc_host_t *host, const nc_port_t *port);
 int netcat_inet_pton(const char *src, void *dst);
 const char *netcat_inet_ntop(const void *src);
+const char *netcat_socket_tune(int sock, int type);
+const char *netcat_socket_fastopen(int sock, bool listen);
+void netcat_socket_fastopen_start(int sock);
+void netcat_socket_quickack(int sock);
+void netcat_socket_nodelay(int sock);
+void netcat_socket_report(int sock);
 int netcat_socket_new(int domain, int type);
+void netcat_socket_linger_off(int sock);
 int netcat_socket_new_connect(int domain, int type, const struct in_addr *addr,
 		in_port_t port, const struct in_addr *local_addr,
 		in_port_t local_port);
 int netcat_socket_new_listen(int domain, const struct in_addr *addr,
-			     in_port_t port);
+			     in_port_t port, bool shared);
 int netcat_socket_accept(int fd, int timeout);
 
+/* pattern.c */
+nc_pattern_type_t netcat_pattern_type(const char *name);
+bool netcat_pattern_parse(nc_pattern_t *p, const char *str);
+int netcat_pattern_read(nc_pattern_t *p, struct iovec *iov, int iovcnt);
+size_t netcat_pattern_verify(nc_pattern_t *p, const void *data, size_t len,
+			     unsigned long long *bad);
+
+/* ping.c */
+int netcat_ping_client(nc_sock_t *ncsock);
+int netcat_ping_echo(nc_sock_t *ncsock);
+
+/* scan.c */
+int netcat_scan(nc_sock_t *ncsock, int total_ports);
+
+/* stats.c */
+extern nc_stats_t stats_recv, stats_sent;
+extern unsigned long long stats_waits;
+void netcat_stats_start(void);
+void netcat_stats_tick(void);
+void netcat_printstats(bool force);
+
 /* telnet.c */
-void netcat_telnet_parse(nc_sock_t *ncsock);
+void netcat_telnet_parse(nc_sock_t *ncsock, unsigned char *buf, int *size);
 
 /* udphelper.c */
 #ifdef USE_PKTINFO
@@ -89,3 +159,6 @@ int udphelper_ancillary_read(struct msghdr *my_hdr,
 int udphelper_sockets_open(int **sockbuf, in_port_t nport);
 #endif
 void udphelper_sockets_close(int *sockbuf);
+
+/* uring.c */
+int netcat_uring_readwrite(nc_sock_t *nc_main, nc_sock_t *nc_slave);
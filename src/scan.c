@@ -0,0 +1,292 @@
+/*
+ * scan.c -- parallel TCP port scanner
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+#include <sys/resource.h>	/* getrlimit() */
+
+/* With -z and --concurrency the connect mode doesn't try one port at a
+   time: up to opt_concurrency non-blocking connects are in flight at once,
+   all of them watched by a single event loop, and each result is reported
+   as soon as it's known.  Every connect gets the same -w timeout, so they
+   expire in the order they were started: the ones in flight are kept in a
+   list in that order, and the first one is always the next to expire. */
+
+/* Descriptors left for everything else when the limit of open files caps
+   the number of connects in flight */
+#define SCAN_FD_SPARE 16
+
+typedef struct scan_conn {
+  int fd;
+  unsigned short port;
+  double deadline;
+  struct scan_conn *prev, *next;
+} scan_conn_t;
+
+typedef struct {
+  nc_sock_t *ncsock;
+  nc_evloop_t ev;
+  scan_conn_t *conns, *unused;
+  scan_conn_t *first, *last;	/* in flight, oldest first */
+  int inflight, open, report_flags;
+} scan_t;
+
+/* Returns the number of connects that can be in flight at once, which is
+   opt_concurrency unless the limit of open files is lower (the soft limit
+   is raised up to the hard one first) */
+
+static int scan_limit(nc_evengine_t engine, int total_ports)
+{
+  int limit = (opt_concurrency < total_ports ? opt_concurrency : total_ports);
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    if ((rl.rlim_cur != RLIM_INFINITY) && (rl.rlim_cur < rl.rlim_max) &&
+	(rl.rlim_cur < (rlim_t) limit + SCAN_FD_SPARE)) {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+      getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if ((rl.rlim_cur != RLIM_INFINITY) &&
+	(rl.rlim_cur < (rlim_t) limit + SCAN_FD_SPARE))
+      limit = (rl.rlim_cur > 2 * SCAN_FD_SPARE ?
+	       (int) rl.rlim_cur - SCAN_FD_SPARE : SCAN_FD_SPARE);
+  }
+  if ((engine == NETCAT_EVENT_SELECT) && (limit > FD_SETSIZE - SCAN_FD_SPARE))
+    limit = FD_SETSIZE - SCAN_FD_SPARE;
+
+  if ((limit < opt_concurrency) && (limit < total_ports))
+    ncprint(NCPRINT_VERB2, _("Scanning %d ports at once at most"), limit);
+  return limit;
+}
+
+/* Returns TRUE if the socket `fd' got connected to itself.  A connect to a
+   closed local port in the range of the ephemeral ports may pick that same
+   port as its source, and then it "succeeds" (TCP simultaneous open), which
+   is more likely with thousands of connects taking up the range. */
+
+static bool scan_self(int fd)
+{
+  struct sockaddr_in local, peer;
+  socklen_t len = sizeof(local);
+
+  if (getsockname(fd, (struct sockaddr *)&local, &len) < 0)
+    return FALSE;
+  len = sizeof(peer);
+  if (getpeername(fd, (struct sockaddr *)&peer, &len) < 0)
+    return FALSE;
+  return ((local.sin_port == peer.sin_port) &&
+	  (local.sin_addr.s_addr == peer.sin_addr.s_addr));
+}
+
+/* Reports the result of the connect to the port `port', which is open if
+   `err' is 0, or failed with the error `err' */
+
+static void scan_report(scan_t *sc, unsigned short port, int err)
+{
+  netcat_getport(&sc->ncsock->port, NULL, port);
+  if (err == 0) {
+    ncprint(NCPRINT_VERB1, _("%s open"), netcat_strid(&sc->ncsock->host,
+						      &sc->ncsock->port));
+    sc->open++;
+  }
+  else
+    ncprint(sc->report_flags, "%s: %s",
+	    netcat_strid(&sc->ncsock->host, &sc->ncsock->port), strerror(err));
+}
+
+/* Closes the connect `c', reporting its result `err' */
+
+static void scan_done(scan_t *sc, scan_conn_t *c, int err)
+{
+  scan_report(sc, c->port, err);
+
+  netcat_event_del(&sc->ev, c->fd);
+  close(c->fd);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    sc->first = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  else
+    sc->last = c->prev;
+  c->next = sc->unused;
+  sc->unused = c;
+  sc->inflight--;
+}
+
+/* Starts the connect to the port `port'.  Returns FALSE if it couldn't be
+   started for a lack of resources, so that it can be tried again after some
+   of the connects in flight are over. */
+
+static bool scan_start(scan_t *sc, unsigned short port)
+{
+  nc_sock_t *ncsock = sc->ncsock;
+  scan_conn_t *c = sc->unused;
+  int sock;
+
+  assert(c);
+  sock = netcat_socket_new_connect(PF_INET, SOCK_STREAM,
+	&ncsock->host.iaddrs[0], htons(port),
+	(ncsock->local_host.iaddrs[0].s_addr ? &ncsock->local_host.iaddrs[0] :
+	NULL), ncsock->local_port.netnum);
+
+  if ((sock == -5) || (sock == -3)) {
+    /* the connect (or the bind) failed right away, this is the result */
+    scan_report(sc, port, errno);
+    return TRUE;
+  }
+  if ((sock < 0) && (sc->inflight > 0) &&
+      ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) ||
+       (errno == ENOMEM)))
+    return FALSE;
+  if (sock < 0)
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT, "Couldn't create connection (err=%d): %s",
+	    sock, strerror(errno));
+
+  if (netcat_event_add(&sc->ev, sock, NC_EV_WRITE, FALSE, c) != 0) {
+    close(sock);
+    if (sc->inflight > 0)
+      return FALSE;
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Critical system request failed: %s"),
+	    strerror(errno));
+  }
+
+  sc->unused = c->next;
+  c->fd = sock;
+  c->port = port;
+  c->deadline = (ncsock->timeout > 0 ? netcat_clock() + ncsock->timeout : 0);
+  c->prev = sc->last;
+  c->next = NULL;
+  if (sc->last)
+    sc->last->next = c;
+  else
+    sc->first = c;
+  sc->last = c;
+  sc->inflight++;
+  return TRUE;
+}
+
+/* Scans the `total_ports' ports of the flagset on the host of the socket
+   object `ncsock', which also holds the local address, the local port and
+   the timeout.  With a local port only one connect at a time can use it, so
+   the ports are scanned one by one.
+   Returns the number of open ports found. */
+
+int netcat_scan(nc_sock_t *ncsock, int total_ports)
+{
+  scan_t sc;
+  int i, limit, left = total_ports;
+  unsigned short port = 0, retry = 0;
+  debug_v(("netcat_scan(ncsock=%p, total_ports=%d)", (void *)ncsock,
+	  total_ports));
+
+  memset(&sc, 0, sizeof(sc));
+  sc.ncsock = ncsock;
+  sc.report_flags = (total_ports > 1 ? NCPRINT_VERB2 : NCPRINT_VERB1);
+  if (!netcat_event_init(&sc.ev, opt_engine))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT, _("Critical system request failed: %s"),
+	    strerror(errno));
+
+  limit = (ncsock->local_port.num ? 1 : scan_limit(sc.ev.engine, total_ports));
+  sc.conns = calloc(limit, sizeof(*sc.conns));
+  if (!sc.conns)
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+  for (i = 0; i < limit; i++)
+    sc.conns[i].next = (i + 1 < limit ? &sc.conns[i + 1] : NULL);
+  sc.unused = sc.conns;
+
+  while ((left > 0) || retry || (sc.inflight > 0)) {
+    nc_event_t events[64];
+    struct timeval tv, *timeout = NULL;
+    double now;
+    int ret;
+
+    /* start as many connects as allowed.  A port that couldn't be started
+       is tried again first, and meanwhile no more than the current ones are
+       allowed at once. */
+    while ((sc.inflight < limit) && (retry || (left > 0))) {
+      if (!retry) {
+	port = (opt_random ? netcat_flag_rand() : netcat_flag_next(port));
+	left--;
+      }
+      if (!scan_start(&sc, (retry ? retry : port))) {
+	if (!retry)
+	  retry = port;
+	limit = sc.inflight;
+	ncprint(NCPRINT_VERB2, _("Out of resources, scanning %d ports at "
+		"once at most"), limit);
+	break;
+      }
+      retry = 0;
+    }
+    if (sc.inflight == 0)
+      continue;
+
+    /* wait until the next connect is over or expires */
+    if (sc.first->deadline > 0) {
+      double wait = sc.first->deadline - netcat_clock();
+
+      if (wait < 0)
+	wait = 0;
+      tv.tv_sec = (long) wait;
+      tv.tv_usec = (long) ((wait - tv.tv_sec) * 1e6);
+      timeout = &tv;
+    }
+    ret = netcat_event_wait(&sc.ev, events, 64, timeout);
+    if ((ret < 0) && (errno != EINTR)) {
+      perror("select(netcat_scan)");
+      exit(EXIT_FAILURE);
+    }
+
+    /* a connect is over when its socket becomes writable, SO_ERROR says
+       how it went */
+    for (i = 0; i < ret; i++) {
+      scan_conn_t *c = events[i].data;
+      int err = 0;
+      socklen_t len = sizeof(err);
+
+      if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	err = errno;
+      else if ((err == 0) && scan_self(c->fd))
+	err = ECONNREFUSED;
+      scan_done(&sc, c, err);
+    }
+
+    /* the oldest connects may have expired */
+    now = netcat_clock();
+    while (sc.first && (sc.first->deadline > 0) &&
+	   (sc.first->deadline <= now))
+      scan_done(&sc, sc.first, ETIMEDOUT);
+  }
+
+  netcat_event_close(&sc.ev);
+  free(sc.conns);
+  return sc.open;
+}
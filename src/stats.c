@@ -0,0 +1,242 @@
+/*
+ * stats.c -- statistics of the data flow
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+
+/* The counters are updated by the data loops as the data moves, while the
+   rates are measured on samples of the byte counters.  The loops call
+   netcat_stats_tick() once for each round, which keeps the latest sample up
+   to date and stores one in a ring every STATS_SAMPLE_MS milliseconds.  The
+   ring covers the longest window, so an idle loop costs nothing.  When the
+   loop wakes up after a pause, the latest sample (the last activity) is
+   stored too, or a burst followed by silence would be spread over the whole
+   pause. */
+
+#define STATS_SAMPLE_MS 250
+#define STATS_WINDOW 1			/* seconds, for the current rate */
+#define STATS_WINDOW_LONG 10		/* seconds, for the average rate */
+#define STATS_SAMPLES (STATS_WINDOW_LONG * 1000 / STATS_SAMPLE_MS + 2)
+
+/* A sample of the byte counters, index 0 for the received data and 1 for
+   the sent data */
+
+typedef struct {
+  double time;
+  unsigned long long bytes[2];
+} stats_sample_t;
+
+nc_stats_t stats_recv, stats_sent;	/* totals of each direction */
+unsigned long long stats_waits = 0;	/* waits for events (or io_uring) */
+
+static stats_sample_t samples[STATS_SAMPLES], stats_live;
+static int sample_last = 0, sample_count = 0;
+static double stats_start = 0, stats_peak[2] = { 0, 0 };
+
+/* Returns the rate in bytes per second of the direction `dir' at the time
+   `now', when its counter was `bytes', measured over the last `window'
+   seconds (or since the start, if the session is younger than that).  The
+   samples taken after `now' are ignored. */
+
+static double stats_rate(int dir, double window, double now,
+			 unsigned long long bytes)
+{
+  stats_sample_t *s = NULL;
+  int i;
+
+  /* find the newest sample which is old enough, starting from the latest
+     one if it wasn't stored yet */
+  if ((sample_count > 0) && (stats_live.time > samples[sample_last].time) &&
+      (now - stats_live.time >= window))
+    s = &stats_live;
+  for (i = 0; !s && (i < sample_count); i++) {
+    s = &samples[(sample_last - i + STATS_SAMPLES) % STATS_SAMPLES];
+    if ((now - s->time < window) && (i < sample_count - 1))
+      s = NULL;
+  }
+  if (!s || (now <= s->time))
+    return 0;
+  return (bytes - s->bytes[dir]) / (now - s->time);
+}
+
+/* Stores the sample `s' in the ring, updating the peak rates with the
+   current rates at the time of the sample */
+
+static void stats_store(const stats_sample_t *s)
+{
+  int i;
+
+  for (i = 0; (i < 2) && (sample_count > 0); i++) {
+    double rate = stats_rate(i, STATS_WINDOW, s->time, s->bytes[i]);
+
+    if (rate > stats_peak[i])
+      stats_peak[i] = rate;
+  }
+  sample_last = (sample_last + 1) % STATS_SAMPLES;
+  samples[sample_last] = *s;
+  if (sample_count < STATS_SAMPLES)
+    sample_count++;
+}
+
+/* Starts the session: the elapsed time and the rates are measured from
+   now on.  If the statistics were requested at regular intervals, the
+   interval timer is started too, and SIGALRM will ask the data loops to
+   print them like SIGUSR1 does.  Only the first call has any effect. */
+
+void netcat_stats_start(void)
+{
+  if (stats_start > 0)
+    return;
+
+  stats_start = netcat_clock();
+  stats_live.time = stats_start;
+  stats_live.bytes[0] = stats_recv.bytes;
+  stats_live.bytes[1] = stats_sent.bytes;
+  stats_store(&stats_live);
+
+  if (opt_stats_interval > 0) {
+    struct itimerval it;
+
+    it.it_interval.tv_sec = (long) opt_stats_interval;
+    it.it_interval.tv_usec = (long) ((opt_stats_interval -
+				      it.it_interval.tv_sec) * 1e6);
+    if (!it.it_interval.tv_sec && !it.it_interval.tv_usec)
+      it.it_interval.tv_usec = 1;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_REAL, &it, NULL) < 0)
+      ncprint(NCPRINT_WARNING, _("Couldn't start the statistics timer: %s"),
+	      strerror(errno));
+  }
+}
+
+/* Updates the latest sample of the byte counters, and stores it if the
+   newest one in the ring is old enough.  This is meant to be called once
+   for each round of the data loops. */
+
+void netcat_stats_tick(void)
+{
+  double now, step = STATS_SAMPLE_MS / 1000.0;
+
+  if (stats_start == 0)
+    return;
+  now = netcat_clock();
+
+  /* the loop was idle, keep the last activity before the pause */
+  if ((now - stats_live.time >= step) &&
+      (stats_live.time > samples[sample_last].time))
+    stats_store(&stats_live);
+
+  stats_live.time = now;
+  stats_live.bytes[0] = stats_recv.bytes;
+  stats_live.bytes[1] = stats_sent.bytes;
+  if (now - samples[sample_last].time >= step)
+    stats_store(&stats_live);
+}
+
+/* Formats the total `bytes' in `str' as netcat_snprintnum() does, followed
+   by the exact number if it was rounded. */
+
+static void stats_total(char *str, size_t size, unsigned long long bytes)
+{
+  int len = netcat_snprintnum(str, size, bytes);
+
+  if ((bytes > 0) && (len > 0) && !isdigit((int)str[len - 1]))
+    snprintf(str + len, size - len, " (%llu)", bytes);
+}
+
+/* Formats in `str' the human readable line about the direction `st', whose
+   rates are `rate' (current), `rate_long' (average of the long window) and
+   `peak'. */
+
+static void stats_line(char *str, size_t size, const char *label,
+		       nc_stats_t *st, double rate, double rate_long,
+		       double peak)
+{
+  char now[32], avg[32], top[32];
+
+  netcat_snprintnum(now, sizeof(now), (unsigned long long) rate);
+  netcat_snprintnum(avg, sizeof(avg), (unsigned long long) rate_long);
+  netcat_snprintnum(top, sizeof(top), (unsigned long long) peak);
+  snprintf(str, size, _("%s rate: %sB/s (%ds: %sB/s, peak: %sB/s), %llu "
+	   "calls, %llu datagrams, queue peak %d"), label, now,
+	   STATS_WINDOW_LONG, avg, top, st->calls, st->packets,
+	   st->queue_peak);
+}
+
+/* prints statistics to stderr with the right verbosity level.  If `force' is
+   TRUE, then the verbosity level is overridden and the statistics are printed
+   anyway.  They are printed as human readable text, or as a single line of
+   JSON with --stats-format=json. */
+
+void netcat_printstats(bool force)
+{
+  int flags = (force ? 0 : NCPRINT_VERB2);
+  double now = netcat_clock(), elapsed = 0, rate[2], rate_long[2];
+  int i;
+
+  if (stats_start > 0)
+    elapsed = now - stats_start;
+  rate[0] = stats_rate(0, STATS_WINDOW, now, stats_recv.bytes);
+  rate[1] = stats_rate(1, STATS_WINDOW, now, stats_sent.bytes);
+  rate_long[0] = stats_rate(0, STATS_WINDOW_LONG, now, stats_recv.bytes);
+  rate_long[1] = stats_rate(1, STATS_WINDOW_LONG, now, stats_sent.bytes);
+
+  /* a session shorter than a sample has no peak stored yet */
+  for (i = 0; i < 2; i++)
+    if (rate[i] > stats_peak[i])
+      stats_peak[i] = rate[i];
+
+  if (opt_stats_json) {
+    char dir[2][192];
+
+    for (i = 0; i < 2; i++) {
+      nc_stats_t *st = (i == 0 ? &stats_recv : &stats_sent);
+
+      snprintf(dir[i], sizeof(dir[i]), "{\"bytes\":%llu,\"packets\":%llu,"
+	       "\"calls\":%llu,\"queue_peak\":%d,\"rate\":%.0f,"
+	       "\"rate_%ds\":%.0f,\"rate_peak\":%.0f}", st->bytes, st->packets,
+	       st->calls, st->queue_peak, rate[i], STATS_WINDOW_LONG,
+	       rate_long[i], stats_peak[i]);
+    }
+    ncprint(NCPRINT_NORMAL | flags, "{\"elapsed\":%.6f,\"waits\":%llu,"
+	    "\"received\":%s,\"sent\":%s}", elapsed, stats_waits, dir[0],
+	    dir[1]);
+  }
+  else {
+    char str_recv[64], str_sent[64], line_recv[192], line_sent[192];
+
+    stats_total(str_recv, sizeof(str_recv), stats_recv.bytes);
+    stats_total(str_sent, sizeof(str_sent), stats_sent.bytes);
+    stats_line(line_recv, sizeof(line_recv), _("Receiving"), &stats_recv,
+	       rate[0], rate_long[0], stats_peak[0]);
+    stats_line(line_sent, sizeof(line_sent), _("Sending"), &stats_sent,
+	       rate[1], rate_long[1], stats_peak[1]);
+    ncprint(NCPRINT_NORMAL | flags, _("Total received bytes: %s\nTotal "
+	    "sent bytes: %s\n%s\n%s\nElapsed time: %.3f s, %llu waits"),
+	    str_recv, str_sent, line_recv, line_sent, elapsed, stats_waits);
+  }
+}
@@ -58,146 +58,116 @@
 				 * to perform, the indicated option. */
 #define TELNET_IAC	255	/* Data Byte 255. */
 
-/* Handle the RFC0854 telnet codes found in the receiving buffer of the
-   specified socket object.  This is a reliable implementation of the rfc,
-   which understands most of the described codes, and automatically replies to
-   the remote end with the appropriate answer codes.
-   The receiving queue is then rewritten with the telnet codes stripped off,
-   and the size is updated to the new length which is less than or equal to
-   the original one (and can also be 0).
-   The case where a telnet code is broken down (i.e. if the buffering block
-   cuts it into two different calls to netcat_telnet_parse() is also handled
-   properly with an internal buffer.
-   If you'll ever need to reset the internal buffer for a fresh call of the
-   telnet parsing function just call it with a NULL argument. */
+/* Queues the refusal of the option `opt' requested with `code' (WILL or
+   DO) in the telnet state `t'.  An option that was refused already is not
+   answered again, so that a peer that keeps asking can't make us flood the
+   link. */
 
-void netcat_telnet_parse(nc_sock_t *ncsock)
+static void telnet_refuse(nc_telnet_t *t, int code, int opt)
 {
-  static unsigned char getrq[4];
-  static int l = 0;
-  unsigned char putrq[4], *buf = ncsock->recvq.pos;
-  int i, *size = &ncsock->recvq.len, eat_chars = 0, ref_size = *size;
-  debug_v(("netcat_telnet_parse(ncsock=%p)", (void *)ncsock));
-
-  /* if the socket object is NULL, assume a reset command */
-  if (ncsock == NULL) {
-    l = 0;
+  unsigned char *refused = t->refused[code == TELNET_DO];
+
+  if (refused[opt / 8] & (1 << (opt % 8))) {
+    debug(("(telnet) option %d was refused already\n", opt));
     return;
   }
+  refused[opt / 8] |= 1 << (opt % 8);
 
-  /* loop all chars of the string */
-  for (i = 0; i < ref_size; i++) {
-    /* if we found IAC char OR we are fetching a IAC code string process it */
-    if ((buf[i] != TELNET_IAC) && (l == 0))
-      continue;
+  assert(t->reply_len + 3 <= NETCAT_TELNET_REPLY);
+  t->reply[t->reply_len++] = TELNET_IAC;
+  t->reply[t->reply_len++] = (code == TELNET_WILL ? TELNET_DONT : TELNET_WONT);
+  t->reply[t->reply_len++] = opt;
+}
 
-#ifndef USE_OLD_TELNET
-    /* this is surely a char that will be eaten */
-    eat_chars++;
-#endif
+/* Handle the RFC0854 telnet codes found in the `*size' bytes pointed to by
+   `buf', which were just received from the specified socket object.  This is
+   a reliable implementation of the rfc, which understands most of the
+   described codes, and automatically replies to the remote end with the
+   appropriate answer codes.  The replies are collected in the socket object,
+   and the core loop sends all of them at once, ahead of the queued data.
+   The data block is then rewritten with the telnet codes stripped off, and
+   the size is updated to the new length which is less than or equal to the
+   original one (and can also be 0).
+   The case where a telnet code is broken down (i.e. if the buffering block
+   cuts it into two different calls to netcat_telnet_parse() is also handled
+   properly: the first part is kept in the socket object until the rest
+   comes in.  A socket object cleared with zeros starts with no pending code.
+
+   The data is scanned only once.  The plain data between the codes is found
+   with memchr(), which looks at a whole word (or vector) of bytes at a time,
+   and it's moved back over the stripped codes as it goes, so the cost doesn't
+   grow with the number of codes in the block. */
+
+void netcat_telnet_parse(nc_sock_t *ncsock, unsigned char *buf, int *size)
+{
+  nc_telnet_t *t = &ncsock->telnet;
+  unsigned char *in = buf, *out = buf, *end = buf + *size;
+  debug_v(("netcat_telnet_parse(ncsock=%p, buf=%p, size=%d)", (void *)ncsock,
+	  (void *)buf, *size));
+
+  while (in < end) {
+    /* copy the plain data up to the next IAC char */
+    if (t->len == 0) {
+      unsigned char *iac = memchr(in, TELNET_IAC, end - in);
+      size_t n = (iac ? iac : end) - in;
+
+      if (out != in)
+	memmove(out, in, n);
+      in += n;
+      out += n;
+      if (!iac)
+	break;
+    }
 
-    /* copy the char in the IAC-code-building buffer */
-    getrq[l++] = buf[i];
+    /* copy the char in the IAC-code-building buffer.  With the old telnet
+       codes parsing policy the codes are left in the data. */
+#ifdef USE_OLD_TELNET
+    *out++ = *in;
+#endif
+    t->code[t->len++] = *in++;
 
     /* if this is the first char (IAC!) go straight to the next one */
-    if (l == 1)
+    if (t->len == 1)
       continue;
 
-    /* identify the IAC code. The effect is resolved here. If the char needs
-       further data the subsection just needs to leave the index 'l' set. */
-    switch (getrq[1]) {
-    case TELNET_SE:
-    case TELNET_NOP:
-      goto do_eat_chars;
-    case TELNET_DM:
-    case TELNET_BRK:
-    case TELNET_IP:
-    case TELNET_AO:
-    case TELNET_AYT:
-    case TELNET_EC:
-    case TELNET_EL:
-    case TELNET_GA:
-    case TELNET_SB:
-      goto do_eat_chars;
+    /* identify the IAC code.  If the code needs further data just leave the
+       length set. */
+    switch (t->code[1]) {
     case TELNET_WILL:
-    case TELNET_WONT:
-      if (l < 3) /* need more data */
-        continue;
-
-      /* refuse this option */
-      putrq[0] = 0xFF;
-      putrq[1] = TELNET_DONT;
-      putrq[2] = getrq[2];
-      /* FIXME: the rfc seems not clean about what to do if the sending queue
-         is not empty.  Since it's the simplest solution, just override the
-         queue for now, but this must change in future. */
-      write(ncsock->fd, putrq, 3);		/* FIXME: handle failures */
-      goto do_eat_chars;
     case TELNET_DO:
+      if (t->len < 3) /* need more data */
+	continue;
+
+      telnet_refuse(t, t->code[1], t->code[2]);
+      break;
+    case TELNET_WONT:
     case TELNET_DONT:
-      if (l < 3) /* need more data */
-        continue;
-
-      /* refuse this option */
-      putrq[0] = 0xFF;
-      putrq[1] = TELNET_WONT;
-      putrq[2] = getrq[2];
-      write(ncsock->fd, putrq, 3);
-      goto do_eat_chars;
+      if (t->len < 3) /* need more data */
+	continue;
+
+      /* every option is already disabled on both sides, and the rfc forbids
+         to acknowledge a request to enter the current state: answering
+         would make two peers like us bounce the code forever */
+      break;
     case TELNET_IAC:
 #ifndef USE_OLD_TELNET
-      /* insert a byte 255 in the buffer.  Note that we don't know in which
-         position we are, but there must be at least 1 eaten char where we
-         can park our data byte.  This effect is senseless if using the old
+      /* an escaped data byte 255.  This effect is senseless if using the old
          telnet codes parsing policy. */
-      buf[i - --eat_chars] = 0xFF;
+      *out++ = TELNET_IAC;
 #endif
-      goto do_eat_chars;
+      break;
     default:
-      /* FIXME: how to handle the unknown code? */
+      /* SE, NOP, DM, BRK, IP, AO, AYT, EC, EL, GA and SB take no argument and
+         have no effect here.  The unknown codes are dropped as well. */
       break;
     }
-    continue;
-
- do_eat_chars:
-    /* ... */
-    l = 0;
-
-#ifndef USE_OLD_TELNET
-    if (eat_chars > 0) {
-      unsigned char *from, *to;
-
-      debug(("(telnet) ate %d chars\n", eat_chars));
-
-      /* move the index to the overlapper character */
-      i++;
-
-      /* if this is the end of the string, memmove() does not care of a null
-         size, it simply does nothing. */
-      from = &buf[i];
-      to = &buf[i - eat_chars];
-      memmove(to, from, ref_size - i);
-
-      /* fix the index.  since the loop will auto-increment the index we need
-         to put it one char before.  this means that it can become negative
-         but it isn't a big problem since it is signed. */
-      i -= eat_chars + 1;
-      ref_size -= eat_chars;
-      eat_chars = 0;
-    }
-#endif
+    t->len = 0;
   }
 
-  /* we are at the end of the buffer. all we have to do now is updating the
-     authoritative buffer size.  In case that there is a broken-down telnet
-     code, the do_eat_chars section is not executed, thus there may be some
-     pending chars that needs to be removed.  This is handled here in an easy
-     way: since they are at the end of the buffer, just cut them playing with
-     the buffer length. */
-
-#ifdef USE_OLD_TELNET
-  assert(eat_chars == 0);
-#endif
-
-  *size = ref_size - eat_chars;
+  /* the chars of a broken-down telnet code at the end of the buffer are
+     already stored in the socket object, so they are simply left out */
+  if (out < end) {
+    debug(("(telnet) ate %d chars\n", (int) (end - out)));
+  }
+  *size = out - buf;
 }
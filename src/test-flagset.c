@@ -0,0 +1,238 @@
+/*
+ * test-flagset.c -- unit tests and microbenchmark of the flagset
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+
+/* Run by "make check" without arguments, it checks the flagset functions
+   against a plain array of booleans, reports every check that fails and
+   then exits with a non-zero status.  With the -b argument ("make bench")
+   it times the same functions on the whole port range instead.  The
+   flagset is a single static array sized for all the ports, as in netcat
+   itself, so every test leaves it empty for the next one. */
+
+#define PORTS 65536
+
+static bool ref[PORTS];
+static int failures = 0;
+
+#define CHECK(cond, what, port) \
+  do { if (!(cond)) { \
+    fprintf(stderr, "test-flagset: %s failed at port %u\n", what, \
+	    (unsigned int) (port)); failures++; } } while (0)
+
+/* Sets the flag `port' both in the flagset and in the reference array */
+
+static void flag(unsigned short port, bool value)
+{
+  netcat_flag_set(port, value);
+  ref[port] = value;
+}
+
+/* Compares the whole flagset with the reference array */
+
+static void compare(const char *name)
+{
+  unsigned int port, expect, count = 0;
+
+  /* port 0 is reserved and never set */
+  for (port = 1; port < PORTS; port++) {
+    CHECK(netcat_flag_get(port) == ref[port], name, port);
+    if (ref[port])
+      count++;
+  }
+  CHECK(netcat_flag_count() == (int) count, name, count);
+
+  /* walking with netcat_flag_next() finds every flag set in order, and
+     then ends with 0 */
+  for (port = 0; ; port = expect) {
+    for (expect = port + 1; (expect < PORTS) && !ref[expect]; expect++);
+    if (expect == PORTS)
+      expect = 0;
+    CHECK(netcat_flag_next(port) == expect, name, port);
+    if (expect == 0)
+      break;
+  }
+}
+
+/* Empties the flagset with netcat_flag_rand(), which must return every flag
+   set exactly once and then 0 */
+
+static void drain(const char *name)
+{
+  unsigned short port;
+  int left = netcat_flag_count();
+
+  while ((port = netcat_flag_rand()) != 0) {
+    CHECK(ref[port], name, port);
+    CHECK(!netcat_flag_get(port), name, port);
+    ref[port] = FALSE;
+    CHECK(netcat_flag_count() == --left, name, port);
+  }
+  CHECK(left == 0, name, left);
+  compare(name);
+}
+
+static void test_boundaries(void)
+{
+  static const unsigned short ports[] = {
+    1, 62, 63, 64, 65, 127, 128, 129, 1023, 1024, 65471, 65472, 65473,
+    65534, 65535
+  };
+  unsigned int i;
+
+  compare("empty");
+  CHECK(netcat_flag_rand() == 0, "rand(empty)", 0);
+
+  /* a single flag at a time, at and around the word boundaries */
+  for (i = 0; i < sizeof(ports) / sizeof(ports[0]); i++) {
+    flag(ports[i], TRUE);
+    compare("single");
+    CHECK(netcat_flag_next(ports[i] - 1) == ports[i], "next(single)",
+	  ports[i]);
+    CHECK(netcat_flag_next(ports[i]) == 0, "next(single)", ports[i]);
+    flag(ports[i], FALSE);
+  }
+  compare("single");
+
+  /* all of them together, setting and clearing twice must not change
+     the count */
+  for (i = 0; i < sizeof(ports) / sizeof(ports[0]); i++) {
+    flag(ports[i], TRUE);
+    flag(ports[i], TRUE);
+  }
+  flag(64, FALSE);
+  flag(64, FALSE);
+  compare("boundaries");
+  drain("rand(boundaries)");
+}
+
+static void test_full(void)
+{
+  unsigned int port;
+
+  for (port = 1; port < PORTS; port++)
+    flag(port, TRUE);
+  compare("full");
+  CHECK(netcat_flag_next(65534) == 65535, "next(full)", 65534);
+  CHECK(netcat_flag_next(65535) == 0, "next(full)", 65535);
+  drain("rand(full)");
+}
+
+static void test_random(void)
+{
+  int round, i;
+
+  for (round = 0; round < 20; round++) {
+    int n = 1 << (round % 16);
+
+    for (i = 0; i < n; i++)
+      flag(1 + RAND() % (PORTS - 1), TRUE);
+    compare("random");
+    drain("rand(random)");
+  }
+}
+
+/* Returns the current time in seconds */
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Times the flagset on the whole port range, as the scans use it */
+
+static void bench(void)
+{
+  double start, elapsed;
+  unsigned int port, n, sum = 0;
+  int round;
+
+  /* netcat_flag_next() over a few ports spread over the range, as in
+     "netcat -z host 1 1000 30000 65535" */
+  for (port = 1; port < PORTS; port += 13107)
+    netcat_flag_set(port, TRUE);
+  start = now();
+  for (round = 0; round < 100000; round++)
+    for (port = netcat_flag_next(0); port; port = netcat_flag_next(port))
+      sum += port;
+  elapsed = now() - start;
+  printf("next, 6 sparse ports:    %8.1f ns/walk\n", elapsed * 1e9 / 100000);
+
+  /* netcat_flag_next() over the whole range */
+  for (port = 1; port < PORTS; port++)
+    netcat_flag_set(port, TRUE);
+  start = now();
+  for (round = 0; round < 100; round++)
+    for (port = netcat_flag_next(0); port; port = netcat_flag_next(port))
+      sum += port;
+  elapsed = now() - start;
+  printf("next, 65535 ports:       %8.1f ns/port\n",
+	 elapsed * 1e9 / (100.0 * (PORTS - 1)));
+
+  start = now();
+  for (round = 0; round < 1000000; round++)
+    sum += netcat_flag_count();
+  elapsed = now() - start;
+  printf("count:                   %8.1f ns/call\n", elapsed * 1e9 / 1000000);
+
+  /* the random order of -r, through all the ports */
+  start = now();
+  for (n = 0; netcat_flag_rand(); n++);
+  elapsed = now() - start;
+  printf("rand, 65535 ports:       %8.1f ns/port\n", elapsed * 1e9 / n);
+
+  /* keeps the compiler from dropping the loops */
+  if (sum == 1)
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  SRAND(1);
+  if (!netcat_flag_init(65535)) {
+    fprintf(stderr, "test-flagset: out of memory\n");
+    return 1;
+  }
+
+  if ((argc > 1) && !strcmp(argv[1], "-b")) {
+    bench();
+    return 0;
+  }
+
+  test_boundaries();
+  test_full();
+  test_random();
+  if (failures > 0) {
+    fprintf(stderr, "test-flagset: %d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
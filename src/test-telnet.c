@@ -0,0 +1,283 @@
+/*
+ * test-telnet.c -- unit tests and microbenchmark of the telnet codes parser
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+#include <stdarg.h>
+
+/* Run by "make check" without arguments, it feeds netcat_telnet_parse()
+   with fixed cases and with random streams cut at random points, and
+   compares the data and the replies with the expected ones.  It reports
+   every check that fails and then exits with a non-zero status.  With the
+   -b argument ("make bench") it measures the throughput of the parser on
+   clean data and on data made only of escaped IAC chars instead.  The old
+   telnet codes parsing policy leaves the codes in the data, so the tests
+   are skipped with it. */
+
+#define IAC 255
+#define WILL 251
+#define WONT 252
+#define DO 253
+#define DONT 254
+
+#define BLOCK 65536
+
+static int failures = 0;
+
+#ifdef DEBUG
+/* telnet.c prints its debug messages through these, which live in misc.c
+   together with the rest of the program */
+
+void ncprint(int type, const char *fmt, ...)
+{
+  (void) type;
+  (void) fmt;
+}
+
+const char *debug_fmt(const char *fmt, ...)
+{
+  return fmt;
+}
+#endif
+
+/* Feeds the `len' bytes of `in' to a fresh socket object, cut into the
+   pieces whose lengths are listed in `cuts' (the rest goes in a last
+   piece), and checks the data left and the replies collected against
+   `out' and `reply'. */
+
+static void check(const char *name, const char *in, int len, const int *cuts,
+		  const char *out, int out_len, const char *reply,
+		  int reply_len)
+{
+  nc_sock_t sock;
+  unsigned char buf[64], got[64];
+  int pos = 0, got_len = 0;
+
+  memset(&sock, 0, sizeof(sock));
+  while (pos < len) {
+    int n = ((cuts && *cuts) ? *cuts++ : len - pos);
+
+    memcpy(buf, in + pos, n);
+    pos += n;
+    netcat_telnet_parse(&sock, buf, &n);
+    memcpy(got + got_len, buf, n);
+    got_len += n;
+  }
+
+  if ((got_len != out_len) || memcmp(got, out, out_len)) {
+    fprintf(stderr, "test-telnet: %s: wrong data\n", name);
+    failures++;
+  }
+  if ((sock.telnet.reply_len != reply_len) ||
+      memcmp(sock.telnet.reply, reply, reply_len)) {
+    fprintf(stderr, "test-telnet: %s: wrong replies\n", name);
+    failures++;
+  }
+}
+
+#define CHECK(name, in, cuts, out, reply) \
+  check(name, in, sizeof(in) - 1, cuts, out, sizeof(out) - 1, reply, \
+	sizeof(reply) - 1)
+
+static void test_fixed(void)
+{
+  static const int one[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0 };
+  static const int split_iac[] = { 3, 0 }, split_will[] = { 4, 0 };
+
+  CHECK("plain", "hello", NULL, "hello", "");
+  CHECK("IAC IAC", "a\377\377b\377\377", NULL, "a\377b\377", "");
+  CHECK("IAC IAC split", "ab\377\377c", split_iac, "ab\377c", "");
+  CHECK("WILL", "a\377\373\001b", NULL, "ab", "\377\376\001");
+  CHECK("DO", "\377\375\030", NULL, "", "\377\374\030");
+  CHECK("WONT and DONT", "x\377\374\001\377\376\002y", NULL, "xy", "");
+  CHECK("unknown code", "a\377\001b\377\361c", NULL, "abc", "");
+  CHECK("code split after IAC", "ab\377\373\005c", split_iac, "abc",
+	"\377\376\005");
+  CHECK("code split before option", "ab\377\373\005c", split_will, "abc",
+	"\377\376\005");
+  CHECK("one byte at a time", "a\377\375\003\377\377\377\373\003b", one,
+	"a\377b", "\377\374\003\377\376\003");
+
+  /* an option is refused once for each side, however often it's asked */
+  CHECK("refused once", "\377\373\001\377\373\001\377\375\001\377\375\001",
+	NULL, "", "\377\376\001\377\374\001");
+  CHECK("refused once, split", "\377\373\001\377\373\001", split_will, "",
+	"\377\376\001");
+}
+
+/* Builds in `in' a random stream of `len' bytes with many telnet codes,
+   and in `out' and `reply' what the parser is expected to make of it.
+   Returns the length of the expected data, and stores in `*reply_len' the
+   length of the replies. */
+
+static int make_stream(unsigned char *in, int len, unsigned char *out,
+		       unsigned char *reply, int *reply_len)
+{
+  static const unsigned char codes[] = { WILL, WONT, DO, DONT, IAC, 240, 241,
+					 246, 250, 1, 100 };
+  unsigned char refused[2][256];
+  int pos = 0, out_len = 0;
+
+  memset(refused, 0, sizeof(refused));
+  *reply_len = 0;
+  while (pos < len) {
+    unsigned char code, opt;
+
+    if ((RAND() % 4) || (pos + 3 > len)) {
+      in[pos] = RAND() % 255;
+      out[out_len++] = in[pos++];
+      continue;
+    }
+
+    code = codes[RAND() % sizeof(codes)];
+    opt = RAND() % 8;
+    in[pos++] = IAC;
+    in[pos++] = code;
+    if (code == IAC)
+      out[out_len++] = IAC;
+    else if ((code >= WILL) && (code <= DONT)) {
+      in[pos++] = opt;
+      if (((code == WILL) || (code == DO)) && !refused[code == DO][opt]) {
+	refused[code == DO][opt] = 1;
+	reply[(*reply_len)++] = IAC;
+	reply[(*reply_len)++] = (code == WILL ? DONT : WONT);
+	reply[(*reply_len)++] = opt;
+      }
+    }
+  }
+  return out_len;
+}
+
+static void test_random(void)
+{
+  static unsigned char in[4096], out[4096], reply[64], buf[4096];
+  int round;
+
+  for (round = 0; round < 2000; round++) {
+    nc_sock_t sock;
+    int len = 1 + RAND() % sizeof(in), pos = 0, got_len = 0, out_len,
+	reply_len;
+
+    out_len = make_stream(in, len, out, reply, &reply_len);
+    memset(&sock, 0, sizeof(sock));
+    while (pos < len) {
+      int n = 1 + RAND() % (RAND() % 2 ? 4 : len - pos);
+
+      if (n > len - pos)
+	n = len - pos;
+      memcpy(buf + got_len, in + pos, n);
+      pos += n;
+      netcat_telnet_parse(&sock, buf + got_len, &n);
+      got_len += n;
+    }
+
+    if ((got_len != out_len) || memcmp(buf, out, out_len)) {
+      fprintf(stderr, "test-telnet: random stream %d: wrong data\n", round);
+      failures++;
+    }
+    if ((sock.telnet.reply_len != reply_len) ||
+	memcmp(sock.telnet.reply, reply, reply_len)) {
+      fprintf(stderr, "test-telnet: random stream %d: wrong replies\n",
+	      round);
+      failures++;
+    }
+  }
+}
+
+/* Returns the current time in seconds */
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Parses copies of the block `data' for about a second and prints the
+   throughput, counting the bytes received.  The copy made before each call
+   is timed on its own and left out. */
+
+static void bench_block(const char *name, const unsigned char *data)
+{
+  static unsigned char buf[BLOCK];
+  double start, elapsed, copy;
+  int rounds = 0, i;
+  nc_sock_t sock;
+
+  start = now();
+  for (i = 0; i < 10000; i++)
+    memcpy(buf, data, BLOCK);
+  copy = (now() - start) / 10000;
+
+  memset(&sock, 0, sizeof(sock));
+  start = now();
+  do {
+    for (i = 0; i < 100; i++, rounds++) {
+      int len = BLOCK;
+
+      memcpy(buf, data, BLOCK);
+      netcat_telnet_parse(&sock, buf, &len);
+    }
+    elapsed = now() - start;
+  } while (elapsed < 1);
+
+  elapsed -= copy * rounds;
+  printf("%-28s %8.0f MB/s\n", name,
+	 (elapsed > 0 ? rounds * (double) BLOCK / elapsed / 1e6 : 0));
+}
+
+static void bench(void)
+{
+  static unsigned char data[BLOCK];
+
+  memset(data, 'x', BLOCK);
+  bench_block("telnet, clean data:", data);
+  memset(data, IAC, BLOCK);
+  bench_block("telnet, escaped IAC only:", data);
+}
+
+int main(int argc, char *argv[])
+{
+  SRAND(1);
+  if ((argc > 1) && !strcmp(argv[1], "-b")) {
+    bench();
+    return 0;
+  }
+
+#ifdef USE_OLD_TELNET
+  return 77;				/* skipped */
+#else
+  test_fixed();
+  test_random();
+  if (failures > 0) {
+    fprintf(stderr, "test-telnet: %d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+#endif
+}
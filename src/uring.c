@@ -0,0 +1,631 @@
+/*
+ * uring.c -- io_uring data pump for the core loop
+ * Part of the GNU netcat project
+ *
+ * Author: Giovanni Giacobbi <giovanni@giacobbi.net>
+ * Copyright (C) 2002 - 2004  Giovanni Giacobbi
+ *
+ * $Id$
+ */
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netcat.h"
+
+#ifdef USE_URING
+#include <sys/mman.h>		/* mmap() */
+#include <sys/stat.h>		/* fstat() */
+#include <sys/syscall.h>	/* the io_uring system calls numbers */
+#include <linux/io_uring.h>
+
+/* The io_uring pump doesn't wait for the descriptors to become ready: it
+   queues the reads and the writes themselves, and the kernel reports when
+   they are done.  Every round of the loop submits all the new requests for
+   both directions and waits for the completions with a single system call.
+   The sockets are read with a multishot receive, which stays armed and picks
+   a free buffer from a ring that we give back to the kernel as soon as the
+   data has been written.  The same buffers are registered with the ring, so
+   the writes don't need to map them every time.
+   The system calls are made directly, so that no library is needed. */
+
+/* multishot receives appeared in Linux 6.0, older kernels refuse them */
+#ifndef IORING_RECV_MULTISHOT
+# define IORING_RECV_MULTISHOT (1U << 1)
+#endif
+
+/* Number of buffers owned by each direction (a power of two) */
+#define URING_NBUFS 16
+
+/* Size of the submission queue.  Each direction has at most a read and a
+   write in flight, the completion queue is bigger because every buffer
+   filled by a multishot receive posts its own completion. */
+#define URING_SQ_ENTRIES 8
+#define URING_CQ_ENTRIES (4 * URING_NBUFS)
+
+/* The user data of each request tells its direction and operation */
+#define URING_OP_READ 0
+#define URING_OP_WRITE 1
+#define URING_OP_CANCEL 2
+#define URING_DATA(dir, op) (((dir) << 2) | (op))
+
+/* The mapped submission and completion queues */
+
+typedef struct {
+  int fd;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, sq_local;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_len, cq_len, sqes_len;
+  bool fixed;				/* the buffers are registered */
+} uring_t;
+
+/* One direction of the pump.  The data is received in one of the buffers and
+   waits in `fifo' until it's written, one write at a time so that a short
+   write can't reorder the stream.  The free buffers of a socket source are
+   in the kernel's buffer ring `br', while for other sources (stdin) they are
+   kept in `freelist' and handed to each read. */
+
+typedef struct {
+  int src, dst;
+  bool sock, eof, reading, writing;
+  unsigned char *mem;			/* URING_NBUFS buffers of `bufsize' */
+  int bufsize, base;			/* first index in the registered table */
+  struct io_uring_buf_ring *br;
+  unsigned short br_tail;
+  int fifo_bid[URING_NBUFS], fifo_len[URING_NBUFS];
+  int fifo_head, fifo_count, wr_off;
+  int freelist[URING_NBUFS], free_count, rd_bid;
+  bool used;				/* some data was received */
+  bool sent;				/* some data was written */
+  nc_stats_t *stats;
+  const char *src_name, *dst_name;	/* for the error messages */
+} uring_dir_t;
+
+#define URING_DIR_IDLE(d) (!(d)->fifo_count && !(d)->writing)
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait,
+		 (wait ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int op, void *arg, unsigned int nr)
+{
+  return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/* Creates the ring `u' and maps its queues in memory.
+   Returns TRUE on success or FALSE on error, in which case errno is set. */
+
+static bool uring_open(uring_t *u)
+{
+  struct io_uring_params p;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_CQ_ENTRIES;
+  u->fd = uring_setup(URING_SQ_ENTRIES, &p);
+  if (u->fd < 0)
+    return FALSE;
+
+  u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* recent kernels map both the queues with a single call */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_len > u->sq_len)
+      u->sq_len = u->cq_len;
+    u->cq_len = 0;
+  }
+  u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    goto err;
+  u->cq_ring = u->sq_ring;
+  if (u->cq_len) {
+    u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED)
+      goto err;
+  }
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto err;
+
+  u->sq_head = (unsigned int *) ((char *) u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned int *) ((char *) u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned int *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned int *) ((char *) u->sq_ring + p.sq_off.array);
+  u->cq_head = (unsigned int *) ((char *) u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned int *) ((char *) u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned int *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+  u->sq_local = *u->sq_tail;
+  return TRUE;
+
+ err:
+  if (u->sq_ring && (u->sq_ring != MAP_FAILED))
+    munmap(u->sq_ring, u->sq_len);
+  if (u->cq_len && u->cq_ring && (u->cq_ring != MAP_FAILED))
+    munmap(u->cq_ring, u->cq_len);
+  close(u->fd);
+  return FALSE;
+}
+
+/* Destroys the ring `u'.  Any request still in flight is cancelled by the
+   kernel. */
+
+static void uring_close(uring_t *u)
+{
+  munmap(u->sqes, u->sqes_len);
+  if (u->cq_len)
+    munmap(u->cq_ring, u->cq_len);
+  munmap(u->sq_ring, u->sq_len);
+  close(u->fd);
+}
+
+/* Returns a cleared submission entry for a new request with `data' as user
+   data.  The entry is submitted by the next uring_submit() call. */
+
+static struct io_uring_sqe *uring_sqe(uring_t *u, unsigned long long data)
+{
+  unsigned int idx = u->sq_local & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+
+  /* the queue can't be full, since every direction has at most a read and a
+     write in flight */
+  assert(u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) <
+	 URING_SQ_ENTRIES);
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = data;
+  u->sq_array[idx] = idx;
+  u->sq_local++;
+  return sqe;
+}
+
+/* Submits the new requests and waits until at least `wait' of them complete.
+   Returns the number of requests submitted or -1 on error. */
+
+static int uring_submit(uring_t *u, unsigned int wait)
+{
+  unsigned int pending;
+
+  __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+  pending = u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  return uring_enter(u->fd, pending, wait);
+}
+
+/* Gives the buffer `bid' back to the direction `d', once its data has been
+   written (or it wasn't used at all). */
+
+static void uring_dir_release(uring_dir_t *d, int bid)
+{
+  if (d->sock) {
+    struct io_uring_buf *buf = &d->br->bufs[d->br_tail & (URING_NBUFS - 1)];
+
+    buf->addr = (unsigned long) (d->mem + bid * d->bufsize);
+    buf->len = d->bufsize;
+    buf->bid = bid;
+    d->br_tail++;
+    __atomic_store_n(&d->br->tail, d->br_tail, __ATOMIC_RELEASE);
+  }
+  else
+    d->freelist[d->free_count++] = bid;
+}
+
+/* Allocates the buffers of the direction `d' (number `dir') and, if the
+   source is a socket, registers them as the provided buffer ring of the
+   group `dir'.  Returns TRUE on success or FALSE on error. */
+
+static bool uring_dir_init(uring_t *u, uring_dir_t *d, int dir)
+{
+  int i;
+
+  d->base = dir * URING_NBUFS;
+  d->bufsize = opt_buffer_size;
+  d->mem = malloc(URING_NBUFS * d->bufsize);
+  if (!d->mem)
+    return FALSE;
+
+  if (d->sock) {
+    struct io_uring_buf_reg reg;
+
+    /* the ring must be page aligned */
+    d->br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf),
+		 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (d->br == MAP_FAILED) {
+      d->br = NULL;
+      return FALSE;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) d->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = dir;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+      return FALSE;
+  }
+
+  for (i = 0; i < URING_NBUFS; i++)
+    uring_dir_release(d, i);
+  return TRUE;
+}
+
+/* Releases the memory of the direction `d' */
+
+static void uring_dir_free(uring_dir_t *d)
+{
+  if (d->br)
+    munmap(d->br, URING_NBUFS * sizeof(struct io_uring_buf));
+  free(d->mem);
+}
+
+/* Queues the requests that the direction `d' (number `dir') needs: a read
+   if there is a free buffer, and a write if there is some data waiting. */
+
+static void uring_dir_prepare(uring_t *u, uring_dir_t *d, int dir)
+{
+  struct io_uring_sqe *sqe;
+
+  if (!d->eof && !d->reading) {
+    if (d->sock && (d->fifo_count < URING_NBUFS)) {
+      /* the kernel picks the buffers from the ring for as long as it can */
+      sqe = uring_sqe(u, URING_DATA(dir, URING_OP_READ));
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = d->src;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = dir;
+      d->reading = TRUE;
+    }
+    else if (!d->sock && (d->free_count > 0)) {
+      d->rd_bid = d->freelist[--d->free_count];
+      sqe = uring_sqe(u, URING_DATA(dir, URING_OP_READ));
+      sqe->opcode = (u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ);
+      sqe->fd = d->src;
+      sqe->addr = (unsigned long) (d->mem + d->rd_bid * d->bufsize);
+      sqe->len = d->bufsize;
+      sqe->off = (unsigned long long) -1;	/* the current position */
+      sqe->buf_index = d->base + d->rd_bid;
+      d->reading = TRUE;
+    }
+  }
+
+  if (!d->writing && (d->fifo_count > 0)) {
+    int bid = d->fifo_bid[d->fifo_head];
+
+    sqe = uring_sqe(u, URING_DATA(dir, URING_OP_WRITE));
+    sqe->opcode = (u->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE);
+    sqe->fd = d->dst;
+    sqe->addr = (unsigned long) (d->mem + bid * d->bufsize + d->wr_off);
+    sqe->len = d->fifo_len[d->fifo_head] - d->wr_off;
+    sqe->off = (unsigned long long) -1;
+    sqe->buf_index = d->base + bid;
+    d->writing = TRUE;
+  }
+}
+
+/* Handles the completion `cqe' of the operation `op' of the direction `d'.
+   Returns 0 on success, or -1 if the kernel refused a read because it
+   doesn't support it (EINVAL, multishot receives on Linux 5.19). */
+
+static int uring_dir_complete(uring_dir_t *d, struct io_uring_cqe *cqe, int op)
+{
+  int res = cqe->res;
+
+  d->stats->calls++;
+  if (op == URING_OP_WRITE) {
+    d->writing = FALSE;
+    debug_dv(("uring write(fd %d) = %d", d->dst, res));
+    if ((res == -EAGAIN) || (res == -EINTR))
+      return 0;
+    if (res < 0) {
+      errno = -res;
+      perror(d->dst_name);
+      exit(EXIT_FAILURE);
+    }
+
+    d->stats->bytes += res;		/* update statistics */
+    d->sent = (d->sent || (res > 0));
+    d->wr_off += res;
+    if (d->wr_off == d->fifo_len[d->fifo_head]) {
+      uring_dir_release(d, d->fifo_bid[d->fifo_head]);
+      d->fifo_head = (d->fifo_head + 1) % URING_NBUFS;
+      d->fifo_count--;
+      d->wr_off = 0;
+    }
+    return 0;
+  }
+
+  /* a multishot receive stays armed for as long as the kernel says so */
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    d->reading = FALSE;
+  debug_dv(("uring read(fd %d) = %d", d->src, res));
+
+  if (res > 0) {
+    int tail = (d->fifo_head + d->fifo_count) % URING_NBUFS;
+
+    d->fifo_bid[tail] = (d->sock ? (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) :
+			 d->rd_bid);
+    d->fifo_len[tail] = res;
+    d->fifo_count++;
+    d->used = TRUE;
+    return 0;
+  }
+
+  if (!d->sock)
+    uring_dir_release(d, d->rd_bid);	/* the buffer wasn't used */
+  if (res == 0) {
+    debug_v(("EOF Received from fd %d", d->src));
+    d->eof = TRUE;
+  }
+  else if (res == -EINVAL)
+    return -1;
+  else if ((res != -ENOBUFS) && (res != -EAGAIN) && (res != -EINTR)) {
+    errno = -res;
+    perror(d->src_name);
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
+
+/* Moves the data received by the direction `d' and not written yet to the
+   queue `q', which is made large enough for it.  Returns FALSE if the memory
+   couldn't be allocated. */
+
+static bool uring_dir_handover(uring_dir_t *d, nc_buffer_t *q)
+{
+  int i, len = 0;
+
+  for (i = 0; i < d->fifo_count; i++)
+    len += d->fifo_len[(d->fifo_head + i) % URING_NBUFS];
+  len -= d->wr_off;
+  if (len == 0)
+    return TRUE;
+  if (!netcat_buffer_init(q, q->len + len > opt_buffer_size ? q->len + len :
+			  opt_buffer_size))
+    return FALSE;
+
+  for (i = 0; i < d->fifo_count; i++) {
+    int slot = (d->fifo_head + i) % URING_NBUFS, off = (i ? 0 : d->wr_off);
+
+    netcat_buffer_put(q, d->mem + d->fifo_bid[slot] * d->bufsize + off,
+		      d->fifo_len[slot] - off);
+  }
+  return TRUE;
+}
+
+/* Moves the data between the main socket and the slave socket or the
+   standard I/O using io_uring.  The data is not inspected at all, so the
+   caller must not use this pump for hexdumps, telnet codes or delayed
+   output, and it works with streams only.
+   Returns 0 when the connection is over, or -1 if io_uring is not available
+   or doesn't support the needed features; in this case nothing has been
+   written yet, the input already read waits in the sending queue of
+   `nc_main', and the caller should fall back to the common loop. */
+
+int netcat_uring_readwrite(nc_sock_t *nc_main, nc_sock_t *nc_slave)
+{
+  int i, ret = 0;
+  bool eof_in = FALSE, stdio = (nc_slave->domain == PF_UNSPEC);
+  struct iovec iov[2 * URING_NBUFS];
+  struct stat st;
+  uring_t u;
+  uring_dir_t dirs[2];
+  debug_v(("netcat_uring_readwrite(nc_main=%p, nc_slave=%p)", (void *)nc_main,
+	  (void *)nc_slave));
+
+  if (!uring_open(&u)) {
+    debug_v(("io_uring_setup() failed: %s", strerror(errno)));
+    return -1;
+  }
+
+  /* the first direction goes from the net to the output, the second one
+     from the input (stdin or the slave socket) to the net */
+  memset(dirs, 0, sizeof(dirs));
+  dirs[0].src = dirs[1].dst = nc_main->fd;
+  dirs[0].dst = (stdio ? STDOUT_FILENO : nc_slave->fd);
+  dirs[1].src = (stdio ? STDIN_FILENO : nc_slave->fd);
+  dirs[0].sock = TRUE;
+  dirs[1].sock = (!stdio || ((fstat(STDIN_FILENO, &st) == 0) &&
+			     S_ISSOCK(st.st_mode)));
+  dirs[0].stats = &stats_recv;
+  dirs[1].stats = &stats_sent;
+  dirs[0].src_name = "read(net)";
+  dirs[0].dst_name = "write(stdout)";
+  dirs[1].src_name = "read(stdin)";
+  dirs[1].dst_name = "write(net)";
+  dirs[1].eof = (stdio && !use_stdin);
+
+  for (i = 0; i < 2; i++) {
+    if (!uring_dir_init(&u, &dirs[i], i)) {
+      debug_v(("io_uring buffers setup failed: %s", strerror(errno)));
+      ret = -1;
+      goto cleanup;
+    }
+  }
+
+  /* register the buffers for the fixed reads and writes.  This may fail
+     because of the locked memory limit, which isn't fatal. */
+  for (i = 0; i < 2 * URING_NBUFS; i++) {
+    uring_dir_t *d = &dirs[i / URING_NBUFS];
+
+    iov[i].iov_base = d->mem + (i % URING_NBUFS) * d->bufsize;
+    iov[i].iov_len = d->bufsize;
+  }
+  u.fixed = (uring_register(u.fd, IORING_REGISTER_BUFFERS, iov,
+			    2 * URING_NBUFS) == 0);
+  if (!u.fixed) {
+    debug_v(("io_uring buffers registration failed: %s", strerror(errno)));
+  }
+
+  ncprint(NCPRINT_VERB2, _("Moving the data with io_uring (%d buffers of %d bytes)"),
+	  2 * URING_NBUFS, opt_buffer_size);
+  signal_handler = FALSE;
+
+  while (TRUE) {
+    unsigned int head, tail;
+
+    /* if we received an interrupt signal break this function */
+    if (got_sigint) {
+      got_sigint = FALSE;
+      break;
+    }
+    /* if we received a terminating signal we must terminate */
+    if (got_sigterm)
+      break;
+
+    /* as in the copying loop, an EOF from the net (or from the input, in
+       tunnel mode or with -c) ends the loop once the data was delivered */
+    if ((dirs[0].eof && URING_DIR_IDLE(&dirs[0])) ||
+	(eof_in && URING_DIR_IDLE(&dirs[1])))
+      break;
+
+    for (i = 0; i < 2; i++)
+      uring_dir_prepare(&u, &dirs[i], i);
+
+    if ((uring_submit(&u, 1) < 0) && (errno != EINTR)) {
+      perror("io_uring_enter(core_readwrite)");
+      exit(EXIT_FAILURE);
+    }
+    stats_waits++;
+
+    head = *u.cq_head;
+    tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+      int dir = cqe->user_data >> 2, op = cqe->user_data & 3;
+
+      if (uring_dir_complete(&dirs[dir], cqe, op) < 0)
+	ret = -1;
+    }
+    __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+
+    /* falling back to the common loop is only possible if nothing was
+       received from the net or written to it yet.  The input may already
+       have been read in the same round (stdin is a pipe holding some data
+       on Linux 5.19, where the multishot receive fails), and it's handed to
+       the common loop below. */
+    if (ret < 0) {
+      if (!dirs[0].used && !dirs[1].sent && !dirs[1].writing)
+	break;
+      errno = EINVAL;
+      perror("io_uring(core_readwrite)");
+      exit(EXIT_FAILURE);
+    }
+
+    /* an EOF from stdin closes the connection only in tunnel mode or with
+       the -c switch, otherwise we just stop reading it */
+    if (dirs[1].eof && !eof_in && (use_stdin || !stdio)) {
+      if ((netcat_mode == NETCAT_TUNNEL) || opt_eofclose) {
+	debug_v(("EOF Received from stdin! (exiting from loop..)"));
+	eof_in = TRUE;
+      }
+      else {
+	debug_v(("EOF Received from stdin! (removing from lookups..)"));
+	use_stdin = FALSE;
+	if (stats_sent.bytes == 0)
+	  netcat_socket_fastopen_start(nc_main->fd);
+      }
+    }
+
+    netcat_stats_tick();
+    if (got_sigusr1) {
+      debug_v(("LOCAL printstats!"));
+      netcat_printstats(TRUE);
+      got_sigusr1 = FALSE;
+    }
+  }
+
+  /* the buffers can't be released while the kernel may still use them, so
+     cancel the requests in flight and wait for them */
+  if (dirs[0].reading || dirs[0].writing || dirs[1].reading ||
+      dirs[1].writing) {
+    struct io_uring_sqe *sqe = uring_sqe(&u, URING_DATA(0, URING_OP_CANCEL));
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    uring_submit(&u, 0);
+  }
+  while (dirs[0].reading || dirs[0].writing || dirs[1].reading ||
+	 dirs[1].writing) {
+    unsigned int head, tail;
+
+    if ((uring_submit(&u, 1) < 0) && (errno != EINTR))
+      break;
+    head = *u.cq_head;
+    tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+      uring_dir_t *d = &dirs[cqe->user_data >> 2];
+
+      /* a read may still complete with some data instead of being
+	 cancelled, which must not be lost if we fall back */
+      if (((cqe->user_data & 3) == URING_OP_READ) && (cqe->res > 0))
+	uring_dir_complete(d, cqe, URING_OP_READ);
+      else if ((cqe->user_data & 3) == URING_OP_WRITE)
+	d->writing = FALSE;
+      else if (((cqe->user_data & 3) == URING_OP_READ) &&
+	       !(cqe->flags & IORING_CQE_F_MORE))
+	d->reading = FALSE;
+    }
+    __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  if ((ret < 0) && !uring_dir_handover(&dirs[1], &nc_main->sendq))
+    ncprint(NCPRINT_ERROR | NCPRINT_EXIT,
+	    _("Couldn't allocate the data queues: %s"), strerror(errno));
+
+  if (ret == 0) {
+    /* we've got an EOF from the net, close the sockets.  If the EOF came
+       from the other side instead, the data still queued in the kernel must
+       get through. */
+    if (eof_in)
+      netcat_socket_linger_off(nc_main->fd);
+    shutdown(nc_main->fd, SHUT_RDWR);
+    close(nc_main->fd);
+    nc_main->fd = -1;
+
+    /* close the slave socket only if it wasn't a simulation */
+    if (!stdio) {
+      if (dirs[0].eof)
+	netcat_socket_linger_off(nc_slave->fd);
+      shutdown(nc_slave->fd, SHUT_RDWR);
+      close(nc_slave->fd);
+      nc_slave->fd = -1;
+    }
+  }
+  signal_handler = TRUE;
+
+ cleanup:
+  uring_close(&u);
+  for (i = 0; i < 2; i++)
+    uring_dir_free(&dirs[i]);
+  return ret;
+}
+#endif